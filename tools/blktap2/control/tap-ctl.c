@@ -702,6 +702,58 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_cache_stats_usage(FILE *stream)
+{
+	fprintf(stream, "usage: cache-stats <-p pid>\n");
+}
+
+static void
+tap_cli_cache_stat(const tapdisk_message_cache_t *cache, void *arg)
+{
+	printf("%s: reads=%"PRIu64" hits=%"PRIu64" (%.1f%%) "
+	       "misses=%"PRIu64" readahead=%"PRIu64" "
+	       "readahead-hits=%"PRIu64" (%.1f%%) evictions=%"PRIu64" "
+	       "size=%"PRIu64"\n",
+	       cache->path, cache->reads, cache->hits,
+	       cache->reads ? 100.0 * cache->hits / cache->reads : 0.0,
+	       cache->misses, cache->readaheads, cache->readahead_hits,
+	       cache->readaheads ?
+	       100.0 * cache->readahead_hits / cache->readaheads : 0.0,
+	       cache->evictions, cache->size);
+}
+
+static int
+tap_cli_cache_stats(int argc, char **argv)
+{
+	int c, pid;
+
+	pid = -1;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_cache_stats_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1)
+		goto usage;
+
+	return tap_ctl_cache_stats(pid, tap_cli_cache_stat, NULL);
+
+usage:
+	tap_cli_cache_stats_usage(stderr);
+	return EINVAL;
+}
+
 struct command commands[] = {
 	{ .name = "list",         .func = tap_cli_list          },
 	{ .name = "allocate",     .func = tap_cli_allocate      },
@@ -717,6 +769,7 @@ struct command commands[] = {
 	{ .name = "unpause",      .func = tap_cli_unpause       },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
+	{ .name = "cache-stats",  .func = tap_cli_cache_stats   },
 };
 
 #define print_commands()					\
@@ -98,4 +98,7 @@ int tap_ctl_unpause(const int id, const int minor, const char *params);
 
 int tap_ctl_blk_major(void);
 
+typedef void (*tap_ctl_cache_fn_t)(const tapdisk_message_cache_t *, void *);
+int tap_ctl_cache_stats(const int id, tap_ctl_cache_fn_t fn, void *arg);
+
 #endif
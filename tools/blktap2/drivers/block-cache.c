@@ -36,6 +36,7 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "block-cache.h"
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -45,6 +46,8 @@
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 
+#define MIN(a, b)                       ((a) <= (b) ? (a) : (b))
+
 #define RADIX_TREE_PAGE_SHIFT           12 /* 4K pages */
 #define RADIX_TREE_PAGE_SIZE            (1 << RADIX_TREE_PAGE_SHIFT)
 
@@ -54,9 +57,27 @@
 
 #define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
 
-#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
+#define BLOCK_CACHE_MAX_SIZE            (100 << 20) /* 100MB, all caches */
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
-#define BLOCK_CACHE_PAGE_IDLETIME       60
+#define BLOCK_CACHE_GC_INTERVAL         120
+
+/* sequential streams tracked per cache, and read-ahead window in sectors */
+#define BLOCK_CACHE_STREAMS             8
+#define BLOCK_CACHE_READAHEAD_MIN       BLOCK_CACHE_NODES_PER_PAGE
+#define BLOCK_CACHE_READAHEAD_MAX       (BLOCK_CACHE_NODES_PER_PAGE << 4)
+#define BLOCK_CACHE_MAX_CHUNKS          \
+	(1 + BLOCK_CACHE_READAHEAD_MAX / BLOCK_CACHE_NODES_PER_PAGE)
+
+/*
+ * Pages start on the ONCE list and move to the MANY list when hit
+ * again, so a sequential scan or unused read-ahead cannot flush pages
+ * shared by several guests.  ONCE is evicted first while it holds more
+ * than half of the cache.
+ */
+#define BLOCK_CACHE_LRU_ONCE            0
+#define BLOCK_CACHE_LRU_MANY            1
+
+#define RADIX_TREE_PAGE_READAHEAD       (1 << 0)
 
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
@@ -67,12 +88,18 @@ typedef struct radix_tree_page          radix_tree_page_t;
 typedef struct block_cache              block_cache_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
+typedef struct block_cache_stream       block_cache_stream_t;
 
 struct radix_tree_page {
 	char                           *buf;
 	size_t                          size;
 	uint64_t                        sec;
 	radix_tree_link_t              *owners[BLOCK_CACHE_NODES_PER_PAGE];
+
+	radix_tree_t                   *tree;
+	struct list_head                lru;
+	int                             list;
+	int                             flags;
 };
 
 struct radix_tree_leaf {
@@ -81,7 +108,6 @@ struct radix_tree_leaf {
 };
 
 struct radix_tree_link {
-	uint32_t                        time;
 	union {
 		radix_tree_node_t      *next;
 		radix_tree_leaf_t       leaf;
@@ -102,10 +128,17 @@ struct radix_tree {
 	block_cache_t                  *cache;
 };
 
+/*
+ * A miss reads the request, plus any read-ahead, in page-sized chunks
+ * starting at treq.sec, each into its own buffer.
+ */
 struct block_cache_request {
 	int                             err;
-	char                           *buf;
 	uint64_t                        secs;
+	uint64_t                        total;
+	size_t                          reserved;
+	uint32_t                        failed;
+	char                           *bufs[BLOCK_CACHE_MAX_CHUNKS];
 	td_request_t                    treq;
 	block_cache_t                  *cache;
 };
@@ -114,7 +147,15 @@ struct block_cache_stats {
 	uint64_t                        reads;
 	uint64_t                        hits;
 	uint64_t                        misses;
-	uint64_t                        prunes;
+	uint64_t                        readaheads;
+	uint64_t                        readahead_hits;
+	uint64_t                        evictions;
+};
+
+struct block_cache_stream {
+	uint64_t                        next;
+	uint64_t                        ahead;
+	int                             window;
 };
 
 struct block_cache {
@@ -131,9 +172,24 @@ struct block_cache {
 
 	radix_tree_t                    tree;
 
+	block_cache_stream_t            streams[BLOCK_CACHE_STREAMS];
+	int                             stream_victim;
+
 	block_cache_stats_t             stats;
+
+	struct list_head                next;
 };
 
+/* shared by all caches of this tapdisk */
+static LIST_HEAD(block_caches);
+static struct list_head block_cache_lru[2] = {
+	LIST_HEAD_INIT(block_cache_lru[BLOCK_CACHE_LRU_ONCE]),
+	LIST_HEAD_INIT(block_cache_lru[BLOCK_CACHE_LRU_MANY]),
+};
+static uint64_t block_cache_lru_size[2];
+static uint64_t block_cache_size;
+static uint64_t block_cache_reserved;
+
 static inline uint64_t
 radix_tree_calculate_size(int height)
 {
@@ -198,6 +254,7 @@ radix_tree_allocate_node(radix_tree_t *tree, int height)
 
 	node->height = height;
 	tree->nodes++;
+	block_cache_size += sizeof(radix_tree_node_t);
 
 	return node;
 }
@@ -216,11 +273,12 @@ radix_tree_free_node(radix_tree_t *tree, radix_tree_node_t *node)
 
 	free(node);
 	tree->nodes--;
+	block_cache_size -= sizeof(radix_tree_node_t);
 }
 
 static inline radix_tree_page_t *
 radix_tree_allocate_page(radix_tree_t *tree,
-			 char *buf, uint64_t sec, size_t size)
+			 char *buf, uint64_t sec, size_t size, int flags)
 {
 	radix_tree_page_t *page;
 
@@ -231,8 +289,15 @@ radix_tree_allocate_page(radix_tree_t *tree,
 	page->buf   = buf;
 	page->sec   = sec;
 	page->size  = size;
+	page->tree  = tree;
+	page->flags = flags;
+	page->list  = BLOCK_CACHE_LRU_ONCE;
 	tree->size += size;
 
+	list_add(&page->lru, &block_cache_lru[page->list]);
+	block_cache_lru_size[page->list] += size;
+	block_cache_size += size;
+
 	return page;
 }
 
@@ -245,12 +310,40 @@ radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
 		DBG("%s: ejecting sector 0x%llx\n",
 		    tree->cache->name, page->sec + i);
 
-	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
+	list_del(&page->lru);
+	block_cache_lru_size[page->list] -= page->size;
+	block_cache_size -= page->size;
+
 	tree->size -= page->size;
 	free(page->buf);
 	free(page);
 }
 
+/*
+ * a page was read: read-ahead pages count their first use, anything
+ * used again is promoted to the MANY list.
+ */
+static void
+radix_tree_touch_page(radix_tree_t *tree, radix_tree_page_t *page)
+{
+	int list;
+
+	if (page->flags & RADIX_TREE_PAGE_READAHEAD) {
+		page->flags &= ~RADIX_TREE_PAGE_READAHEAD;
+		tree->cache->stats.readahead_hits +=
+			page->size >> RADIX_TREE_NODE_SHIFT;
+		list = BLOCK_CACHE_LRU_ONCE;
+	} else
+		list = BLOCK_CACHE_LRU_MANY;
+
+	list_del(&page->lru);
+	block_cache_lru_size[page->list] -= page->size;
+
+	page->list = list;
+	list_add(&page->lru, &block_cache_lru[list]);
+	block_cache_lru_size[list] += page->size;
+}
+
 /*
  * remove a leaf and the shared radix_tree_page_t containing its buffer.
  * leaves are deleted, nodes are not; gc will reap the nodes later.
@@ -290,24 +383,21 @@ radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
 	}
 }
 
-static char *
+static radix_tree_leaf_t *
 radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
 {
 	int idx;
-	struct timeval now;
 	radix_tree_link_t *link;
 	radix_tree_node_t *node;
 
 	node = tree->root;
-	gettimeofday(&now, NULL);
 
 	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+		idx  = radix_tree_index(node, sector);
+		link = node->links + idx;
 
 		if (radix_tree_node_contains_leaves(tree, node))
-			return link->u.leaf.buf;
+			return link->u.leaf.buf ? &link->u.leaf : NULL;
 
 		if (!link->u.next)
 			return NULL;
@@ -321,17 +411,14 @@ radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
 		    radix_tree_page_t *page, off_t off)
 {
 	int idx;
-	struct timeval now;
 	radix_tree_link_t *link;
 	radix_tree_node_t *node;
 
 	node = tree->root;
-	gettimeofday(&now, NULL);
 
 	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+		idx  = radix_tree_index(node, sector);
+		link = node->links + idx;
 
 		if (radix_tree_node_contains_leaves(tree, node)) {
 			radix_tree_remove_page(tree, link->u.leaf.page);
@@ -352,13 +439,14 @@ radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
 
 static int
 radix_tree_add_leaves(radix_tree_t *tree, char *buf,
-		      uint64_t sector, uint64_t sectors)
+		      uint64_t sector, uint64_t sectors, int flags)
 {
 	int i;
 	radix_tree_page_t *page;
 
 	page = radix_tree_allocate_page(tree, buf, sector,
-					sectors << RADIX_TREE_NODE_SHIFT);
+					sectors << RADIX_TREE_NODE_SHIFT,
+					flags);
 	if (!page)
 		return -ENOMEM;
 
@@ -406,11 +494,10 @@ radix_tree_destroy(radix_tree_t *tree)
 }
 
 /*
- * returns 1 if @node is empty after pruning, 0 otherwise
+ * returns 1 if @node is empty after collection, 0 otherwise
  */
 static int
-radix_tree_prune_branch(radix_tree_t *tree,
-			radix_tree_node_t *node, uint32_t now)
+radix_tree_gc_branch(radix_tree_t *tree, radix_tree_node_t *node)
 {
 	int i, empty;
 	radix_tree_link_t *link;
@@ -422,26 +509,19 @@ radix_tree_prune_branch(radix_tree_t *tree,
 	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
 		link = node->links + i;
 
-		if (now - link->time < BLOCK_CACHE_PAGE_IDLETIME) {
-			if (radix_tree_node_contains_leaves(tree, node)) {
-				empty = 0;
-				continue;
-			}
-
-			if (radix_tree_prune_branch(tree, link->u.next, now))
-				radix_tree_clear_link(link);
-			else
+		if (radix_tree_node_contains_leaves(tree, node)) {
+			if (link->u.leaf.page)
 				empty = 0;
-
 			continue;
 		}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+		if (!link->u.next)
+			continue;
 
-		radix_tree_clear_link(link);
+		if (radix_tree_gc_branch(tree, link->u.next))
+			radix_tree_clear_link(link);
+		else
+			empty = 0;
 	}
 
 	if (empty && !radix_tree_node_is_root(tree, node))
@@ -451,24 +531,22 @@ radix_tree_prune_branch(radix_tree_t *tree,
 }
 
 /*
- * walk tree and free any node that has been idle for too long
+ * pages are evicted in LRU order as the cache fills; free the interior
+ * nodes left empty by that now and then.
  */
 static void
-radix_tree_prune(radix_tree_t *tree)
+radix_tree_gc(radix_tree_t *tree)
 {
-	struct timeval now;
+	uint32_t nodes;
 
 	if (!tree->root)
 		return;
 
-	DPRINTF("tree %s has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
-
-	gettimeofday(&now, NULL);
-	radix_tree_prune_branch(tree, tree->root, now.tv_sec);
+	nodes = tree->nodes;
+	radix_tree_gc_branch(tree, tree->root);
 
-	DPRINTF("tree %s now has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+	DPRINTF("tree %s has %"PRIu64" bytes, freed %u of %u nodes\n",
+		tree->cache->name, tree->size, nodes - tree->nodes, nodes);
 }
 
 static inline int
@@ -489,7 +567,7 @@ radix_tree_free(radix_tree_t *tree)
 }
 
 static void
-block_cache_prune_event(event_id_t id, char mode, void *private)
+block_cache_gc_event(event_id_t id, char mode, void *private)
 {
 	radix_tree_t *tree;
 	block_cache_t *cache;
@@ -497,7 +575,46 @@ block_cache_prune_event(event_id_t id, char mode, void *private)
 	cache = (block_cache_t *)private;
 	tree  = &cache->tree;
 
-	radix_tree_prune(tree);
+	radix_tree_gc(tree);
+}
+
+/*
+ * make room for @size more bytes, evicting least recently used pages of
+ * any cache.  the room stays reserved until block_cache_unreserve().
+ */
+static int
+block_cache_reserve(size_t size)
+{
+	int list;
+	radix_tree_page_t *page;
+
+	while (block_cache_size + block_cache_reserved + size >
+	       BLOCK_CACHE_MAX_SIZE) {
+		if (!list_empty(&block_cache_lru[BLOCK_CACHE_LRU_ONCE]) &&
+		    (block_cache_lru_size[BLOCK_CACHE_LRU_ONCE] >
+		     BLOCK_CACHE_MAX_SIZE / 2 ||
+		     list_empty(&block_cache_lru[BLOCK_CACHE_LRU_MANY])))
+			list = BLOCK_CACHE_LRU_ONCE;
+		else if (!list_empty(&block_cache_lru[BLOCK_CACHE_LRU_MANY]))
+			list = BLOCK_CACHE_LRU_MANY;
+		else
+			return -ENOSPC;
+
+		page = list_entry(block_cache_lru[list].prev,
+				  radix_tree_page_t, lru);
+		page->tree->cache->stats.evictions +=
+			page->size >> RADIX_TREE_NODE_SHIFT;
+		radix_tree_remove_page(page->tree, page);
+	}
+
+	block_cache_reserved += size;
+	return 0;
+}
+
+static inline void
+block_cache_unreserve(size_t size)
+{
+	block_cache_reserved -= size;
 }
 
 static inline block_cache_request_t *
@@ -548,12 +665,14 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
 							  -1, /* dummy fd */
-							  BLOCK_CACHE_PAGE_IDLETIME << 1,
-							  block_cache_prune_event,
+							  BLOCK_CACHE_GC_INTERVAL,
+							  block_cache_gc_event,
 							  cache);
 	if (cache->timeout_id < 0)
 		goto fail;
 
+	list_add_tail(&cache->next, &block_caches);
+
 	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
 		"tree: %p, height: %d\n",
 		cache->name, cache->sectors, tree, tree->height);
@@ -581,6 +700,7 @@ block_cache_close(td_driver_t *driver)
 	DPRINTF("closing cache for %s\n", cache->name);
 
 	tapdisk_server_unregister_event(cache->timeout_id);
+	list_del(&cache->next);
 	radix_tree_free(tree);
 	free(cache->name);
 
@@ -606,28 +726,102 @@ block_cache_hash(block_cache_t *cache, char *buf)
 }
 
 static void
-block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
+block_cache_hit(block_cache_t *cache, td_request_t treq,
+		radix_tree_leaf_t *leaves[])
 {
 	int i;
 	off_t off;
+	radix_tree_page_t *page;
 
 	cache->stats.hits += treq.secs;
 
-	for (i = 0; i < treq.secs; i++) {
+	for (i = 0, page = NULL; i < treq.secs; i++) {
 		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
-		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
+		    cache->name, treq.sec + i,
+		    block_cache_hash(cache, leaves[i]->buf));
 
 		off = i << RADIX_TREE_NODE_SHIFT;
-		memcpy(treq.buf + off, iov[i], RADIX_TREE_NODE_SIZE);
+		memcpy(treq.buf + off, leaves[i]->buf, RADIX_TREE_NODE_SIZE);
+
+		if (leaves[i]->page != page) {
+			page = leaves[i]->page;
+			radix_tree_touch_page(&cache->tree, page);
+		}
 	}
 
 	td_complete_request(treq, 0);
 }
 
+/*
+ * find the sequential stream @treq continues, if any, and advance it.
+ * otherwise, start tracking a new stream in place of an older one.
+ */
+static block_cache_stream_t *
+block_cache_stream(block_cache_t *cache, td_request_t treq)
+{
+	int i;
+	block_cache_stream_t *stream;
+
+	for (i = 0; i < BLOCK_CACHE_STREAMS; i++) {
+		stream = cache->streams + i;
+		if (stream->next == treq.sec && treq.sec) {
+			stream->next += treq.secs;
+			return stream;
+		}
+	}
+
+	stream = cache->streams + cache->stream_victim;
+	cache->stream_victim = (cache->stream_victim + 1) % BLOCK_CACHE_STREAMS;
+
+	stream->next   = treq.sec + treq.secs;
+	stream->ahead  = 0;
+	stream->window = 0;
+
+	return NULL;
+}
+
+/*
+ * sectors to read ahead of @treq: the stream window, doubled on every
+ * miss, but never past the end of the image or into cached sectors.
+ * misses still covered by read-ahead in flight do not read ahead again.
+ */
+static int
+block_cache_readahead(block_cache_t *cache, td_request_t treq,
+		      block_cache_stream_t *stream)
+{
+	int i, window;
+	uint64_t sec;
+
+	if (!stream)
+		return 0;
+
+	sec = treq.sec + treq.secs;
+	if (sec < stream->ahead)
+		return 0;
+
+	window = stream->window << 1;
+	if (window < BLOCK_CACHE_READAHEAD_MIN)
+		window = BLOCK_CACHE_READAHEAD_MIN;
+	if (window > BLOCK_CACHE_READAHEAD_MAX)
+		window = BLOCK_CACHE_READAHEAD_MAX;
+	stream->window = window;
+
+	if (sec + window > cache->sectors)
+		window = sec < cache->sectors ? cache->sectors - sec : 0;
+
+	for (i = 0; i < window; i++)
+		if (radix_tree_find_leaf(&cache->tree, sec + i))
+			break;
+
+	stream->ahead = sec + i;
+	return i;
+}
+
 static void
 block_cache_populate_cache(td_request_t clone, int err)
 {
-	int i;
+	int i, n, chunk, flags;
+	uint64_t sec, secs;
 	radix_tree_t *tree;
 	block_cache_t *cache;
 	block_cache_request_t *breq;
@@ -636,74 +830,123 @@ block_cache_populate_cache(td_request_t clone, int err)
 	cache       = breq->cache;
 	tree        = &cache->tree;
 	breq->secs -= clone.secs;
-	breq->err   = (breq->err ? breq->err : err);
+
+	if (err) {
+		chunk = (clone.sec - breq->treq.sec) / BLOCK_CACHE_NODES_PER_PAGE;
+		breq->failed |= 1 << chunk;
+
+		/* failed read-ahead only costs the read-ahead */
+		if (clone.sec < breq->treq.sec + breq->treq.secs)
+			breq->err = (breq->err ? breq->err : err);
+	}
 
 	if (breq->secs)
 		return;
 
-	if (breq->err) {
-		free(breq->buf);
-		goto out;
-	}
+	block_cache_unreserve(breq->reserved);
 
-	for (i = 0; i < breq->treq.secs; i++) {
-		off_t off = i << RADIX_TREE_NODE_SHIFT;
+	for (i = 0; !breq->err && i < breq->treq.secs; i += n) {
+		chunk = i / BLOCK_CACHE_NODES_PER_PAGE;
+		n     = MIN(breq->treq.secs - i, BLOCK_CACHE_NODES_PER_PAGE);
 		DBG("%s: populating sec 0x%08llx\n",
 		    cache->name, breq->treq.sec + i);
-		memcpy(breq->treq.buf + off,
-		       breq->buf + off, RADIX_TREE_NODE_SIZE);
+		memcpy(breq->treq.buf + (i << RADIX_TREE_NODE_SHIFT),
+		       breq->bufs[chunk], n << RADIX_TREE_NODE_SHIFT);
 	}
 
-	if (radix_tree_add_leaves(tree, breq->buf,
-				  breq->treq.sec, breq->treq.secs))
-		free(breq->buf);
+	for (chunk = 0; chunk < BLOCK_CACHE_MAX_CHUNKS; chunk++) {
+		if (!breq->bufs[chunk])
+			break;
+
+		sec   = breq->treq.sec + chunk * BLOCK_CACHE_NODES_PER_PAGE;
+		secs  = MIN(breq->treq.sec + breq->total - sec,
+			    BLOCK_CACHE_NODES_PER_PAGE);
+		flags = sec >= breq->treq.sec + breq->treq.secs ?
+			RADIX_TREE_PAGE_READAHEAD : 0;
+
+		if (breq->err || (breq->failed & (1 << chunk)) ||
+		    radix_tree_add_leaves(tree, breq->bufs[chunk],
+					  sec, secs, flags))
+			free(breq->bufs[chunk]);
+	}
 
-out:
 	td_complete_request(breq->treq, breq->err);
 	block_cache_put_request(cache, breq);
 }
 
 static void
-block_cache_miss(block_cache_t *cache, td_request_t treq)
+block_cache_miss(block_cache_t *cache, td_request_t treq,
+		 block_cache_stream_t *stream)
 {
-	char *buf;
+	int i, chunks;
 	size_t size;
+	uint64_t total;
 	td_request_t clone;
-	radix_tree_t *tree;
 	block_cache_request_t *breq;
 
 	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
 
-	clone = treq;
-	tree  = &cache->tree;
-	size  = treq.secs << RADIX_TREE_NODE_SHIFT;
-
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
-		goto out;
-
 	breq = block_cache_get_request(cache);
 	if (!breq)
 		goto out;
 
-	if (posix_memalign((void **)&buf, RADIX_TREE_NODE_SIZE, size)) {
-		block_cache_put_request(cache, breq);
-		goto out;
+	total = treq.secs + block_cache_readahead(cache, treq, stream);
+	size  = total << RADIX_TREE_NODE_SHIFT;
+
+	if (block_cache_reserve(size)) {
+		/* no room for the read-ahead, try without */
+		total = treq.secs;
+		size  = total << RADIX_TREE_NODE_SHIFT;
+
+		if (block_cache_reserve(size)) {
+			block_cache_put_request(cache, breq);
+			goto out;
+		}
 	}
 
-	breq->treq    = treq;
-	breq->secs    = treq.secs;
-	breq->err     = 0;
-	breq->buf     = buf;
-	breq->cache   = cache;
+	breq->treq     = treq;
+	breq->secs     = total;
+	breq->total    = total;
+	breq->reserved = size;
+	breq->err      = 0;
+	breq->failed   = 0;
+	breq->cache    = cache;
+
+	chunks = (total + BLOCK_CACHE_NODES_PER_PAGE - 1) /
+		BLOCK_CACHE_NODES_PER_PAGE;
+
+	for (i = 0; i < chunks; i++)
+		if (posix_memalign((void **)&breq->bufs[i],
+				   RADIX_TREE_NODE_SIZE,
+				   RADIX_TREE_PAGE_SIZE)) {
+			while (i--)
+				free(breq->bufs[i]);
+			block_cache_unreserve(size);
+			block_cache_put_request(cache, breq);
+			goto out;
+		}
+
+	cache->stats.readaheads += total - treq.secs;
+
+	/* no chunk can complete the request before all are issued */
+	for (i = 0; i < chunks; i++) {
+		clone         = treq;
+		clone.sec     = treq.sec + i * BLOCK_CACHE_NODES_PER_PAGE;
+		clone.secs    = MIN(treq.sec + total - clone.sec,
+				    BLOCK_CACHE_NODES_PER_PAGE);
+		clone.buf     = breq->bufs[i];
+		clone.cb      = block_cache_populate_cache;
+		clone.cb_data = breq;
+
+		td_forward_request(clone);
+	}
 
-	clone.buf     = buf;
-	clone.cb      = block_cache_populate_cache;
-	clone.cb_data = breq;
+	return;
 
 out:
-	td_forward_request(clone);
+	td_forward_request(treq);
 }
 
 static void
@@ -712,7 +955,8 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 	int i;
 	radix_tree_t *tree;
 	block_cache_t *cache;
-	char *iov[BLOCK_CACHE_NODES_PER_PAGE];
+	block_cache_stream_t *stream;
+	radix_tree_leaf_t *leaves[BLOCK_CACHE_NODES_PER_PAGE];
 
 	cache = (block_cache_t *)driver->data;
 	tree  = &cache->tree;
@@ -722,13 +966,15 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
 		return td_forward_request(treq);
 
+	stream = block_cache_stream(cache, treq);
+
 	for (i = 0; i < treq.secs; i++) {
-		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
-		if (!iov[i])
-			return block_cache_miss(cache, treq);
+		leaves[i] = radix_tree_find_leaf(tree, treq.sec + i);
+		if (!leaves[i])
+			return block_cache_miss(cache, treq, stream);
 	}
 
-	return block_cache_hit(cache, treq, iov);
+	return block_cache_hit(cache, treq, leaves);
 }
 
 static void
@@ -769,8 +1015,39 @@ block_cache_debug(td_driver_t *driver)
 	stats = &cache->stats;
 
 	WARN("BLOCK CACHE %s\n", cache->name);
-	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
-	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", "
+	     "readaheads: %"PRIu64", readahead hits: %"PRIu64", "
+	     "evictions: %"PRIu64"\n",
+	     stats->reads, stats->hits, stats->misses, stats->readaheads,
+	     stats->readahead_hits, stats->evictions);
+	WARN("size: %"PRIu64" of %"PRIu64" bytes shared by all caches\n",
+	     block_cache_size, (uint64_t)BLOCK_CACHE_MAX_SIZE);
+}
+
+int
+block_cache_for_each(block_cache_info_fn_t fn, void *arg)
+{
+	int n;
+	block_cache_t *cache;
+	block_cache_info_t info;
+
+	n = 0;
+	list_for_each_entry(cache, &block_caches, next) {
+		info.name           = cache->name;
+		info.size           = radix_tree_size(&cache->tree);
+		info.reads          = cache->stats.reads;
+		info.hits           = cache->stats.hits;
+		info.misses         = cache->stats.misses;
+		info.readaheads     = cache->stats.readaheads;
+		info.readahead_hits = cache->stats.readahead_hits;
+		info.evictions      = cache->stats.evictions;
+
+		if (fn)
+			fn(&info, arg);
+		n++;
+	}
+
+	return n;
 }
 
 struct tap_disk tapdisk_block_cache = {
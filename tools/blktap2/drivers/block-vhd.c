@@ -109,7 +109,12 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               256  /* default bitmaps cached */
+#define VHD_CACHE_SIZE_MIN           8
+#define VHD_CACHE_SIZE_MAX           65536
+
+#define VHD_PREALLOCATE_AHEAD        3    /* extra blocks for seq writes */
+#define VHD_BAT_BATCH                (1 + VHD_PREALLOCATE_AHEAD)
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
@@ -186,8 +191,9 @@ struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
 	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
+	uint32_t                  pbw_blk;     /* first blk of pending write */
+	uint32_t                  pbw_count;   /* blks in pending write */
+	uint64_t                  pbw_offset[VHD_BAT_BATCH]; /* file offsets */
 	struct vhd_request        req;         /* for writing bat table */
 	struct vhd_request        zero_req;    /* for initializing bitmaps */
 	char                     *bat_buf;
@@ -195,8 +201,9 @@ struct vhd_bat_state {
 
 struct vhd_bitmap {
 	u32                       blk;
-	u64                       seqno;       /* lru sequence number */
 	vhd_flag_t                status;
+	struct list_head          lru;         /* most recently used first */
+	struct vhd_bitmap        *hnext;       /* next in hash bucket */
 
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
@@ -226,14 +233,17 @@ struct vhd_state {
 						* (unallocated) datablock */
 
 	struct vhd_bat_state      bat;
+	u64                       seq_sec;     /* sector after last write */
 
-	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+	int                       bm_cache_size;
+	u32                       bm_hash_mask;
+	struct vhd_bitmap       **bm_hash;     /* cached bitmaps by blk */
+	struct list_head          bm_lru;      /* cached bitmaps, lru last */
 
 	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	struct vhd_bitmap       **bitmap_free;
+	struct vhd_bitmap        *bitmap_list;
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -456,14 +466,46 @@ vhd_free_bitmap_cache(struct vhd_state *s)
 	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	if (!s->bitmap_list)
+		goto out;
+
+	for (i = 0; i < s->bm_cache_size; i++) {
 		bm = s->bitmap_list + i;
 		free(bm->map);
 		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+ out:
+	free(s->bitmap_list);
+	free(s->bitmap_free);
+	free(s->bm_hash);
+	s->bitmap_list   = NULL;
+	s->bitmap_free   = NULL;
+	s->bm_hash       = NULL;
+	s->bm_free_count = 0;
+}
+
+/*
+ * TAPDISK2_VHD_BITMAP_CACHE sets the number of bitmaps cached per image,
+ * each one bitmap (512 bytes for 2MB blocks) plus its shadow copy.
+ */
+static int
+vhd_bitmap_cache_size(void)
+{
+	long size;
+	char *env, *end;
+
+	env = getenv("TAPDISK2_VHD_BITMAP_CACHE");
+	if (!env)
+		return VHD_CACHE_SIZE;
+
+	size = strtol(env, &end, 0);
+	if (*end || size < VHD_CACHE_SIZE_MIN || size > VHD_CACHE_SIZE_MAX) {
+		EPRINTF("invalid TAPDISK2_VHD_BITMAP_CACHE '%s'\n", env);
+		return VHD_CACHE_SIZE;
+	}
+
+	return size;
 }
 
 static int
@@ -472,13 +514,25 @@ vhd_initialize_bitmap_cache(struct vhd_state *s)
 	int i, err, map_size;
 	struct vhd_bitmap *bm;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	s->bm_cache_size = vhd_bitmap_cache_size();
+	for (s->bm_hash_mask = 1;
+	     s->bm_hash_mask < s->bm_cache_size; s->bm_hash_mask <<= 1)
+		;
+	s->bm_hash_mask--;
+
+	s->bitmap_list = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap));
+	s->bitmap_free = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap *));
+	s->bm_hash     = calloc(s->bm_hash_mask + 1,
+				sizeof(struct vhd_bitmap *));
+	if (!s->bitmap_list || !s->bitmap_free || !s->bm_hash) {
+		err = -ENOMEM;
+		goto fail;
+	}
 
-	s->bm_lru        = 0;
 	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	s->bm_free_count = s->bm_cache_size;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; i < s->bm_cache_size; i++) {
 		bm = s->bitmap_list + i;
 
 		err = posix_memalign((void **)&bm->map, 512, map_size);
@@ -608,6 +662,7 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 
 	s->flags  = flags;
 	s->driver = driver;
+	INIT_LIST_HEAD(&s->bm_lru);
 
 	err = vhd_initialize(s);
 	if (err)
@@ -932,8 +987,9 @@ init_bat(struct vhd_state *s)
 	s->bat.req.next   = NULL;
 	s->bat.req.error  = 0;
 	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
+	s->bat.pbw_count  = 0;
 	s->bat.status     = 0;
+	memset(s->bat.pbw_offset, 0, sizeof(s->bat.pbw_offset));
 }
 
 static inline void
@@ -954,12 +1010,26 @@ bat_locked(struct vhd_state *s)
 	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
 }
 
+/* is @blk one of the blocks the locked bat is being updated for? */
+static inline int
+bat_pending(struct vhd_state *s, uint32_t blk)
+{
+	return (bat_locked(s) && blk - s->bat.pbw_blk < s->bat.pbw_count);
+}
+
+static inline uint64_t
+bat_pending_offset(struct vhd_state *s, uint32_t blk)
+{
+	ASSERT(bat_pending(s, blk));
+	return s->bat.pbw_offset[blk - s->bat.pbw_blk];
+}
+
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
 	bm->status = 0;
+	bm->hnext  = NULL;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
 	clear_req_list(&bm->waiting);
@@ -968,17 +1038,20 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline struct vhd_bitmap **
+bitmap_bucket(struct vhd_state *s, uint32_t block)
+{
+	return s->bm_hash + (block & s->bm_hash_mask);
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	for (bm = *bitmap_bucket(s, block); bm; bm = bm->hnext)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
@@ -1030,28 +1103,37 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 	return 1;
 }
 
+static void
+uninstall_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pprev;
+
+	pprev = bitmap_bucket(s, bm->blk);
+	while (*pprev != bm)
+		pprev = &(*pprev)->hnext;
+
+	*pprev = bm->hnext;
+	list_del(&bm->lru);
+	bm->hnext = NULL;
+}
+
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	u64 seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct list_head *pos;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
-	}
+	for (pos = s->bm_lru.prev; pos != &s->bm_lru; pos = pos->prev) {
+		bm = list_entry(pos, struct vhd_bitmap, lru);
+		if (bitmap_locked(bm))
+			continue;
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
+		ASSERT(!bitmap_in_use(bm));
+		uninstall_bitmap(s, bm);
+		return bm;
 	}
 
-	return  lru;
+	return NULL;
 }
 
 static int
@@ -1076,62 +1158,33 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_del(&bm->lru);
+	list_add(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	struct vhd_bitmap **bucket = bitmap_bucket(s, bm->blk);
+
+	ASSERT(!get_bitmap(s, bm->blk));
 
-	ASSERT(0);
+	bm->hnext = *bucket;
+	*bucket   = bm;
+	list_add(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(get_bitmap(s, bm->blk) == bm);
 
-	s->bitmap[i] = NULL;
+	uninstall_bitmap(s, bm);
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
@@ -1156,7 +1209,7 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
 		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		    bat_locked(s) && !bat_pending(s, blk))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1275,8 +1328,9 @@ reserve_new_block(struct vhd_state *s, uint32_t blk)
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	s->bat.pbw_blk       = blk;
+	s->bat.pbw_count     = 1;
+	s->bat.pbw_offset[0] = s->next_db + gap;
 
 	return s->next_db;
 }
@@ -1290,16 +1344,19 @@ schedule_bat_write(struct vhd_state *s)
 	u64 offset;
 	struct vhd_request *req;
 
-	ASSERT(bat_locked(s));
-
 	req = &s->bat.req;
 	buf = s->bat.bat_buf;
 	blk = s->bat.pbw_blk;
 
+	/* all pending entries must be in the one bat sector written */
+	ASSERT(bat_locked(s));
+	ASSERT(s->bat.pbw_count && blk % 128 + s->bat.pbw_count <= 128);
+
 	init_vhd_request(s, req);
 	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
 
-	((u32 *)buf)[blk % 128] = s->bat.pbw_offset;
+	for (i = 0; i < s->bat.pbw_count; i++)
+		((u32 *)buf)[(blk + i) % 128] = s->bat.pbw_offset[i];
 
 	for (i = 0; i < 128; i++)
 		BE32_OUT(&((u32 *)buf)[i]);
@@ -1313,8 +1370,9 @@ schedule_bat_write(struct vhd_state *s)
 	aio_write(s, req, offset);
 	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	DBG(TLOG_DBG, "blk: 0x%04x, count: %u, pbwo: 0x%08"PRIx64", "
+	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_count,
+	    s->bat.pbw_offset[0], offset);
 
 	return 0;
 }
@@ -1331,7 +1389,7 @@ schedule_zero_bm_write(struct vhd_state *s,
 	offset         = vhd_sectors_to_bytes(lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
 	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.secs = (s->bat.pbw_offset[0] - lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
@@ -1353,7 +1411,7 @@ update_bat(struct vhd_state *s, uint32_t blk)
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 	
 	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
+		ASSERT(bat_pending(s, blk));
 		return 0;
 	}
 
@@ -1377,69 +1435,113 @@ update_bat(struct vhd_state *s, uint32_t blk)
 	return 0;
 }
 
+/*
+ * allocate @blk, and up to @nr_blks - 1 free blocks following it in the
+ * same bat sector, so that one bat write covers them all.  the bat write
+ * counts as a request in the transaction of each block's bitmap: writes
+ * to any of the blocks complete only once the bat points at them.
+ */
 static int
-allocate_block(struct vhd_state *s, uint32_t blk)
+allocate_block(struct vhd_state *s, uint32_t blk, uint32_t nr_blks)
 {
-	char *zeros;
 	int err, gap;
-	uint64_t offset, size;
+	uint32_t i;
+	uint64_t offset, size, next_db;
 	struct vhd_bitmap *bm;
+	struct vhd_request *req;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
 	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
+		ASSERT(bat_pending(s, blk));
 		if (s->bat.req.error)
 			return -EBUSY;
 		return 0;
 	}
 
-	gap            = 0;
-	s->bat.pbw_blk = blk;
-	offset         = vhd_sectors_to_bytes(s->next_db);
+	nr_blks = MIN(nr_blks, VHD_BAT_BATCH);
+	nr_blks = MIN(nr_blks, 128 - (blk % 128));
+	nr_blks = MIN(nr_blks, s->bat.bat.entries - blk);
 
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
-		s->next_db += gap;
-	}
+	for (i = 0; i < nr_blks; i++) {
+		if (i && bat_entry(s, blk + i) != DD_BLK_UNUSED)
+			break;
 
-	s->bat.pbw_offset = s->next_db;
+		/* empty bitmap could already be in
+		 * cache if earlier bat update failed */
+		bm = get_bitmap(s, blk + i);
+		if (!bm) {
+			/* install empty bitmap in cache */
+			err = alloc_vhd_bitmap(s, &bm, blk + i);
+			if (err && !i)
+				return err;
+			if (err)
+				break;
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+			install_bitmap(s, bm);
+		} else if (i && bitmap_in_use(bm))
+			break;
 
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(errno, "lseek failed\n");
-		return -errno;
+		lock_bitmap(bm);
 	}
 
-	size = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	err  = write(s->vhd.fd, vhd_zeros(size), size);
-	if (err != size) {
-		err = (err == -1 ? -errno : -EIO);
-		ERR(err, "write failed");
-		return err;
+	nr_blks = i;
+	next_db = s->next_db;
+	offset  = vhd_sectors_to_bytes(next_db);
+
+	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
+		err = -errno;
+		ERR(err, "lseek failed\n");
+		goto fail;
 	}
 
-	/* empty bitmap could already be in
-	 * cache if earlier bat update failed */
-	bm = get_bitmap(s, blk);
-	if (!bm) {
-		/* install empty bitmap in cache */
-		err = alloc_vhd_bitmap(s, &bm, blk);
-		if (err) 
-			return err;
+	for (i = 0; i < nr_blks; i++) {
+		/* data region of segment should begin on page boundary */
+		gap = 0;
+		if ((next_db + s->bm_secs) % s->spp)
+			gap = (s->spp - ((next_db + s->bm_secs) % s->spp));
+
+		size = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
+		err  = write(s->vhd.fd, vhd_zeros(size), size);
+		if (err != size) {
+			err = (err == -1 ? -errno : -EIO);
+			ERR(err, "write failed");
+			goto fail;
+		}
 
-		install_bitmap(s, bm);
+		s->bat.pbw_offset[i] = next_db + gap;
+		next_db += gap + s->bm_secs + s->spb;
 	}
 
+	s->bat.pbw_blk   = blk;
+	s->bat.pbw_count = nr_blks;
+
+	DBG(TLOG_DBG, "blk: 0x%04x, count: %u, pbwo: 0x%08"PRIx64"\n",
+	    blk, nr_blks, s->bat.pbw_offset[0]);
+
 	lock_bat(s);
-	lock_bitmap(bm);
+
+	for (i = 0; i < nr_blks; i++) {
+		bm  = get_bitmap(s, blk + i);
+		req = &bm->req;
+
+		init_vhd_request(s, req);
+		req->op       = VHD_OP_BAT_WRITE;
+		req->treq.sec = (uint64_t)(blk + i) * s->spb;
+		add_to_transaction(&bm->tx, req);
+	}
+
 	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
 
 	return 0;
+
+ fail:
+	for (i = 0; i < nr_blks; i++) {
+		bm = get_bitmap(s, blk + i);
+		if (!bitmap_in_use(bm))
+			unlock_bitmap(bm);
+	}
+	return err;
 }
 
 static int 
@@ -1505,15 +1607,17 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	offset = bat_entry(s, blk);
 
 	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BAT)) {
+		/* sequential writers get the next few blocks too */
 		if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-			err = allocate_block(s, blk);
+			err = allocate_block(s, blk, treq.sec == s->seq_sec ?
+					     1 + VHD_PREALLOCATE_AHEAD : 1);
 		else
 			err = update_bat(s, blk);
 
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		offset = bat_pending_offset(s, blk);
 	}
 
 	offset += s->bm_secs + sec;
@@ -1607,10 +1711,8 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	ASSERT(bm && bitmap_valid(bm) &&
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
-	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
-	}
+	if (offset == DD_BLK_UNUSED)
+		offset = bat_pending_offset(s, blk);
 	
 	offset = vhd_sectors_to_bytes(offset);
 
@@ -1820,6 +1922,7 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 		treq.sec  += clone.secs;
 		treq.secs -= clone.secs;
 		treq.buf  += vhd_sectors_to_bytes(clone.secs);
+		s->seq_sec = treq.sec;
 		continue;
 
 	fail:
@@ -1902,22 +2005,28 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 static void
 finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	struct vhd_transaction *tx = &bm->tx;
-
-	if (!bat_locked(s))
-		return;
+	int live;
+	uint32_t i;
+	struct vhd_bitmap *b;
 
-	if (s->bat.pbw_blk != bm->blk)
+	if (!bat_pending(s, bm->blk))
 		return;
 
 	if (!s->bat.req.error)
 		goto release;
 
-	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
-		goto release;
+	/* keep the bat locked until no block of the failed update is live */
+	live = 0;
+	for (i = 0; i < s->bat.pbw_count; i++) {
+		b = get_bitmap(s, s->bat.pbw_blk + i);
+		if (b && test_vhd_flag(b->tx.status, VHD_FLAG_TX_LIVE)) {
+			b->tx.closed = 1;
+			live = 1;
+		}
+	}
 
-	tx->closed = 1;
-	return;
+	if (live)
+		return;
 
  release:
 	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
@@ -1986,6 +2095,8 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 static void
 finish_bat_write(struct vhd_request *req)
 {
+	int err;
+	uint32_t i, blk, count;
 	struct vhd_bitmap *bm;
 	struct vhd_transaction *tx;
 	struct vhd_state *s = req->state;
@@ -1993,35 +2104,66 @@ finish_bat_write(struct vhd_request *req)
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	err   = req->error;
+	blk   = s->bat.pbw_blk;
+	count = s->bat.pbw_count;
+	bm    = get_bitmap(s, blk);
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
+	DBG(TLOG_DBG, "blk 0x%04x, count: %u, pbwo: 0x%08"PRIx64", err %d\n",
+	    blk, count, s->bat.pbw_offset[0], err);
 	ASSERT(bm && bitmap_valid(bm));
 	ASSERT(bat_locked(s) &&
 	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+	if (!err) {
+		for (i = 0; i < count; i++)
+			bat_entry(s, blk + i) = s->bat.pbw_offset[i];
+		s->next_db = s->bat.pbw_offset[count - 1] +
+			s->spb + s->bm_secs;
+	}
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
+		tx = &bm->tx;
+		ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+
+		if (err)
+			tx->error = err;
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
 		if (s->bat.req.tx)
-			finish_bitmap_transaction(s, bm, req->error);
+			finish_bitmap_transaction(s, bm, err);
+
+		finish_bat_transaction(s, bm);
+		return;
 	}
 
+	/*
+	 * release the bat, or on error close the transactions of all its
+	 * blocks, before completing the transactions.
+	 */
 	finish_bat_transaction(s, bm);
+
+	for (i = 0; i < count; i++) {
+		bm = get_bitmap(s, blk + i);
+		ASSERT(bm && bitmap_valid(bm));
+
+		tx = &bm->tx;
+		ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+
+		if (err)
+			tx->error = err;
+
+		tx->finished++;
+		remove_from_req_list(&tx->requests, &bm->req);
+		if (!transaction_completed(tx))
+			continue;
+
+		/* blocks allocated ahead of any write have nothing to flush */
+		if (tx->requests.head)
+			finish_data_transaction(s, bm);
+		else
+			finish_bitmap_transaction(s, bm, 0);
+	}
 }
 
 static void
@@ -2240,6 +2382,7 @@ void
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2261,16 +2404,13 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: (%d total)\n", s->bm_cache_size);
+	i = 0;
+	list_for_each_entry(bm, &s->bm_lru, lru) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
-			continue;
-
 		tx = &bm->tx;
 		r = bm->queue.head;
 		while (r) {
@@ -2296,11 +2436,12 @@ vhd_debug(td_driver_t *driver)
 		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
 		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
+		i++;
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
+	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, pbw_count: %u, "
 	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	    s->bat.pbw_count, s->bat.pbw_offset[0], s->bat.req.tx);
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
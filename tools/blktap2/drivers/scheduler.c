@@ -29,7 +29,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 
 #include "scheduler.h"
 #include "tapdisk-log.h"
@@ -49,6 +51,7 @@
 
 typedef struct event {
 	char                         mode;
+	char                         pending;
 	event_id_t                   id;
 
 	int                          fd;
@@ -59,47 +62,126 @@ typedef struct event {
 	void                        *private;
 
 	struct list_head             next;
+	struct list_head             fd_next;
+	struct list_head             timer_next;
+	struct list_head             ready_next;
 } event_t;
 
+/* All events registered on one fd, which epoll knows only once. */
+struct scheduler_fd {
+	int                          fd;
+	uint32_t                     mask;
+	struct list_head             events;
+};
+
+static uint32_t
+scheduler_epoll_mask(struct scheduler_fd *sfd)
+{
+	uint32_t mask = 0;
+	event_t *event;
+
+	list_for_each_entry(event, &sfd->events, fd_next) {
+		if (event->mode & SCHEDULER_POLL_READ_FD)
+			mask |= EPOLLIN;
+		if (event->mode & SCHEDULER_POLL_WRITE_FD)
+			mask |= EPOLLOUT;
+		if (event->mode & SCHEDULER_POLL_EXCEPT_FD)
+			mask |= EPOLLPRI;
+		if (event->mode & SCHEDULER_POLL_EDGE)
+			mask |= EPOLLET;
+	}
+
+	return mask;
+}
+
+static int
+scheduler_update_fd(scheduler_t *s, struct scheduler_fd *sfd)
+{
+	struct epoll_event ev;
+	uint32_t mask;
+	int op, err;
+
+	mask = scheduler_epoll_mask(sfd);
+	if (mask == sfd->mask)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events  = mask;
+	ev.data.fd = sfd->fd;
+
+	if (!mask)
+		op = EPOLL_CTL_DEL;
+	else if (!sfd->mask)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	err = epoll_ctl(s->epoll_fd, op, sfd->fd, &ev);
+	/* The fd may already have been closed, which removed it from epoll. */
+	if (err && op != EPOLL_CTL_DEL)
+		return -errno;
+
+	sfd->mask = mask;
+	return 0;
+}
+
+static struct scheduler_fd *
+scheduler_get_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd *sfd, **fds;
+	int nr;
+
+	if (fd >= s->nr_fds) {
+		nr  = MAX(fd + 1, 2 * s->nr_fds);
+		fds = realloc(s->fds, nr * sizeof(*fds));
+		if (!fds)
+			return NULL;
+		memset(fds + s->nr_fds, 0, (nr - s->nr_fds) * sizeof(*fds));
+		s->fds    = fds;
+		s->nr_fds = nr;
+	}
+
+	sfd = s->fds[fd];
+	if (!sfd) {
+		sfd = calloc(1, sizeof(*sfd));
+		if (!sfd)
+			return NULL;
+		sfd->fd = fd;
+		INIT_LIST_HEAD(&sfd->events);
+		s->fds[fd] = sfd;
+	}
+
+	return sfd;
+}
+
+static void
+scheduler_put_fd(scheduler_t *s, struct scheduler_fd *sfd)
+{
+	scheduler_update_fd(s, sfd);
+
+	if (list_empty(&sfd->events)) {
+		s->fds[sfd->fd] = NULL;
+		free(sfd);
+	}
+}
+
 static void
 scheduler_prepare_events(scheduler_t *s)
 {
 	int diff;
 	struct timeval now;
-	event_t *event, *tmp;
-
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	event_t *event;
 
-	s->max_fd  = 0;
 	s->timeout = SCHEDULER_MAX_TIMEOUT;
 
 	gettimeofday(&now, NULL);
 
-	scheduler_for_each_event(s, event, tmp) {
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
-
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
-
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
-
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
-		}
+	list_for_each_entry(event, &s->timers, timer_next) {
+		diff = event->deadline - now.tv_sec;
+		if (diff > 0)
+			s->timeout = MIN(s->timeout, diff);
+		else
+			s->timeout = 0;
 	}
 
 	s->timeout = MIN(s->timeout, s->max_timeout);
@@ -118,45 +200,71 @@ scheduler_event_callback(event_t *event, char mode)
 }
 
 static void
-scheduler_run_events(scheduler_t *s)
+scheduler_queue_event(scheduler_t *s, event_t *event, char mode)
 {
-	struct timeval now;
-	event_t *event, *tmp;
+	if (event->pending)
+		return;
 
-	gettimeofday(&now, NULL);
+	event->pending = mode;
+	list_add_tail(&event->ready_next, &s->ready);
+}
+
+/*
+ * Queue the events of a ready fd.  As with select(), errors and hangups
+ * make an fd readable and writable, and each event gets one callback.
+ */
+static void
+scheduler_queue_fd(scheduler_t *s, int fd, uint32_t revents)
+{
+	struct scheduler_fd *sfd;
+	event_t *event;
 
- again:
-	s->restart = 0;
+	if (fd >= s->nr_fds || !(sfd = s->fds[fd]))
+		return;
 
-	scheduler_for_each_event(s, event, tmp) {
+	list_for_each_entry(event, &sfd->events, fd_next) {
 		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_READ_FD);
-			goto next;
-		}
-
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_WRITE_FD);
-			goto next;
-		}
+		    (revents & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+			scheduler_queue_event(s, event,
+					      SCHEDULER_POLL_READ_FD);
+		else if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
+			 (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+			scheduler_queue_event(s, event,
+					      SCHEDULER_POLL_WRITE_FD);
+		else if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
+			 (revents & EPOLLPRI))
+			scheduler_queue_event(s, event,
+					      SCHEDULER_POLL_EXCEPT_FD);
+	}
+}
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_EXCEPT_FD);
-			goto next;
-		}
+static void
+scheduler_run_events(scheduler_t *s, struct epoll_event *ready, int n)
+{
+	struct timeval now;
+	event_t *event;
+	char mode;
+	int i;
 
-		if ((event->mode & SCHEDULER_POLL_TIMEOUT) &&
-		    (event->deadline <= now.tv_sec))
-		    scheduler_event_callback(event, SCHEDULER_POLL_TIMEOUT);
+	gettimeofday(&now, NULL);
 
-	next:
-		if (s->restart)
-			goto again;
+	for (i = 0; i < n; i++)
+		scheduler_queue_fd(s, ready[i].data.fd, ready[i].events);
+
+	list_for_each_entry(event, &s->timers, timer_next)
+		if (event->deadline <= now.tv_sec)
+			scheduler_queue_event(s, event, SCHEDULER_POLL_TIMEOUT);
+
+	/*
+	 * Callbacks may register and unregister events: unregistering
+	 * takes an event off the ready list, and new ones are not on it.
+	 */
+	while (!list_empty(&s->ready)) {
+		event = list_entry(s->ready.next, event_t, ready_next);
+		list_del_init(&event->ready_next);
+		mode = event->pending;
+		event->pending = 0;
+		scheduler_event_callback(event, mode);
 	}
 }
 
@@ -164,8 +272,10 @@ int
 scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 int timeout, event_cb_t cb, void *private)
 {
+	struct scheduler_fd *sfd = NULL;
 	event_t *event;
 	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -173,6 +283,9 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!(mode & SCHEDULER_POLL_TIMEOUT) && !(mode & SCHEDULER_POLL_FD))
 		return -EINVAL;
 
+	if ((mode & SCHEDULER_POLL_FD) && fd < 0)
+		return -EINVAL;
+
 	event = calloc(1, sizeof(event_t));
 	if (!event)
 		return -ENOMEM;
@@ -180,6 +293,9 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	gettimeofday(&now, NULL);
 
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->fd_next);
+	INIT_LIST_HEAD(&event->timer_next);
+	INIT_LIST_HEAD(&event->ready_next);
 
 	event->mode     = mode;
 	event->fd       = fd;
@@ -187,7 +303,28 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	event->deadline = now.tv_sec + timeout;
 	event->cb       = cb;
 	event->private  = private;
-	event->id       = s->uuid++;
+
+	if (mode & SCHEDULER_POLL_FD) {
+		sfd = scheduler_get_fd(s, fd);
+		if (!sfd) {
+			free(event);
+			return -ENOMEM;
+		}
+
+		list_add_tail(&event->fd_next, &sfd->events);
+		err = scheduler_update_fd(s, sfd);
+		if (err) {
+			list_del(&event->fd_next);
+			scheduler_put_fd(s, sfd);
+			free(event);
+			return err;
+		}
+	}
+
+	if (mode & SCHEDULER_POLL_TIMEOUT)
+		list_add_tail(&event->timer_next, &s->timers);
+
+	event->id = s->uuid++;
 
 	if (!s->uuid)
 		s->uuid++;
@@ -208,8 +345,13 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 	scheduler_for_each_event(s, event, tmp)
 		if (event->id == id) {
 			list_del(&event->next);
+			list_del(&event->timer_next);
+			list_del(&event->ready_next);
+			if (event->mode & SCHEDULER_POLL_FD) {
+				list_del(&event->fd_next);
+				scheduler_put_fd(s, s->fds[event->fd]);
+			}
 			free(event);
-			s->restart = 1;
 			break;
 		}
 }
@@ -225,41 +367,59 @@ int
 scheduler_wait_for_events(scheduler_t *s)
 {
 	int ret;
-	struct timeval tv;
+	struct epoll_event ready[SCHEDULER_MAX_READY];
 
 	scheduler_prepare_events(s);
 
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
-
 	DBG("timeout: %d, max_timeout: %d\n",
 	    s->timeout, s->max_timeout);
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
+	ret = epoll_wait(s->epoll_fd, ready, SCHEDULER_MAX_READY,
+			 s->timeout * 1000);
 
-	s->restart     = 0;
 	s->timeout     = SCHEDULER_MAX_TIMEOUT;
 	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
 	if (ret < 0)
 		return ret;
 
-	scheduler_run_events(s);
+	scheduler_run_events(s, ready, ret);
 
 	return ret;
 }
 
-void
+int
 scheduler_initialize(scheduler_t *s)
 {
 	memset(s, 0, sizeof(scheduler_t));
 
 	s->uuid = 1;
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
-
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->timers);
+	INIT_LIST_HEAD(&s->ready);
+
+	s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epoll_fd < 0)
+		return -errno;
+
+	return 0;
+}
+
+void
+scheduler_destroy(scheduler_t *s)
+{
+	event_t *event, *tmp;
+
+	scheduler_for_each_event(s, event, tmp)
+		scheduler_unregister_event(s, event->id);
+
+	free(s->fds);
+	s->fds    = NULL;
+	s->nr_fds = 0;
+
+	if (s->epoll_fd >= 0) {
+		close(s->epoll_fd);
+		s->epoll_fd = -1;
+	}
 }
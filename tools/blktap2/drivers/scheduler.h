@@ -36,30 +36,41 @@
 #define SCHEDULER_POLL_WRITE_FD      0x2
 #define SCHEDULER_POLL_EXCEPT_FD     0x4
 #define SCHEDULER_POLL_TIMEOUT       0x8
+/*
+ * Edge-triggered: the callback runs once per change of the fd's state and
+ * must consume everything available (e.g. an eventfd need not be read).
+ */
+#define SCHEDULER_POLL_EDGE          0x10
+
+#define SCHEDULER_MAX_READY          64
 
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct scheduler_fd;
+
 typedef struct scheduler {
-	fd_set                       read_fds;
-	fd_set                       write_fds;
-	fd_set                       except_fds;
+	int                          epoll_fd;
+
+	struct scheduler_fd        **fds;     /* indexed by fd */
+	int                          nr_fds;
 
 	struct list_head             events;
+	struct list_head             timers;  /* events with a timeout */
+	struct list_head             ready;   /* events to run callbacks for */
 
 	int                          uuid;
-	int                          max_fd;
 	int                          timeout;
-	int                          restart;
 	int                          max_timeout;
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+int scheduler_initialize(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
 void scheduler_unregister_event(scheduler_t *,  event_id_t);
 void scheduler_set_max_timeout(scheduler_t *, int);
 int scheduler_wait_for_events(scheduler_t *);
+void scheduler_destroy(scheduler_t *);
 
 #endif
@@ -47,6 +47,7 @@
 #include "tapdisk-server.h"
 #include "tapdisk-message.h"
 #include "tapdisk-disktype.h"
+#include "block-cache.h"
 
 struct tapdisk_control {
 	char              *path;
@@ -291,6 +292,71 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 	tapdisk_control_close_connection(connection);
 }
 
+struct tapdisk_control_cache_walk {
+	struct tapdisk_control_connection *connection;
+	uint16_t           cookie;
+	int                count;
+};
+
+/* the cache stats must not change the size of the message */
+typedef char tapdisk_message_cache_fits[
+	sizeof(tapdisk_message_cache_t) <= sizeof(tapdisk_message_params_t) ?
+	1 : -1];
+
+static void
+tapdisk_control_cache_stat(const block_cache_info_t *info, void *private)
+{
+	struct tapdisk_control_cache_walk *walk = private;
+	tapdisk_message_t response;
+	const char *name;
+	size_t len;
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_CACHE_STATS_RSP;
+	response.cookie = walk->cookie;
+
+	response.u.cache.count          = walk->count--;
+	response.u.cache.size           = info->size;
+	response.u.cache.reads          = info->reads;
+	response.u.cache.hits           = info->hits;
+	response.u.cache.misses         = info->misses;
+	response.u.cache.readaheads     = info->readaheads;
+	response.u.cache.readahead_hits = info->readahead_hits;
+	response.u.cache.evictions      = info->evictions;
+
+	/* keep the end of overlong paths, where the image names differ */
+	name = info->name;
+	len  = strlen(name);
+	if (len >= sizeof(response.u.cache.path))
+		name += len - sizeof(response.u.cache.path) + 1;
+	snprintf(response.u.cache.path, sizeof(response.u.cache.path),
+		 "%s", name);
+
+	tapdisk_control_write_message(walk->connection->socket, &response, 2);
+}
+
+static void
+tapdisk_control_cache_stats(struct tapdisk_control_connection *connection,
+			    tapdisk_message_t *request)
+{
+	tapdisk_message_t response;
+	struct tapdisk_control_cache_walk walk;
+
+	walk.connection = connection;
+	walk.cookie     = request->cookie;
+	walk.count      = block_cache_for_each(NULL, NULL);
+
+	block_cache_for_each(tapdisk_control_cache_stat, &walk);
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_CACHE_STATS_RSP;
+	response.cookie = request->cookie;
+	response.u.cache.count = 0;
+
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
 static void
 tapdisk_control_get_pid(struct tapdisk_control_connection *connection,
 			tapdisk_message_t *request)
@@ -664,6 +730,8 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 		return tapdisk_control_resume_vbd(connection, &message);
 	case TAPDISK_MESSAGE_CLOSE:
 		return tapdisk_control_close_image(connection, &message);
+	case TAPDISK_MESSAGE_CACHE_STATS:
+		return tapdisk_control_cache_stats(connection, &message);
 	default: {
 		tapdisk_message_t response;
 	fail:
@@ -28,8 +28,12 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <libaio.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
@@ -44,6 +48,13 @@
 #include "libaio-compat.h"
 #include "atomicio.h"
 
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define TAPDISK_IO_URING
+#endif
+#endif
+
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
@@ -262,9 +273,9 @@ tapdisk_rwio_submit(struct tqueue *queue)
 
 static const struct tio td_tio_rwio = {
 	.name        = "rwio",
-	.data_size   = 0,
-	.tio_setup   = NULL,
-	.tio_destroy = NULL,
+	.data_size   = sizeof(struct rwio),
+	.tio_setup   = tapdisk_rwio_setup,
+	.tio_destroy = tapdisk_rwio_destroy,
 	.tio_submit  = tapdisk_rwio_submit
 };
 
@@ -428,16 +439,6 @@ tapdisk_lio_set_eventfd(struct tqueue *queue, int n, struct iocb **iocbs)
 			__io_set_eventfd(iocbs[i], lio->event_fd);
 }
 
-static void
-tapdisk_lio_ack_event(struct tqueue *queue)
-{
-	struct lio *lio = queue->tio_data;
-	uint64_t val;
-
-	if (lio->flags & LIO_FLAG_EVENTFD)
-		read_exact(lio->event_fd, &val, sizeof(val));
-}
-
 static void
 tapdisk_lio_event(event_id_t id, char mode, void *private)
 {
@@ -448,8 +449,6 @@ tapdisk_lio_event(event_id_t id, char mode, void *private)
 	struct tiocb *tiocb;
 	struct io_event *ep;
 
-	tapdisk_lio_ack_event(queue);
-
 	lio   = queue->tio_data;
 	ret   = io_getevents(lio->aio_ctx, 0,
 			     queue->size, lio->aio_events, NULL);
@@ -483,8 +482,14 @@ tapdisk_lio_setup(struct tqueue *queue, int qlen)
 	if (err)
 		goto fail;
 
+	/*
+	 * The eventfd is edge-triggered: io_getevents() below reaps all
+	 * completions, so its counter never needs to be read back.
+	 */
 	lio->event_id =
-		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD |
+					      (lio->flags & LIO_FLAG_EVENTFD ?
+					       SCHEDULER_POLL_EDGE : 0),
 					      lio->event_fd, 0,
 					      tapdisk_lio_event,
 					      queue);
@@ -547,6 +552,434 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+/*
+ * io_uring
+ *
+ * Like lio, but merged iocbs are written straight into the submission
+ * ring and reaped from the completion ring in batches, with a single
+ * io_uring_enter() per submission and none per completion.  Reads and
+ * writes to buffers registered through tapdisk_queue_register_buffer
+ * (the blkif data pages) use the fixed-buffer opcodes, which saves the
+ * kernel pinning and unpinning the pages for every request.
+ *
+ * Requires kernel 5.6 or later for IORING_OP_READ/WRITE.
+ */
+
+#ifdef TAPDISK_IO_URING
+
+#define URING_MAX_BUFS          16
+
+struct uring {
+	int                  ring_fd;
+	int                  event_id;
+
+	void                *ring;
+	size_t               ring_sz;
+	struct io_uring_sqe *sqes;
+	size_t               sqes_sz;
+
+	unsigned            *sq_head;
+	unsigned            *sq_tail;
+	unsigned             sq_mask;
+	unsigned            *sq_array;
+
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned             cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct io_event     *aio_events;
+
+	/* buffers wanted, and those currently registered with the ring */
+	struct iovec         bufs[URING_MAX_BUFS];
+	int                  nr_bufs;
+	struct iovec         reg[URING_MAX_BUFS];
+	int                  nr_reg;
+
+	int                  flags;
+};
+
+#define URING_FLAG_BUFS_DIRTY   (1<<0)
+#define URING_FLAG_NO_FIXED     (1<<1)
+
+static inline int
+__uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__uring_enter(int fd, unsigned to_submit)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static inline int
+__uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (!uring)
+		return;
+
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
+	}
+
+	if (uring->sqes) {
+		munmap(uring->sqes, uring->sqes_sz);
+		uring->sqes = NULL;
+	}
+
+	if (uring->ring) {
+		munmap(uring->ring, uring->ring_sz);
+		uring->ring = NULL;
+	}
+
+	/* closing the ring drops any registered buffers with it */
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+		uring->ring_fd = -1;
+	}
+
+	free(uring->aio_events);
+	uring->aio_events = NULL;
+}
+
+/*
+ * Bring the registered buffer table in line with the wanted one.  Only
+ * done while nothing is in flight, so no request can still refer to a
+ * table slot being replaced.
+ */
+static void
+tapdisk_uring_update_buffers(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int err;
+
+	if (!(uring->flags & URING_FLAG_BUFS_DIRTY) || queue->iocbs_pending)
+		return;
+
+	uring->flags &= ~URING_FLAG_BUFS_DIRTY;
+
+	if (uring->nr_reg) {
+		__uring_register(uring->ring_fd,
+				 IORING_UNREGISTER_BUFFERS, NULL, 0);
+		uring->nr_reg = 0;
+	}
+
+	if (!uring->nr_bufs || (uring->flags & URING_FLAG_NO_FIXED))
+		return;
+
+	memcpy(uring->reg, uring->bufs, uring->nr_bufs * sizeof(struct iovec));
+
+	err = __uring_register(uring->ring_fd, IORING_REGISTER_BUFFERS,
+			       uring->reg, uring->nr_bufs);
+	if (err) {
+		/* e.g. foreign mappings which cannot be pinned */
+		DPRINTF("Couldn't register I/O buffers with io_uring: %d, "
+			"using unregistered I/O\n", -errno);
+		uring->flags |= URING_FLAG_NO_FIXED;
+		return;
+	}
+
+	uring->nr_reg = uring->nr_bufs;
+}
+
+static int
+tapdisk_uring_register_buf(struct tqueue *queue, void *base, size_t size)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (uring->nr_bufs == URING_MAX_BUFS)
+		return -ENOSPC;
+
+	uring->bufs[uring->nr_bufs].iov_base = base;
+	uring->bufs[uring->nr_bufs].iov_len  = size;
+	uring->nr_bufs++;
+
+	uring->flags |= URING_FLAG_BUFS_DIRTY;
+
+	return 0;
+}
+
+static void
+tapdisk_uring_unregister_buf(struct tqueue *queue, void *base)
+{
+	struct uring *uring = queue->tio_data;
+	int i;
+
+	/* the kernel copied the table, so stale slots can just be hidden */
+	for (i = 0; i < uring->nr_reg; i++)
+		if (uring->reg[i].iov_base == base)
+			uring->reg[i].iov_len = 0;
+
+	for (i = 0; i < uring->nr_bufs; i++)
+		if (uring->bufs[i].iov_base == base) {
+			uring->bufs[i] = uring->bufs[--uring->nr_bufs];
+			uring->flags |= URING_FLAG_BUFS_DIRTY;
+			break;
+		}
+}
+
+static int
+tapdisk_uring_lookup_buf(struct uring *uring, const struct iocb *iocb)
+{
+	char *buf = iocb->u.c.buf;
+	int i;
+
+	for (i = 0; i < uring->nr_reg; i++) {
+		char *base = uring->reg[i].iov_base;
+
+		if (buf >= base &&
+		    buf + iocb->u.c.nbytes <= base + uring->reg[i].iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *uring;
+	int i, ret, split;
+	unsigned head, tail;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+	struct io_uring_cqe *cqe;
+
+	uring = queue->tio_data;
+	head  = *uring->cq_head;
+	tail  = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (ret = 0; head != tail && ret < queue->size; head++, ret++) {
+		cqe     = &uring->cqes[head & uring->cq_mask];
+		ep      = uring->aio_events + ret;
+		ep->obj = (struct iocb *)(uintptr_t)cqe->user_data;
+		ep->res = cqe->res;
+	}
+
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+	split = io_split(&queue->opioctx, uring->aio_events, ret);
+	tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static int
+tapdisk_uring_map(struct uring *uring, struct io_uring_params *p)
+{
+	void *ring;
+
+	uring->ring_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	if (uring->ring_sz < p->cq_off.cqes +
+	    p->cq_entries * sizeof(struct io_uring_cqe))
+		uring->ring_sz = p->cq_off.cqes +
+			p->cq_entries * sizeof(struct io_uring_cqe);
+
+	ring = mmap(0, uring->ring_sz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+		    IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		return -errno;
+	uring->ring = ring;
+
+	uring->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(0, uring->sqes_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+			   IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		return -errno;
+	}
+
+	uring->sq_head  = ring + p->sq_off.head;
+	uring->sq_tail  = ring + p->sq_off.tail;
+	uring->sq_mask  = *(unsigned *)(ring + p->sq_off.ring_mask);
+	uring->sq_array = ring + p->sq_off.array;
+
+	uring->cq_head  = ring + p->cq_off.head;
+	uring->cq_tail  = ring + p->cq_off.tail;
+	uring->cq_mask  = *(unsigned *)(ring + p->cq_off.ring_mask);
+	uring->cqes     = ring + p->cq_off.cqes;
+
+	return 0;
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params p;
+	int err;
+
+	uring->ring_fd  = -1;
+	uring->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+
+	uring->ring_fd = __uring_setup(qlen, &p);
+	if (uring->ring_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	/*
+	 * The completion ring is twice the size of the submission ring,
+	 * which is at least qlen, and no more than qlen requests are ever
+	 * in flight, so completions cannot overflow.  We also rely on
+	 * both rings sharing one mapping.
+	 */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_RW_CUR_POS)) {
+		err = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	err = tapdisk_uring_map(uring, &p);
+	if (err)
+		goto fail;
+
+	/* the ring fd polls readable while completions are waiting */
+	uring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      uring->ring_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = uring->event_id;
+	if (err < 0)
+		goto fail;
+
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static void
+tapdisk_uring_prep(struct uring *uring, struct io_uring_sqe *sqe,
+		   struct iocb *iocb)
+{
+	int write = iocb->aio_lio_opcode == IO_CMD_PWRITE;
+	int idx   = tapdisk_uring_lookup_buf(uring, iocb);
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	if (idx >= 0) {
+		sqe->opcode    = write ? IORING_OP_WRITE_FIXED :
+					 IORING_OP_READ_FIXED;
+		sqe->buf_index = idx;
+	} else
+		sqe->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	sqe->fd        = iocb->aio_fildes;
+	sqe->addr      = (uintptr_t)iocb->u.c.buf;
+	sqe->len       = iocb->u.c.nbytes;
+	sqe->off       = iocb->u.c.offset;
+	sqe->user_data = (uintptr_t)iocb;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, merged, submitted, err = 0;
+	unsigned head, tail;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_uring_update_buffers(queue);
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	/*
+	 * Without SQPOLL the kernel consumes the whole submission ring
+	 * in io_uring_enter(), so it is empty here and has room for at
+	 * least queue->size entries.
+	 */
+	tail = *uring->sq_tail;
+	for (i = 0; i < merged; i++, tail++) {
+		unsigned idx = tail & uring->sq_mask;
+
+		tapdisk_uring_prep(uring, &uring->sqes[idx], queue->iocbs[i]);
+		uring->sq_array[idx] = idx;
+	}
+	__atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	do {
+		err = __uring_enter(uring->ring_fd, merged);
+	} while (err < 0 && errno == EINTR);
+	err = err < 0 ? -errno : 0;
+
+	/*
+	 * Entries the kernel did not consume (e.g. -EAGAIN) are pulled
+	 * back off the ring and failed like a short io_submit().
+	 */
+	head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	submitted = merged - (tail - head);
+	if (head != tail) {
+		__atomic_store_n(uring->sq_tail, head, __ATOMIC_RELEASE);
+		if (!err)
+			err = -EIO;
+	}
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static const struct tio td_tio_uring = {
+	.name               = "uring",
+	.data_size          = sizeof(struct uring),
+	.tio_setup          = tapdisk_uring_setup,
+	.tio_destroy        = tapdisk_uring_destroy,
+	.tio_submit         = tapdisk_uring_submit,
+	.tio_register_buf   = tapdisk_uring_register_buf,
+	.tio_unregister_buf = tapdisk_uring_unregister_buf,
+};
+
+#endif /* TAPDISK_IO_URING */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +1008,14 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+	case TIO_DRV_URING:
+#ifdef TAPDISK_IO_URING
+		tio = &td_tio_uring;
+		break;
+#else
+		err = -EOPNOTSUPP;
+		goto fail;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -639,6 +1080,19 @@ tapdisk_init_queue(struct tqueue *queue, int size,
 	return err;
 }
 
+int
+tapdisk_queue_driver(const char *name)
+{
+	if (!strcmp(name, "lio"))
+		return TIO_DRV_LIO;
+	if (!strcmp(name, "rwio"))
+		return TIO_DRV_RWIO;
+	if (!strcmp(name, "uring"))
+		return TIO_DRV_URING;
+
+	return -EINVAL;
+}
+
 void
 tapdisk_free_queue(struct tqueue *queue)
 {
@@ -690,6 +1144,26 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 	tiocb->next = NULL;
 }
 
+/*
+ * Buffers are registered only as a hint: drivers which cannot use them
+ * ignore them, and I/O to unregistered memory is always fine.
+ */
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *base, size_t size)
+{
+	if (!queue->tio || !queue->tio->tio_register_buf)
+		return 0;
+
+	return queue->tio->tio_register_buf(queue, base, size);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *base)
+{
+	if (queue->tio && queue->tio->tio_unregister_buf)
+		queue->tio->tio_unregister_buf(queue, base);
+}
+
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
@@ -101,6 +101,18 @@ tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
 }
 
+int
+tapdisk_server_register_buffer(void *base, size_t size)
+{
+	return tapdisk_queue_register_buffer(&server.aio_queue, base, size);
+}
+
+void
+tapdisk_server_unregister_buffer(void *base)
+{
+	tapdisk_queue_unregister_buffer(&server.aio_queue, base);
+}
+
 void
 tapdisk_server_debug(void)
 {
@@ -205,11 +217,36 @@ tapdisk_server_stop_vbds(void)
 		tapdisk_vbd_kill_queue(vbd);
 }
 
+/*
+ * The I/O queue driver defaults to libaio and can be overridden with
+ * TAPDISK2_TIO=lio|rwio|uring.  io_uring falls back to libaio where the
+ * kernel lacks it.
+ */
 static int
 tapdisk_server_init_aio(void)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	const char *name;
+	int drv, err;
+
+	drv  = TIO_DRV_LIO;
+	name = getenv("TAPDISK2_TIO");
+	if (name) {
+		drv = tapdisk_queue_driver(name);
+		if (drv < 0) {
+			EPRINTF("unknown I/O queue driver '%s'\n", name);
+			drv = TIO_DRV_LIO;
+		}
+	}
+
+	err = tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS, drv, NULL);
+	if (err && drv == TIO_DRV_URING) {
+		DPRINTF("io_uring unavailable (%d), falling back to libaio\n",
+			err);
+		err = tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_LIO, NULL);
+	}
+
+	return err;
 }
 
 static void
@@ -222,6 +259,7 @@ static void
 tapdisk_server_close(void)
 {
 	tapdisk_server_close_aio();
+	scheduler_destroy(&server.scheduler);
 }
 
 void
@@ -283,9 +321,7 @@ tapdisk_server_init(void)
 	memset(&server, 0, sizeof(server));
 	INIT_LIST_HEAD(&server.vbds);
 
-	scheduler_initialize(&server.scheduler);
-
-	return 0;
+	return scheduler_initialize(&server.scheduler);
 }
 
 int
@@ -311,7 +347,9 @@ tapdisk_server_initialize(void)
 {
 	int err;
 
-	tapdisk_server_init();
+	err = tapdisk_server_init();
+	if (err)
+		return err;
 
 	err = tapdisk_server_complete();
 	if (err)
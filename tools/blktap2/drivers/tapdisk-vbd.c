@@ -631,6 +631,11 @@ tapdisk_vbd_map_device(td_vbd_t *vbd, const char *devname)
 
 	ioctl(ring->fd, BLKTAP_IOCTL_SETMODE, BLKTAP_MODE_INTERPOSE);
 
+	/* the request data pages; failing to register them is harmless */
+	tapdisk_server_register_buffer((void *)ring->vstart,
+				       psize * (BLKTAP_MMAP_REGION_SIZE -
+						BLKTAP_RING_PAGES));
+
 	return 0;
 
 fail:
@@ -652,8 +657,10 @@ tapdisk_vbd_unmap_device(td_vbd_t *vbd)
 
 	if (vbd->ring.fd != -1)
 		close(vbd->ring.fd);
-	if (vbd->ring.mem > 0)
+	if (vbd->ring.mem > 0) {
+		tapdisk_server_unregister_buffer((void *)vbd->ring.vstart);
 		munmap(vbd->ring.mem, psize * BLKTAP_MMAP_REGION_SIZE);
+	}
 
 	return 0;
 }
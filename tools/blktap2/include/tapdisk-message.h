@@ -33,6 +33,13 @@
 #define TAPDISK_MESSAGE_MAX_PATH_LENGTH  256
 #define TAPDISK_MESSAGE_STRING_LENGTH    256
 
+/*
+ * Keeps tapdisk_message_cache no larger than tapdisk_message_params, so
+ * that adding it did not change the size of tapdisk_message.
+ */
+#define TAPDISK_MESSAGE_CACHE_PATH_LENGTH \
+	(TAPDISK_MESSAGE_MAX_PATH_LENGTH - 6 * sizeof(uint64_t))
+
 #define TAPDISK_MESSAGE_MAX_MINORS \
 	((TAPDISK_MESSAGE_MAX_PATH_LENGTH / sizeof(int)) - 1)
 
@@ -50,6 +57,7 @@ typedef struct tapdisk_message_string    tapdisk_message_string_t;
 typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
+typedef struct tapdisk_message_cache     tapdisk_message_cache_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -88,6 +96,19 @@ struct tapdisk_message_list {
 	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
 };
 
+/* sector counts, except size which is in bytes */
+struct tapdisk_message_cache {
+	int                              count;
+	uint64_t                         size;
+	uint64_t                         reads;
+	uint64_t                         hits;
+	uint64_t                         misses;
+	uint64_t                         readaheads;
+	uint64_t                         readahead_hits;
+	uint64_t                         evictions;
+	char                             path[TAPDISK_MESSAGE_CACHE_PATH_LENGTH];
+};
+
 struct tapdisk_message {
 	uint16_t                         type;
 	uint16_t                         cookie;
@@ -100,6 +121,7 @@ struct tapdisk_message {
 		tapdisk_message_minors_t minors;
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t   list;
+		tapdisk_message_cache_t  cache;
 	} u;
 };
 
@@ -126,6 +148,8 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_LIST_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_CACHE_STATS,
+	TAPDISK_MESSAGE_CACHE_STATS_RSP,
 };
 
 static inline char *
@@ -195,6 +219,12 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_CACHE_STATS:
+		return "cache stats";
+
+	case TAPDISK_MESSAGE_CACHE_STATS_RSP:
+		return "cache stats response";
+
 	default:
 		return "unknown";
 	}
@@ -1433,6 +1433,20 @@ int xc_lockprof_query(xc_interface *xch,
                       uint32_t *n_elems,
                       uint64_t *time,
                       xc_hypercall_buffer_t *data);
+/*
+ * Reset and restart lock profiling, sampling one in 2^sample_shift lock
+ * acquisitions per cpu, for window_ms milliseconds (0: until stopped).
+ */
+int xc_lockprof_start(xc_interface *xch, uint32_t sample_shift,
+                      uint32_t window_ms);
+int xc_lockprof_stop(xc_interface *xch);
+typedef xen_sysctl_lockprof_cpu_t xc_lockprof_cpu_t;
+/* Per-cpu wait statistics, data is indexed by cpu. */
+int xc_lockprof_query_cpu(xc_interface *xch,
+                          uint32_t *n_elems,
+                          uint64_t *time,
+                          uint32_t *sample_shift,
+                          xc_hypercall_buffer_t *data);
 
 void *xc_memalign(xc_interface *xch, size_t alignment, size_t size);
 
@@ -1981,6 +1995,43 @@ int xc_hvm_unmap_io_range_from_ioreq_server(xc_interface *xch,
                                             uint64_t start,
                                             uint64_t end);
 
+/**
+ * This function registers a range of memory for posted-write emulation:
+ * single writes to the range are queued in the buffered ioreq ring and
+ * the vCPU is not paused waiting for the emulator to complete them.  Reads
+ * are emulated synchronously.  The IOREQ Server must have a buffered ioreq
+ * ring and must understand the posted write encoding described in
+ * xen/include/public/hvm/hvm_op.h.
+ *
+ * @parm xch a handle to an open hypervisor interface.
+ * @parm domid the domain id to be serviced
+ * @parm id the IOREQ Server id.
+ * @parm start start of range
+ * @parm end end of range (inclusive).
+ * @return 0 on success, -1 on failure.
+ */
+int xc_hvm_map_posted_range_to_ioreq_server(xc_interface *xch,
+                                            domid_t domid,
+                                            ioservid_t id,
+                                            uint64_t start,
+                                            uint64_t end);
+
+/**
+ * This function deregisters a range of memory for posted-write emulation.
+ *
+ * @parm xch a handle to an open hypervisor interface.
+ * @parm domid the domain id to be serviced
+ * @parm id the IOREQ Server id.
+ * @parm start start of range
+ * @parm end end of range (inclusive).
+ * @return 0 on success, -1 on failure.
+ */
+int xc_hvm_unmap_posted_range_from_ioreq_server(xc_interface *xch,
+                                                domid_t domid,
+                                                ioservid_t id,
+                                                uint64_t start,
+                                                uint64_t end);
+
 /**
  * This function registers a PCI device for config space emulation.
  *
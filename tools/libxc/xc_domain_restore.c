@@ -38,6 +38,9 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#ifndef __MINIOS__
+#include <pthread.h>
+#endif
 #include <inttypes.h>
 
 #include "xg_private.h"
@@ -1438,6 +1441,197 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
     return rc;
 }
 
+/* Place all the pages of a pagebuf.  Returns the number of races, or -1. */
+static int place_pages(xc_interface *xch, uint32_t dom,
+                       struct restore_ctx *ctx, xen_pfn_t *region_mfn,
+                       unsigned long *pfn_type, int pae_extended_cr3,
+                       struct xc_mmu *mmu, pagebuf_t *pagebuf)
+{
+    int curbatch, invalid_pages = 0, nraces = 0, brc;
+
+    /* break pagebuf into batches */
+    for ( curbatch = 0; curbatch < pagebuf->nr_pages;
+          curbatch += MAX_BATCH_SIZE )
+    {
+        brc = apply_batch(xch, dom, ctx, region_mfn, pfn_type,
+                          pae_extended_cr3, mmu, pagebuf, curbatch,
+                          &invalid_pages);
+        if ( brc < 0 )
+            return -1;
+
+        nraces += brc;
+    }
+
+    return nraces;
+}
+
+/*
+ * Until the image is complete, the pages of each batch are placed into
+ * the guest by a helper thread while the main thread reads the next batch
+ * from the stream.  Only the page contents move to the placer: records
+ * interleaved with the batches are still gathered in the main pagebuf.
+ */
+struct restore_placer {
+    int running;
+#ifndef __MINIOS__
+    int busy, exit;
+    int rc, err;        /* Result of the last batch placed. */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    xc_interface *xch;
+    uint32_t dom;
+    struct restore_ctx *ctx;
+    xen_pfn_t *region_mfn;
+    unsigned long *pfn_type;
+    int pae_extended_cr3;
+    struct xc_mmu *mmu;
+    pagebuf_t buf;
+#endif
+};
+
+#ifndef __MINIOS__
+static void *placer_thread(void *arg)
+{
+    struct restore_placer *p = arg;
+    int rc;
+
+    pthread_mutex_lock(&p->lock);
+    for ( ; ; )
+    {
+        while ( !p->busy && !p->exit )
+            pthread_cond_wait(&p->cond, &p->lock);
+        if ( !p->busy )
+            break;
+        pthread_mutex_unlock(&p->lock);
+
+        rc = place_pages(p->xch, p->dom, p->ctx, p->region_mfn, p->pfn_type,
+                         p->pae_extended_cr3, p->mmu, &p->buf);
+
+        pthread_mutex_lock(&p->lock);
+        if ( rc < 0 )
+        {
+            p->rc = -1;
+            p->err = errno;
+        }
+        else if ( p->rc >= 0 )
+            p->rc += rc;
+        p->busy = 0;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void placer_init(struct restore_placer *p, xc_interface *xch,
+                        uint32_t dom, struct restore_ctx *ctx,
+                        xen_pfn_t *region_mfn, unsigned long *pfn_type,
+                        int pae_extended_cr3, struct xc_mmu *mmu)
+{
+    memset(p, 0, sizeof(*p));
+    p->xch = xch;
+    p->dom = dom;
+    p->ctx = ctx;
+    p->region_mfn = region_mfn;
+    p->pfn_type = pfn_type;
+    p->pae_extended_cr3 = pae_extended_cr3;
+    p->mmu = mmu;
+    pagebuf_init(&p->buf);
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    /* Without a placer thread, pages are placed synchronously. */
+    if ( pthread_create(&p->thread, NULL, placer_thread, p) == 0 )
+        p->running = 1;
+    else
+        DPRINTF("No placer thread: placing pages synchronously\n");
+}
+
+/*
+ * Wait for the placer to be idle.  Returns the number of races seen since
+ * the last call, or -1 with errno set if placing a batch failed.
+ */
+static int placer_wait(struct restore_placer *p)
+{
+    int rc;
+
+    if ( !p->running )
+        return 0;
+
+    pthread_mutex_lock(&p->lock);
+    while ( p->busy )
+        pthread_cond_wait(&p->cond, &p->lock);
+    rc = p->rc;
+    if ( rc < 0 )
+        errno = p->err;
+    else
+        p->rc = 0;
+    pthread_mutex_unlock(&p->lock);
+
+    return rc;
+}
+
+/* Hand the pages in buf to the (idle) placer, leaving buf empty. */
+static void placer_submit(struct restore_placer *p, pagebuf_t *buf)
+{
+    void *pages = p->buf.pages;
+    unsigned long *pfn_types = p->buf.pfn_types;
+
+    p->buf.pages = buf->pages;
+    p->buf.pfn_types = buf->pfn_types;
+    p->buf.nr_pages = buf->nr_pages;
+    p->buf.nr_physpages = buf->nr_physpages;
+    p->buf.verify = buf->verify;
+
+    buf->pages = pages;
+    buf->pfn_types = pfn_types;
+    buf->nr_pages = buf->nr_physpages = 0;
+
+    pthread_mutex_lock(&p->lock);
+    p->busy = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void placer_free(struct restore_placer *p)
+{
+    if ( !p->running )
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->exit = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_join(p->thread, NULL);
+    pagebuf_free(&p->buf);
+    p->running = 0;
+}
+#else
+static void placer_init(struct restore_placer *p, xc_interface *xch,
+                        uint32_t dom, struct restore_ctx *ctx,
+                        xen_pfn_t *region_mfn, unsigned long *pfn_type,
+                        int pae_extended_cr3, struct xc_mmu *mmu)
+{
+    p->running = 0;
+}
+
+static int placer_wait(struct restore_placer *p)
+{
+    return 0;
+}
+
+static void placer_submit(struct restore_placer *p, pagebuf_t *buf)
+{
+}
+
+static void placer_free(struct restore_placer *p)
+{
+}
+#endif
+
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned int store_evtchn, unsigned long *store_mfn,
                       domid_t store_domid, unsigned int console_evtchn,
@@ -1502,6 +1696,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     struct restore_ctx *ctx = &_ctx;
     struct domain_info_context *dinfo = &ctx->dinfo;
 
+    struct restore_placer placer = { .running = 0 };
+
     DPRINTF("%s: starting restore of new domid %u", __func__, dom);
 
     pagebuf_init(&pagebuf);
@@ -1629,11 +1825,14 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
      * We uncanonicalise page tables as we go.
      */
 
+    placer_init(&placer, xch, dom, ctx, region_mfn, pfn_type,
+                pae_extended_cr3, mmu);
+
     n = m = 0;
  loadpages:
     for ( ; ; )
     {
-        int j, curbatch, invalid_pages;
+        int j, brc;
 
         xc_report_progress_step(xch, n, dinfo->p2m_size);
 
@@ -1650,6 +1849,12 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         DBGPRINTF("batch %d\n",j);
 
         if ( j == 0 ) {
+            /* Wait for the last batch to be in place. */
+            brc = placer_wait(&placer);
+            if ( brc < 0 )
+                goto out;
+            nraces += brc;
+
             /* catch vcpu updates */
             if (pagebuf.new_ctxt_format) {
                 max_vcpu_id = pagebuf.max_vcpu_id;
@@ -1675,21 +1880,23 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
             break;  /* our work here is done */
         }
 
-        /* break pagebuf into batches */
-        curbatch = 0;
-        invalid_pages = 0;
-        while ( curbatch < j ) {
-            int brc;
-
-            brc = apply_batch(xch, dom, ctx, region_mfn, pfn_type,
-                              pae_extended_cr3, mmu, &pagebuf, curbatch,
-                              &invalid_pages);
+        if ( placer.running && !ctx->completed )
+        {
+            /* Place these pages while reading the next batch. */
+            brc = placer_wait(&placer);
             if ( brc < 0 )
                 goto out;
-
             nraces += brc;
 
-            curbatch += MAX_BATCH_SIZE;
+            placer_submit(&placer, &pagebuf);
+        }
+        else
+        {
+            brc = place_pages(xch, dom, ctx, region_mfn, pfn_type,
+                              pae_extended_cr3, mmu, &pagebuf);
+            if ( brc < 0 )
+                goto out;
+            nraces += brc;
         }
 
         pagebuf.nr_physpages = pagebuf.nr_pages = 0;
@@ -2368,6 +2575,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     rc = 0;
 
  out:
+    placer_free(&placer);
     if ( (rc != 0) && (dom != 0) )
         xc_domain_destroy(xch, dom);
     xc_hypercall_buffer_free(xch, ctxt);
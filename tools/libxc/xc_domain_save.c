@@ -26,6 +26,9 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <assert.h>
+#ifndef __MINIOS__
+#include <pthread.h>
+#endif
 
 #include "xc_private.h"
 #include "xc_bitops.h"
@@ -277,6 +280,272 @@ static int write_compressed(xc_interface *xch, comp_ctx *compress_ctx,
     return 0;
 }
 
+/*
+ * Batches of pages are written to the stream by a separate writer thread,
+ * so that scanning, mapping and canonicalising the next batch overlaps
+ * with sending the previous one.  A batch keeps its foreign mapping until
+ * it has been written; page table pages are sent from canonicalised
+ * copies held in the batch.
+ */
+#define NR_WRITE_BATCHES 4
+
+struct write_seg {
+    void *buf;
+    size_t len;
+};
+
+struct write_batch {
+    unsigned int batch;
+    unsigned long *pfn_type;      /* MAX_BATCH_SIZE entries, as sent */
+    unsigned char *region;        /* unmapped once written */
+    char *pt_pages;               /* MAX_BATCH_SIZE canonicalised pages */
+    unsigned int nr_pt_pages;
+    struct write_seg *segs;       /* data to send after pfn_type */
+    unsigned int nr_segs;
+    int dobuf;
+    struct outbuf *ob;
+};
+
+struct save_writer {
+    xc_interface *xch;
+    int fd;
+    struct write_batch batches[NR_WRITE_BATCHES];
+    /* batches[head % N] up to batches[tail % N] are queued for writing. */
+    unsigned int head, tail;
+    int err;                      /* errno of the first failed write */
+#ifndef __MINIOS__
+    int running, exit;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+};
+
+/* Queue data to be sent, merging it with the previous segment if adjacent. */
+static void write_batch_add(struct write_batch *wb, void *buf, size_t len)
+{
+    struct write_seg *seg;
+
+    if ( wb->nr_segs )
+    {
+        seg = &wb->segs[wb->nr_segs - 1];
+        if ( (char *)seg->buf + seg->len == buf )
+        {
+            seg->len += len;
+            return;
+        }
+    }
+
+    seg = &wb->segs[wb->nr_segs++];
+    seg->buf = buf;
+    seg->len = len;
+}
+
+/* Returns a page for a canonicalised copy of a page table, or NULL. */
+static void *write_batch_pt_page(struct write_batch *wb)
+{
+    if ( !wb->pt_pages &&
+         !(wb->pt_pages = malloc(MAX_BATCH_SIZE * PAGE_SIZE)) )
+        return NULL;
+
+    return wb->pt_pages + PAGE_SIZE * wb->nr_pt_pages++;
+}
+
+static int write_batch_out(xc_interface *xch, int fd, struct write_batch *wb)
+{
+    unsigned int i;
+
+    if ( write_buffer(xch, wb->dobuf, wb->ob, fd,
+                      &wb->batch, sizeof(wb->batch)) ||
+         write_buffer(xch, wb->dobuf, wb->ob, fd,
+                      wb->pfn_type, sizeof(*wb->pfn_type) * wb->batch) )
+        return -1;
+
+    for ( i = 0; i < wb->nr_segs; i++ )
+        if ( write_uncached(xch, wb->dobuf, wb->ob, fd, wb->segs[i].buf,
+                            wb->segs[i].len) != wb->segs[i].len )
+            return -1;
+
+    return 0;
+}
+
+/* Write out (unless a write failed already) and unmap one queued batch. */
+static void save_writer_one(struct save_writer *w, struct write_batch *wb)
+{
+    int err = 0;
+
+    if ( !w->err && write_batch_out(w->xch, w->fd, wb) )
+        err = errno ?: EIO;
+
+    munmap(wb->region, wb->batch * PAGE_SIZE);
+    wb->region = NULL;
+
+    if ( err && !w->err )
+        w->err = err;
+}
+
+#ifndef __MINIOS__
+static void *save_writer_thread(void *arg)
+{
+    struct save_writer *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    for ( ; ; )
+    {
+        while ( w->head == w->tail && !w->exit )
+            pthread_cond_wait(&w->cond, &w->lock);
+        if ( w->head == w->tail )
+            break;
+
+        pthread_mutex_unlock(&w->lock);
+        save_writer_one(w, &w->batches[w->head % NR_WRITE_BATCHES]);
+        pthread_mutex_lock(&w->lock);
+
+        w->head++;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+#endif
+
+static int save_writer_init(xc_interface *xch, struct save_writer *w, int fd)
+{
+    unsigned int i;
+
+    memset(w, 0, sizeof(*w));
+    w->xch = xch;
+    w->fd = fd;
+
+    for ( i = 0; i < NR_WRITE_BATCHES; i++ )
+    {
+        w->batches[i].pfn_type = malloc(MAX_BATCH_SIZE *
+                                        sizeof(*w->batches[i].pfn_type));
+        w->batches[i].segs = malloc(MAX_BATCH_SIZE *
+                                    sizeof(*w->batches[i].segs));
+        if ( !w->batches[i].pfn_type || !w->batches[i].segs )
+        {
+            ERROR("failed to alloc memory for write batches");
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+#ifndef __MINIOS__
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    /* Without a writer thread, batches are written synchronously. */
+    if ( pthread_create(&w->thread, NULL, save_writer_thread, w) == 0 )
+        w->running = 1;
+    else
+        DPRINTF("No writer thread: writing batches synchronously\n");
+#endif
+
+    return 0;
+}
+
+/* Get a free batch to fill in, or NULL (with errno) if a write failed. */
+static struct write_batch *save_writer_get(struct save_writer *w)
+{
+    struct write_batch *wb;
+    int err;
+
+#ifndef __MINIOS__
+    pthread_mutex_lock(&w->lock);
+    while ( w->tail - w->head == NR_WRITE_BATCHES )
+        pthread_cond_wait(&w->cond, &w->lock);
+    err = w->err;
+    pthread_mutex_unlock(&w->lock);
+#else
+    err = w->err;
+#endif
+
+    if ( err )
+    {
+        errno = err;
+        return NULL;
+    }
+
+    wb = &w->batches[w->tail % NR_WRITE_BATCHES];
+    wb->nr_segs = 0;
+    wb->nr_pt_pages = 0;
+
+    return wb;
+}
+
+/* Queue a batch obtained from save_writer_get() for writing. */
+static void save_writer_put(struct save_writer *w, struct write_batch *wb)
+{
+#ifndef __MINIOS__
+    if ( w->running )
+    {
+        pthread_mutex_lock(&w->lock);
+        w->tail++;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+#endif
+
+    save_writer_one(w, wb);
+}
+
+/* Wait for all queued batches to be written. */
+static int save_writer_drain(struct save_writer *w)
+{
+    int err;
+
+#ifndef __MINIOS__
+    pthread_mutex_lock(&w->lock);
+    while ( w->head != w->tail )
+        pthread_cond_wait(&w->cond, &w->lock);
+    err = w->err;
+    pthread_mutex_unlock(&w->lock);
+#else
+    err = w->err;
+#endif
+
+    if ( err )
+    {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Stop the writer.  With abort, queued batches are unmapped but not sent. */
+static void save_writer_free(struct save_writer *w, int abort)
+{
+    unsigned int i;
+
+#ifndef __MINIOS__
+    if ( w->running )
+    {
+        pthread_mutex_lock(&w->lock);
+        if ( abort && !w->err )
+            w->err = ECANCELED;
+        w->exit = 1;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+
+        pthread_join(w->thread, NULL);
+        w->running = 0;
+    }
+#endif
+
+    for ( i = 0; i < NR_WRITE_BATCHES; i++ )
+    {
+        free(w->batches[i].pfn_type);
+        free(w->batches[i].segs);
+        free(w->batches[i].pt_pages);
+        w->batches[i].pfn_type = NULL;
+        w->batches[i].segs = NULL;
+        w->batches[i].pt_pages = NULL;
+    }
+}
+
 struct time_stats {
     struct timeval wall;
     long long d0_cpu, d1_cpu;
@@ -880,6 +1149,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
      * to ob_pagebuf and finally flushed out.
      */
     struct outbuf ob_pagebuf, ob_tailbuf, *ob = NULL;
+    struct save_writer writer;
+    struct write_batch *wb = NULL;
     struct save_ctx _ctx;
     struct save_ctx *ctx = &_ctx;
     struct domain_info_context *dinfo = &ctx->dinfo;
@@ -924,6 +1195,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         goto exit;
     }
 
+    if ( save_writer_init(xch, &writer, io_fd) )
+        goto out;
+
     shared_info_frame = info.shared_info_frame;
 
     /* Map the shared info frame */
@@ -1334,26 +1608,44 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 continue; /* bail on this batch: no valid pages */
             }
 
-            if ( wrexact(io_fd, &batch, sizeof(unsigned int)) )
+            if ( !compressing )
             {
-                PERROR("Error when writing to state file (2)");
-                goto out;
-            }
-
-            if ( sizeof(unsigned long) < sizeof(*pfn_type) )
+                wb = save_writer_get(&writer);
+                if ( !wb )
+                {
+                    PERROR("Error when writing to state file (2)");
+                    munmap(region_base, batch*PAGE_SIZE);
+                    goto out;
+                }
+                wb->batch = batch;
+                wb->region = region_base;
+                wb->dobuf = last_iter;
+                wb->ob = ob;
                 for ( j = 0; j < batch; j++ )
-                    ((unsigned long *)pfn_type)[j] = pfn_type[j];
-            if ( wrexact(io_fd, pfn_type, sizeof(unsigned long)*batch) )
+                    wb->pfn_type[j] = pfn_type[j];
+            }
+            else
             {
-                PERROR("Error when writing to state file (3)");
-                goto out;
+                if ( wrexact(io_fd, &batch, sizeof(unsigned int)) )
+                {
+                    PERROR("Error when writing to state file (2)");
+                    goto out;
+                }
+
+                if ( sizeof(unsigned long) < sizeof(*pfn_type) )
+                    for ( j = 0; j < batch; j++ )
+                        ((unsigned long *)pfn_type)[j] = pfn_type[j];
+                if ( wrexact(io_fd, pfn_type, sizeof(unsigned long)*batch) )
+                {
+                    PERROR("Error when writing to state file (3)");
+                    goto out;
+                }
+                if ( sizeof(unsigned long) < sizeof(*pfn_type) )
+                    while ( --j >= 0 )
+                        pfn_type[j] = ((unsigned long *)pfn_type)[j];
             }
-            if ( sizeof(unsigned long) < sizeof(*pfn_type) )
-                while ( --j >= 0 )
-                    pfn_type[j] = ((unsigned long *)pfn_type)[j];
 
             /* entering this loop, pfn_type is now in pfns (Not mfns) */
-            run = 0;
             for ( j = 0; j < batch; j++ )
             {
                 unsigned long pfn, pagetype;
@@ -1362,24 +1654,6 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 pfn      = pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
                 pagetype = pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
 
-                if ( pagetype != 0 )
-                {
-                    /* If the page is not a normal data page, write out any
-                       run of pages we may have previously acumulated */
-                    if ( !compressing && run )
-                    {
-                        if ( wruncached(io_fd, live,
-                                       (char*)region_base+(PAGE_SIZE*(j-run)), 
-                                       PAGE_SIZE*run) != PAGE_SIZE*run )
-                        {
-                            PERROR("Error when writing to state file (4a)"
-                                  " (errno %d)", errno);
-                            goto out;
-                        }                        
-                        run = 0;
-                    }
-                }
-
                 /*
                  * skip pages that aren't present,
                  * or are broken, or are alloc-only
@@ -1395,13 +1669,25 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                      (pagetype <= XEN_DOMCTL_PFINFO_L4TAB) )
                 {
                     /* We have a pagetable page: need to rewrite it. */
+                    char *ptpage = compressing ? page : write_batch_pt_page(wb);
+
+                    if ( !ptpage )
+                    {
+                        ERROR("failed to alloc memory for pagetable pages");
+                        errno = ENOMEM;
+                        munmap(region_base, batch*PAGE_SIZE);
+                        goto out;
+                    }
+
                     race = 
-                        canonicalize_pagetable(ctx, pagetype, pfn, spage, page); 
+                        canonicalize_pagetable(ctx, pagetype, pfn, spage, ptpage); 
 
                     if ( race && !live )
                     {
                         ERROR("Fatal PT race (pfn %lx, type %08lx)", pfn,
                               pagetype);
+                        if ( !compressing )
+                            munmap(region_base, batch*PAGE_SIZE);
                         goto out;
                     }
 
@@ -1438,13 +1724,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                             }
                         }
                     }
-                    else if ( wruncached(io_fd, live, page,
-                                         PAGE_SIZE) != PAGE_SIZE )
-                    {
-                        PERROR("Error when writing to state file (4b)"
-                              " (errno %d)", errno);
-                        goto out;
-                    }
+                    else
+                        write_batch_add(wb, ptpage, PAGE_SIZE);
                 }
                 else
                 {
@@ -1476,31 +1757,28 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                         }
                     }
                     else
-                        run++;
+                        write_batch_add(wb, spage, PAGE_SIZE);
                 }
             } /* end of the write out for this batch */
 
-            if ( run )
-            {
-                /* write out the last accumulated run of pages */
-                if ( wruncached(io_fd, live,
-                               (char*)region_base+(PAGE_SIZE*(j-run)), 
-                               PAGE_SIZE*run) != PAGE_SIZE*run )
-                {
-                    PERROR("Error when writing to state file (4c)"
-                          " (errno %d)", errno);
-                    goto out;
-                }                        
-            }
-
             sent_this_iter += batch;
 
-            munmap(region_base, batch*PAGE_SIZE);
+            /* The writer unmaps the batch once it has been sent. */
+            if ( compressing )
+                munmap(region_base, batch*PAGE_SIZE);
+            else
+                save_writer_put(&writer, wb);
 
         } /* end of this while loop for this iteration */
 
       skip:
 
+        if ( save_writer_drain(&writer) )
+        {
+            PERROR("Error when writing to state file (4)");
+            goto out;
+        }
+
         xc_report_progress_step(xch, dinfo->p2m_size, dinfo->p2m_size);
 
         total_sent += sent_this_iter;
@@ -2078,6 +2356,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
  out_rc:
     completed = 1;
 
+    /* Batches still queued after an error are not sent. */
+    if ( rc )
+        save_writer_free(&writer, 1);
+
     if ( !rc && callbacks->postcopy )
         callbacks->postcopy(callbacks->data);
 
@@ -2167,6 +2449,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     xc_hypercall_buffer_free_pages(xch, to_send, NRPAGES(bitmap_size(dinfo->p2m_size)));
     xc_hypercall_buffer_free_pages(xch, to_skip, NRPAGES(bitmap_size(dinfo->p2m_size)));
 
+    save_writer_free(&writer, 0);
     free(pfn_type);
     free(pfn_batch);
     free(pfn_err);
@@ -2175,6 +2458,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     outbuf_free(&ob_pagebuf);
 
     errno = rc;
+    /* Not to be reached once the writer exists: save_writer_free() joins it. */
 exit:
     DPRINTF("Save exit of domid %u with errno=%d\n", dom, errno);
 
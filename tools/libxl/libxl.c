@@ -4985,8 +4985,10 @@ int libxl_wait_for_free_memory(libxl_ctx *ctx, uint32_t domid, uint32_t
         rc = libxl_get_physinfo(ctx, &info);
         if (rc < 0)
             goto out;
-        if (info.free_pages * 4 >= freemem_slack &&
-            info.free_pages * 4 - freemem_slack >= memory_kb) {
+        /* Pages waiting to be scrubbed are scrubbed on allocation. */
+        if ((info.free_pages + info.scrub_pages) * 4 >= freemem_slack &&
+            (info.free_pages + info.scrub_pages) * 4 - freemem_slack >=
+            memory_kb) {
             rc = 0;
             goto out;
         }
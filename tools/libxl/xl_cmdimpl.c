@@ -5123,6 +5123,7 @@ static void output_physinfo(void)
     const libxl_version_info *vinfo;
     unsigned int i;
     libxl_bitmap cpumap;
+    uint64_t free_pages;
     int n = 0;
 
     if (libxl_get_physinfo(ctx, &info) != 0) {
@@ -5148,7 +5149,14 @@ static void output_physinfo(void)
     if (vinfo) {
         i = (1 << 20) / vinfo->pagesize;
         printf("total_memory           : %"PRIu64"\n", info.total_pages / i);
-        printf("free_memory            : %"PRIu64"\n", (info.free_pages - info.outstanding_pages) / i);
+        /*
+         * Pages waiting to be scrubbed are scrubbed on allocation, and
+         * claims are checked against them too.
+         */
+        free_pages = info.free_pages + info.scrub_pages;
+        free_pages = free_pages > info.outstanding_pages ?
+                     free_pages - info.outstanding_pages : 0;
+        printf("free_memory            : %"PRIu64"\n", free_pages / i);
         printf("sharing_freed_memory   : %"PRIu64"\n", info.sharing_freed_pages / i);
         printf("sharing_used_memory    : %"PRIu64"\n", info.sharing_used_frames / i);
         printf("outstanding_claims     : %"PRIu64"\n", info.outstanding_pages / i);
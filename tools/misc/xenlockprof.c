@@ -17,21 +17,140 @@
 #include <errno.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
+
+/* Upper bounds of the histogram buckets, see LOCKPROF_HIST_N. */
+static const char *hist_label[LOCKPROF_HIST_N] = {
+    "<256ns", "<512ns", "<1us", "<2us", "<4us", "<8us", "<16us", "<32us",
+    "<65us", "<131us", "<262us", "<524us", "<1ms", "<2ms", "<4ms", ">4ms"
+};
+
+static void print_hist(const char *what, const uint64_t *hist)
+{
+    int i;
+
+    printf("    %-5s", what);
+    for ( i = 0; i < LOCKPROF_HIST_N; i++ )
+        if ( hist[i] )
+            printf(" %s:%"PRIu64, hist_label[i], hist[i]);
+    printf("\n");
+}
+
+static int cmp_block_time(const void *a, const void *b)
+{
+    const xc_lockprof_data_t *da = a, *db = b;
+
+    if ( da->block_time != db->block_time )
+        return da->block_time < db->block_time ? 1 : -1;
+    return 0;
+}
+
+static int print_cpus(xc_interface *xc_handle)
+{
+    uint32_t i, n, shift;
+    uint64_t time;
+    int max_cpus;
+    DECLARE_HYPERCALL_BUFFER(xc_lockprof_cpu_t, data);
+
+    if ( (max_cpus = xc_get_max_cpus(xc_handle)) <= 0 )
+    {
+        fprintf(stderr, "Error getting number of cpus: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+    n = max_cpus;
+
+    data = xc_hypercall_buffer_alloc(xc_handle, data, sizeof(*data) * n);
+    if ( data == NULL )
+    {
+        fprintf(stderr, "Could not allocate buffers: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    i = n;
+    if ( xc_lockprof_query_cpu(xc_handle, &i, &time, &shift,
+                               HYPERCALL_BUFFER(data)) != 0 )
+    {
+        fprintf(stderr, "Error getting cpu records: %d (%s)\n",
+                errno, strerror(errno));
+        xc_hypercall_buffer_free(xc_handle, data);
+        return 1;
+    }
+
+    if ( shift )
+        printf("sampling 1 in %u lock acquisitions\n", 1u << shift);
+    for ( i = 0; i < n && i < max_cpus; i++ )
+        if ( data[i].block_cnt )
+            printf("cpu %4u: block:%12"PRId64"(%20.9fs)\n", i,
+                   data[i].block_cnt, (double)data[i].block_time / 1E+09);
+
+    xc_hypercall_buffer_free(xc_handle, data);
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("%s: [-r] [-x] [-s shift] [-w msecs] [-d] [-c] [-n locks]\n", prog);
+    printf("no args: print lock profile data\n");
+    printf("    -r : reset profile data\n");
+    printf("    -x : stop profiling, keeping the data\n");
+    printf("    -s : restart profiling, sampling 1 in 2^shift lock "
+           "acquisitions\n");
+    printf("    -w : restart profiling for msecs, wait and print the data\n");
+    printf("    -d : print wait/hold time histograms and waiting call sites\n");
+    printf("    -c : print wait times per cpu\n");
+    printf("    -n : only print the locks with the longest wait times\n");
+}
 
 int main(int argc, char *argv[])
 {
     xc_interface      *xc_handle;
-    uint32_t           i, j, n;
+    uint32_t           i, j, k, n, shift = 0, window = 0, max_locks = 0;
     uint64_t           time;
     double             l, b, sl, sb;
     char               name[60];
+    int                opt, reset = 0, stop = 0, start = 0, detail = 0;
+    int                cpus = 0, rc = 0;
     DECLARE_HYPERCALL_BUFFER(xc_lockprof_data_t, data);
 
-    if ( (argc > 2) || ((argc == 2) && (strcmp(argv[1], "-r") != 0)) )
+    while ( (opt = getopt(argc, argv, "rxs:w:dcn:h")) != -1 )
     {
-        printf("%s: [-r]\n", argv[0]);
-        printf("no args: print lock profile data\n");
-        printf("    -r : reset profile data\n");
+        switch ( opt )
+        {
+        case 'r':
+            reset = 1;
+            break;
+        case 'x':
+            stop = 1;
+            break;
+        case 's':
+            shift = strtoul(optarg, NULL, 0);
+            start = 1;
+            break;
+        case 'w':
+            window = strtoul(optarg, NULL, 0);
+            start = 1;
+            break;
+        case 'd':
+            detail = 1;
+            break;
+        case 'c':
+            cpus = 1;
+            break;
+        case 'n':
+            max_locks = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( optind != argc || reset + stop + start > 1 )
+    {
+        usage(argv[0]);
         return 1;
     }
 
@@ -42,17 +161,32 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    if ( argc > 1 )
+    if ( reset || stop )
     {
-        if ( xc_lockprof_reset(xc_handle) != 0 )
+        if ( (reset ? xc_lockprof_reset(xc_handle)
+                    : xc_lockprof_stop(xc_handle)) != 0 )
         {
-            fprintf(stderr, "Error reseting profile data: %d (%s)\n",
-                    errno, strerror(errno));
+            fprintf(stderr, "Error %s profile data: %d (%s)\n",
+                    reset ? "reseting" : "stopping", errno, strerror(errno));
             return 1;
         }
         return 0;
     }
 
+    if ( start )
+    {
+        if ( xc_lockprof_start(xc_handle, shift, window) != 0 )
+        {
+            fprintf(stderr, "Error starting profiling: %d (%s)\n",
+                    errno, strerror(errno));
+            return 1;
+        }
+        if ( !window )
+            return 0;
+        sleep(window / 1000);
+        usleep((window % 1000) * 1000);
+    }
+
     n = 0;
     if ( xc_lockprof_query_number(xc_handle, &n) != 0 )
     {
@@ -84,6 +218,13 @@ int main(int argc, char *argv[])
         i = n;
     }
 
+    if ( max_locks )
+    {
+        qsort(data, i, sizeof(*data), cmp_block_time);
+        if ( i > max_locks )
+            i = max_locks;
+    }
+
     sl = 0;
     sb = 0;
     for ( j = 0; j < i; j++ )
@@ -108,6 +249,14 @@ int main(int argc, char *argv[])
         printf("%-50s: lock:%12"PRId64"(%20.9fs), "
                "block:%12"PRId64"(%20.9fs)\n",
                name, data[j].lock_cnt, l, data[j].block_cnt, b);
+        if ( !detail )
+            continue;
+        print_hist("hold", data[j].hold_hist);
+        print_hist("block", data[j].block_hist);
+        for ( k = 0; k < LOCKPROF_SITES_N && data[j].sites[k].addr; k++ )
+            printf("    waiter %#018"PRIx64": %12"PRIu64"(%20.9fs)\n",
+                   data[j].sites[k].addr, data[j].sites[k].block_cnt,
+                   (double)data[j].sites[k].block_time / 1E+09);
     }
     l = (double)time / 1E+09;
     printf("total profiling time: %20.9fs\n", l);
@@ -116,5 +265,8 @@ int main(int argc, char *argv[])
 
     xc_hypercall_buffer_free(xc_handle, data);
 
-    return 0;
+    if ( cpus )
+        rc = print_cpus(xc_handle);
+
+    return rc;
 }
@@ -0,0 +1,245 @@
+/*
+ * evtchn-scale.c
+ *
+ * Measure event channel notification throughput as the number of
+ * concurrent sending threads grows, approximating a backend with many
+ * queues signalling its frontends from several vCPUs.
+ *
+ * Each thread binds an interdomain channel between two event channel
+ * handles of the local domain and then notifies its end of the channel
+ * (EVTCHNOP_send) in a loop.  With -S all threads share one channel
+ * instead, which shows the cost of contention on a single port.
+ *
+ * The receiving end is never unmasked, so after the first event the
+ * guest kernel sees no further upcalls and the loop measures the send
+ * path in Xen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <xenctrl.h>
+
+#define DEFAULT_THREADS  16
+#define DEFAULT_SECONDS   5
+
+struct worker {
+    pthread_t thread;
+    xc_evtchn *tx, *rx;
+    evtchn_port_t tx_port, rx_port;
+    unsigned long ops;
+    int err;
+};
+
+static volatile int stop;
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+
+    while ( !stop )
+    {
+        if ( xc_evtchn_notify(w->tx, w->tx_port) )
+        {
+            w->err = errno;
+            break;
+        }
+        w->ops++;
+    }
+
+    return NULL;
+}
+
+static int run(struct worker *workers, unsigned int nr_threads,
+               unsigned int seconds)
+{
+    unsigned int i;
+    unsigned long ops = 0;
+    uint64_t start, elapsed;
+    int rc = 0;
+
+    stop = 0;
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        workers[i].ops = 0;
+        workers[i].err = 0;
+    }
+
+    start = now_usec();
+    for ( i = 0; i < nr_threads; i++ )
+        if ( pthread_create(&workers[i].thread, NULL, worker_fn,
+                            &workers[i]) )
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            stop = 1;
+            nr_threads = i;
+            rc = -1;
+            break;
+        }
+
+    if ( !rc )
+        sleep(seconds);
+    stop = 1;
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+        if ( workers[i].err )
+        {
+            fprintf(stderr, "thread %u: %s\n", i, strerror(workers[i].err));
+            rc = -1;
+        }
+    }
+    elapsed = now_usec() - start;
+
+    if ( !rc )
+        printf("%7u %14.0f %14.0f\n", nr_threads,
+               ops * 1e6 / elapsed, ops * 1e6 / elapsed / nr_threads);
+
+    return rc;
+}
+
+static int bind_pair(struct worker *w, uint32_t domid)
+{
+    int port;
+
+    w->tx = xc_evtchn_open(NULL, 0);
+    w->rx = xc_evtchn_open(NULL, 0);
+    if ( !w->tx || !w->rx )
+        return -1;
+
+    port = xc_evtchn_bind_unbound_port(w->rx, domid);
+    if ( port < 0 )
+        return -1;
+    w->rx_port = port;
+
+    port = xc_evtchn_bind_interdomain(w->tx, domid, w->rx_port);
+    if ( port < 0 )
+        return -1;
+    w->tx_port = port;
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t max-threads] [-s seconds-per-step] "
+            "[-d local-domid] [-S]\n"
+            "Runs with 1, 2, 4, ... up to max-threads sending threads and "
+            "reports\nnotifications per second for each step.\n"
+            "-S makes all threads notify the same event channel.\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int max_threads = DEFAULT_THREADS, seconds = DEFAULT_SECONDS;
+    unsigned int nr_threads, i;
+    uint32_t domid = 0;
+    struct worker *workers;
+    int opt, shared = 0, rc = 0;
+
+    while ( (opt = getopt(argc, argv, "t:s:d:Sh")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 't':
+            max_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            domid = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            shared = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( !max_threads || !seconds )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    workers = calloc(max_threads, sizeof(*workers));
+    if ( !workers )
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for ( i = 0; i < max_threads; i++ )
+    {
+        /* A port can only be notified through the handle it is bound to. */
+        if ( shared && i )
+        {
+            workers[i].tx = workers[0].tx;
+            workers[i].tx_port = workers[0].tx_port;
+            continue;
+        }
+        if ( !bind_pair(&workers[i], domid) )
+            continue;
+
+        fprintf(stderr, "failed to set up thread %u: %s\n",
+                i, strerror(errno));
+        rc = 1;
+        goto out;
+    }
+
+    printf("%7s %14s %14s\n", "threads", "ops/s", "ops/s/thread");
+    for ( nr_threads = 1; ; nr_threads *= 2 )
+    {
+        if ( nr_threads > max_threads )
+            nr_threads = max_threads;
+        if ( run(workers, nr_threads, seconds) )
+        {
+            rc = 1;
+            break;
+        }
+        if ( nr_threads == max_threads )
+            break;
+    }
+
+ out:
+    for ( i = 0; i < (shared ? 1 : max_threads); i++ )
+    {
+        if ( workers[i].tx )
+            xc_evtchn_close(workers[i].tx);
+        if ( workers[i].rx )
+            xc_evtchn_close(workers[i].rx);
+    }
+    free(workers);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,253 @@
+/*
+ * gnttab-scale.c
+ *
+ * Measure grant map/unmap throughput as the number of concurrent
+ * mapping threads grows, approximating a multi-queue backend.
+ *
+ * Pages are shared with the local domain through the grant sharing
+ * driver (gntalloc) and then mapped and unmapped in a loop through the
+ * grant mapping driver (gntdev) from an increasing number of threads.
+ * Each thread uses its own gntdev handle and its own set of grant
+ * references, so any serialisation observed is inside Xen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include <xenctrl.h>
+
+#define DEFAULT_THREADS  16
+#define DEFAULT_REFS      8
+#define DEFAULT_SECONDS   5
+
+struct worker {
+    pthread_t thread;
+    xc_gnttab *xcg;
+    uint32_t domid;
+    uint32_t *refs;
+    unsigned int nr_refs;
+    unsigned long ops;
+    int err;
+};
+
+static volatile int stop;
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    unsigned int i = 0;
+    void *addr;
+
+    while ( !stop )
+    {
+        addr = xc_gnttab_map_grant_ref(w->xcg, w->domid, w->refs[i],
+                                       PROT_READ | PROT_WRITE);
+        if ( addr == NULL )
+        {
+            w->err = errno;
+            break;
+        }
+
+        /* Touch the page so that the mapping is really established. */
+        *(volatile char *)addr;
+
+        if ( xc_gnttab_munmap(w->xcg, addr, 1) )
+        {
+            w->err = errno;
+            break;
+        }
+
+        w->ops += 2;
+        if ( ++i == w->nr_refs )
+            i = 0;
+    }
+
+    return NULL;
+}
+
+static int run(struct worker *workers, unsigned int nr_threads,
+               unsigned int seconds)
+{
+    unsigned int i;
+    unsigned long ops = 0;
+    uint64_t start, elapsed;
+    int rc = 0;
+
+    stop = 0;
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        workers[i].ops = 0;
+        workers[i].err = 0;
+    }
+
+    start = now_usec();
+    for ( i = 0; i < nr_threads; i++ )
+        if ( pthread_create(&workers[i].thread, NULL, worker_fn,
+                            &workers[i]) )
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            stop = 1;
+            nr_threads = i;
+            rc = -1;
+            break;
+        }
+
+    if ( !rc )
+        sleep(seconds);
+    stop = 1;
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+        if ( workers[i].err )
+        {
+            fprintf(stderr, "thread %u: %s\n", i, strerror(workers[i].err));
+            rc = -1;
+        }
+    }
+    elapsed = now_usec() - start;
+
+    if ( !rc )
+        printf("%7u %14.0f %14.0f\n", nr_threads,
+               ops * 1e6 / elapsed, ops * 1e6 / elapsed / nr_threads);
+
+    return rc;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t max-threads] [-r refs-per-thread] "
+            "[-s seconds-per-step] [-d local-domid]\n"
+            "Runs with 1, 2, 4, ... up to max-threads mapping threads and "
+            "reports\nmap+unmap operations per second for each step.\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int max_threads = DEFAULT_THREADS, nr_refs = DEFAULT_REFS;
+    unsigned int seconds = DEFAULT_SECONDS, nr_threads, i;
+    uint32_t domid = 0, *refs;
+    struct worker *workers;
+    xc_gntshr *xgs;
+    void *shared;
+    int opt, rc = 0;
+
+    while ( (opt = getopt(argc, argv, "t:r:s:d:h")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 't':
+            max_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            nr_refs = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            domid = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( !max_threads || !nr_refs || !seconds )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    refs = calloc(max_threads * nr_refs, sizeof(*refs));
+    workers = calloc(max_threads, sizeof(*workers));
+    if ( !refs || !workers )
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    xgs = xc_gntshr_open(NULL, 0);
+    if ( !xgs )
+    {
+        fprintf(stderr, "failed to open gntshr: %s\n", strerror(errno));
+        return 1;
+    }
+
+    shared = xc_gntshr_share_pages(xgs, domid, max_threads * nr_refs,
+                                   refs, 1);
+    if ( !shared )
+    {
+        fprintf(stderr, "failed to share %u pages: %s\n",
+                max_threads * nr_refs, strerror(errno));
+        xc_gntshr_close(xgs);
+        return 1;
+    }
+
+    for ( i = 0; i < max_threads; i++ )
+    {
+        workers[i].domid = domid;
+        workers[i].refs = &refs[i * nr_refs];
+        workers[i].nr_refs = nr_refs;
+        workers[i].xcg = xc_gnttab_open(NULL, 0);
+        if ( !workers[i].xcg )
+        {
+            fprintf(stderr, "failed to open gnttab: %s\n", strerror(errno));
+            rc = 1;
+            goto out;
+        }
+    }
+
+    printf("%7s %14s %14s\n", "threads", "ops/s", "ops/s/thread");
+    for ( nr_threads = 1; ; nr_threads *= 2 )
+    {
+        if ( nr_threads > max_threads )
+            nr_threads = max_threads;
+        if ( run(workers, nr_threads, seconds) )
+        {
+            rc = 1;
+            break;
+        }
+        if ( nr_threads == max_threads )
+            break;
+    }
+
+ out:
+    for ( i = 0; i < max_threads; i++ )
+        if ( workers[i].xcg )
+            xc_gnttab_close(workers[i].xcg);
+    xc_gntshr_munmap(xgs, shared, max_threads * nr_refs);
+    xc_gntshr_close(xgs);
+    free(workers);
+    free(refs);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,314 @@
+/*
+ * heap-scale.c
+ *
+ * Measure the throughput of the Xen heap allocator as the number of
+ * concurrent allocating threads grows.
+ *
+ * Each thread repeatedly populates a private range of guest frames of one
+ * of the target domains and releases them again (XENMEM_populate_physmap
+ * and XENMEM_decrease_reservation), so that every operation goes through
+ * alloc_heap_pages() and free_heap_pages() in the hypervisor.  Threads are
+ * spread round-robin over the target domains, so that the per-domain
+ * page_alloc_lock doesn't hide contention on the heap itself, and with -N
+ * also over the NUMA nodes.
+ *
+ * The target domains should be idle spare domains (e.g. created paused).
+ * Their maximum reservation is raised for the duration of the test.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <xenctrl.h>
+
+#define DEFAULT_THREADS  16
+#define DEFAULT_EXTENTS  64
+#define DEFAULT_SECONDS   5
+#define DEFAULT_BASE     (1UL << 24) /* 64GiB: above any test guest's RAM */
+#define MAX_DOMAINS      16
+
+struct worker {
+    pthread_t thread;
+    xc_interface *xch;
+    uint32_t domid;
+    unsigned int mem_flags;
+    xen_pfn_t *gpfns, *extents;
+    unsigned long ops;
+    int err;
+};
+
+static volatile int stop;
+static unsigned int nr_extents = DEFAULT_EXTENTS, order;
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+
+    while ( !stop )
+    {
+        /* PV domains get MFNs back in place of the requested GPFNs. */
+        memcpy(w->extents, w->gpfns, nr_extents * sizeof(*w->extents));
+
+        if ( xc_domain_populate_physmap_exact(w->xch, w->domid, nr_extents,
+                                              order, w->mem_flags,
+                                              w->extents) )
+        {
+            w->err = errno;
+            break;
+        }
+
+        if ( xc_domain_decrease_reservation_exact(w->xch, w->domid,
+                                                  nr_extents, order,
+                                                  w->extents) )
+        {
+            w->err = errno;
+            break;
+        }
+
+        w->ops += 2 * nr_extents;
+    }
+
+    return NULL;
+}
+
+static int run(struct worker *workers, unsigned int nr_threads,
+               unsigned int seconds)
+{
+    unsigned int i;
+    unsigned long ops = 0;
+    uint64_t start, elapsed;
+    int rc = 0;
+
+    stop = 0;
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        workers[i].ops = 0;
+        workers[i].err = 0;
+    }
+
+    start = now_usec();
+    for ( i = 0; i < nr_threads; i++ )
+        if ( pthread_create(&workers[i].thread, NULL, worker_fn,
+                            &workers[i]) )
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            stop = 1;
+            nr_threads = i;
+            rc = -1;
+            break;
+        }
+
+    if ( !rc )
+        sleep(seconds);
+    stop = 1;
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+        if ( workers[i].err )
+        {
+            fprintf(stderr, "thread %u: %s\n", i, strerror(workers[i].err));
+            rc = -1;
+        }
+    }
+    elapsed = now_usec() - start;
+
+    if ( !rc )
+        printf("%7u %14.0f %14.0f\n", nr_threads,
+               ops * 1e6 / elapsed, ops * 1e6 / elapsed / nr_threads);
+
+    return rc;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t max-threads] [-e extents-per-op] [-o order] "
+            "[-s seconds-per-step]\n"
+            "          [-b base-gpfn] [-N] -d domid [-d domid ...]\n"
+            "Runs with 1, 2, 4, ... up to max-threads allocating threads and "
+            "reports\nallocations+frees of 2^order pages per second for each "
+            "step.\n-N binds thread i to NUMA node i %% nr_nodes.\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int max_threads = DEFAULT_THREADS, seconds = DEFAULT_SECONDS;
+    unsigned int nr_doms = 0, nr_raised = 0, nr_nodes = 1, per_dom;
+    unsigned int nr_threads, i, j;
+    unsigned long base = DEFAULT_BASE;
+    uint32_t domids[MAX_DOMAINS];
+    unsigned long max_memkb[MAX_DOMAINS];
+    struct worker *workers;
+    xc_interface *xch;
+    xc_physinfo_t physinfo = { 0 };
+    xc_dominfo_t info;
+    int opt, numa = 0, rc = 0;
+
+    while ( (opt = getopt(argc, argv, "t:e:o:s:b:d:Nh")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 't':
+            max_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            nr_extents = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            order = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            base = strtoul(optarg, NULL, 0);
+            break;
+        case 'N':
+            numa = 1;
+            break;
+        case 'd':
+            if ( nr_doms == MAX_DOMAINS )
+            {
+                fprintf(stderr, "at most %u domains\n", MAX_DOMAINS);
+                return 1;
+            }
+            domids[nr_doms++] = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( !max_threads || !nr_extents || !seconds || !nr_doms || order > 18 )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    workers = calloc(max_threads, sizeof(*workers));
+    if ( !workers )
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+    {
+        fprintf(stderr, "failed to open xc interface: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if ( numa )
+    {
+        if ( xc_physinfo(xch, &physinfo) )
+        {
+            fprintf(stderr, "failed to get physinfo: %s\n", strerror(errno));
+            rc = 1;
+            goto out_close;
+        }
+        nr_nodes = physinfo.nr_nodes ?: 1;
+    }
+
+    /* Make room for the pages of all the threads using each domain. */
+    per_dom = (max_threads + nr_doms - 1) / nr_doms;
+    for ( i = 0; i < nr_doms; i++ )
+    {
+        if ( xc_domain_getinfo(xch, domids[i], 1, &info) != 1 ||
+             info.domid != domids[i] )
+        {
+            fprintf(stderr, "no domain %u\n", domids[i]);
+            rc = 1;
+            goto out_restore;
+        }
+        max_memkb[i] = info.max_memkb;
+        if ( xc_domain_setmaxmem(xch, domids[i],
+                                 max_memkb[i] + ((unsigned long)per_dom *
+                                                 nr_extents << order) *
+                                 (XC_PAGE_SIZE >> 10)) )
+        {
+            fprintf(stderr, "failed to raise maxmem of domain %u: %s\n",
+                    domids[i], strerror(errno));
+            rc = 1;
+            goto out_restore;
+        }
+        nr_raised++;
+    }
+
+    for ( i = 0; i < max_threads; i++ )
+    {
+        struct worker *w = &workers[i];
+
+        w->domid = domids[i % nr_doms];
+        w->mem_flags = numa ? XENMEMF_exact_node(i % nr_nodes) : 0;
+        w->gpfns = calloc(nr_extents, sizeof(*w->gpfns));
+        w->extents = calloc(nr_extents, sizeof(*w->extents));
+        w->xch = xc_interface_open(NULL, NULL, 0);
+        if ( !w->gpfns || !w->extents || !w->xch )
+        {
+            fprintf(stderr, "failed to set up thread %u\n", i);
+            rc = 1;
+            goto out;
+        }
+        for ( j = 0; j < nr_extents; j++ )
+            w->gpfns[j] = base + (((unsigned long)i * nr_extents + j) << order);
+    }
+
+    printf("%7s %14s %14s\n", "threads", "ops/s", "ops/s/thread");
+    for ( nr_threads = 1; ; nr_threads *= 2 )
+    {
+        if ( nr_threads > max_threads )
+            nr_threads = max_threads;
+        if ( run(workers, nr_threads, seconds) )
+        {
+            rc = 1;
+            break;
+        }
+        if ( nr_threads == max_threads )
+            break;
+    }
+
+ out:
+    for ( i = 0; i < max_threads; i++ )
+    {
+        if ( workers[i].xch )
+            xc_interface_close(workers[i].xch);
+        free(workers[i].gpfns);
+        free(workers[i].extents);
+    }
+ out_restore:
+    for ( i = 0; i < nr_raised; i++ )
+        xc_domain_setmaxmem(xch, domids[i], max_memkb[i]);
+ out_close:
+    xc_interface_close(xch);
+    free(workers);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,279 @@
+/*
+ * Rangeset stress test
+ *
+ * Builds xen/common/rangeset.c and xen/common/rbtree.c in user space.
+ * First checks random add/remove operations against a reference bitmap,
+ * then reports the latency of add, remove and contains operations on sets
+ * of increasing size, up to 10000 ranges by default.
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "emul.h"
+
+#define UNIVERSE        4096
+#define CHECK_OPS     200000
+#define DEFAULT_RANGES 10000
+#define TIMED_OPS    1000000
+
+static unsigned char ref[UNIVERSE];
+
+struct walk {
+    unsigned long next;
+    int err;
+};
+
+static int check_range(unsigned long s, unsigned long e, void *arg)
+{
+    struct walk *w = arg;
+    unsigned long i;
+
+    /* Ranges must be ordered, maximal and match the reference exactly. */
+    if ( s < w->next || (s && ref[s - 1]) || (e + 1 < UNIVERSE && ref[e + 1]) )
+        w->err = 1;
+    for ( i = w->next; i < s; i++ )
+        if ( ref[i] )
+            w->err = 1;
+    for ( i = s; i <= e; i++ )
+        if ( !ref[i] )
+            w->err = 1;
+    w->next = e + 1;
+
+    return w->err;
+}
+
+static int check_set(struct rangeset *r)
+{
+    struct walk w = { 0, 0 };
+    unsigned long i;
+
+    rangeset_report_ranges(r, 0, UNIVERSE - 1, check_range, &w);
+    for ( i = w.next; i < UNIVERSE; i++ )
+        if ( ref[i] )
+            w.err = 1;
+
+    return w.err;
+}
+
+static int check_random_ops(void)
+{
+    struct rangeset *r = rangeset_new(NULL, "check", 0);
+    unsigned long s, e, i;
+    unsigned int op;
+    int contains, overlaps;
+
+    for ( op = 0; op < CHECK_OPS; op++ )
+    {
+        s = rand() % UNIVERSE;
+        e = s + rand() % (rand() & 1 ? 4 : 64);
+        if ( e >= UNIVERSE )
+            e = UNIVERSE - 1;
+
+        switch ( rand() % 3 )
+        {
+        case 0:
+            if ( rangeset_add_range(r, s, e) )
+                goto fail;
+            memset(&ref[s], 1, e - s + 1);
+            break;
+        case 1:
+            if ( rangeset_remove_range(r, s, e) )
+                goto fail;
+            memset(&ref[s], 0, e - s + 1);
+            break;
+        default:
+            contains = 1;
+            overlaps = 0;
+            for ( i = s; i <= e; i++ )
+            {
+                contains &= ref[i];
+                overlaps |= ref[i];
+            }
+            if ( !rangeset_contains_range(r, s, e) != !contains ||
+                 !rangeset_overlaps_range(r, s, e) != !overlaps )
+                goto fail;
+            break;
+        }
+
+        if ( (op % 64) == 0 && check_set(r) )
+            goto fail;
+    }
+
+    if ( check_set(r) )
+        goto fail;
+
+    rangeset_destroy(r);
+    return 0;
+
+ fail:
+    printf("FAILED at operation %u [%lu,%lu]\n", op, s, e);
+    rangeset_printk(r);
+    printf("\n");
+    rangeset_destroy(r);
+    return 1;
+}
+
+static int check_limit(void)
+{
+    struct rangeset *r = rangeset_new(NULL, "limit", 0);
+    int rc = 0;
+
+    rangeset_limit(r, 2);
+    if ( rangeset_add_range(r, 0, 1) || rangeset_add_range(r, 4, 5) ||
+         rangeset_add_range(r, 8, 9) != -ENOMEM ||
+         /* Merging doesn't need a new range, splitting does. */
+         rangeset_add_range(r, 2, 3) ||
+         rangeset_remove_range(r, 2, 2) ||
+         rangeset_remove_range(r, 4, 4) != -ENOMEM )
+        rc = 1;
+
+    rangeset_destroy(r);
+    return rc;
+}
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void shuffle(unsigned long *a, unsigned long n)
+{
+    unsigned long i, j, t;
+
+    for ( i = n - 1; i > 0; i-- )
+    {
+        j = rand() % (i + 1);
+        t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+    }
+}
+
+/*
+ * Time operations on a set of nr disjoint ranges [8i,8i+1].  Singletons
+ * 8i+4 are added and removed in random order, so the set never holds
+ * fewer than nr or more than 2*nr ranges.
+ */
+static int time_ops(unsigned long nr)
+{
+    struct rangeset *r = rangeset_new(NULL, "timed", 0);
+    unsigned long *slot = malloc(nr * sizeof(*slot));
+    unsigned long i, done, hits = 0;
+    uint64_t t, t_add = 0, t_remove = 0, t_contains;
+    int rc = 1;
+
+    if ( !r || !slot )
+        goto out;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        slot[i] = i;
+        if ( rangeset_add_range(r, 8 * i, 8 * i + 1) )
+            goto out;
+    }
+
+    for ( done = 0; done < TIMED_OPS; done += nr )
+    {
+        shuffle(slot, nr);
+
+        t = now_nsec();
+        for ( i = 0; i < nr; i++ )
+            if ( rangeset_add_singleton(r, 8 * slot[i] + 4) )
+                goto out;
+        t_add += now_nsec() - t;
+
+        shuffle(slot, nr);
+
+        t = now_nsec();
+        for ( i = 0; i < nr; i++ )
+            if ( rangeset_remove_singleton(r, 8 * slot[i] + 4) )
+                goto out;
+        t_remove += now_nsec() - t;
+    }
+
+    t = now_nsec();
+    for ( i = 0; i < done; i++ )
+        hits += rangeset_contains_singleton(r, rand() % (8 * nr));
+    t_contains = now_nsec() - t;
+
+    /* A quarter of all points are covered. */
+    if ( hits < done / 8 || hits > done / 2 )
+        goto out;
+
+    printf("%8lu %12.1f %12.1f %12.1f\n", nr,
+           (double)t_add / done, (double)t_remove / done,
+           (double)t_contains / done);
+    rc = 0;
+
+ out:
+    if ( rc )
+        printf("FAILED timing %lu ranges\n", nr);
+    free(slot);
+    rangeset_destroy(r);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long max_ranges = DEFAULT_RANGES, nr;
+    int rc = 0;
+
+    if ( argc > 1 )
+        max_ranges = strtoul(argv[1], NULL, 0);
+    if ( !max_ranges )
+    {
+        fprintf(stderr, "usage: %s [max-ranges]\n", argv[0]);
+        return 1;
+    }
+
+    srand(1);
+
+    printf("Checking random operations against reference ... ");
+    if ( check_random_ops() )
+        return 1;
+    printf("okay\n");
+
+    printf("Checking range limit ... ");
+    if ( check_limit() )
+    {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("okay\n");
+
+    printf("%8s %12s %12s %12s\n", "ranges", "add ns", "remove ns",
+           "contains ns");
+    for ( nr = 10; ; nr *= 10 )
+    {
+        if ( nr > max_ranges )
+            nr = max_ranges;
+        rc |= time_ops(nr);
+        if ( nr == max_ranges )
+            break;
+    }
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
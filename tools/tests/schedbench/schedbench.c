@@ -0,0 +1,304 @@
+/*
+ * schedbench.c
+ *
+ * Measure wakeup-to-run latency as seen from inside a guest, to compare
+ * scheduler configurations (e.g. credit2 runqueue arrangements) under
+ * load from many short-running vCPUs.
+ *
+ * Each sleeper thread repeatedly blocks until an absolute deadline and
+ * records how late it got to run.  With -P a sleeper is instead woken by a
+ * dedicated waker thread writing a timestamp into a pipe, which measures a
+ * cross-vCPU wakeup.  Whenever the guest vCPUs are idle they block in Xen,
+ * so the latency includes the time for Xen to wake and schedule the vCPU.
+ * Optional busy threads (-b) compete for the vCPUs, and running several
+ * instances in different guests loads the host scheduler.
+ *
+ * The latency distribution over all sleepers is reported as percentiles.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DEFAULT_THREADS     8
+#define DEFAULT_PERIOD_US 1000
+#define DEFAULT_SECONDS     10
+
+/* 1us buckets up to 10ms, with one overflow bucket. */
+#define NR_BUCKETS       10000
+
+struct sleeper {
+    pthread_t thread, waker;
+    int pipe[2];
+    unsigned long hist[NR_BUCKETS + 1];
+    uint64_t max;
+    unsigned long samples;
+    int err;
+};
+
+static volatile int stop;
+static unsigned int period_us = DEFAULT_PERIOD_US;
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Sleep until a deadline up to two periods away, spread to avoid lockstep. */
+static uint64_t sleep_period(unsigned int *seed)
+{
+    uint64_t deadline = now_nsec() + 1000ull * period_us +
+                        rand_r(seed) % (1000ull * period_us);
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000,
+        .tv_nsec = deadline % 1000000000,
+    };
+
+    while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+            EINTR )
+        ;
+
+    return deadline;
+}
+
+static void record(struct sleeper *s, uint64_t lat)
+{
+    uint64_t us = lat / 1000;
+
+    s->hist[us < NR_BUCKETS ? us : NR_BUCKETS]++;
+    if ( lat > s->max )
+        s->max = lat;
+    s->samples++;
+}
+
+static void *sleeper_fn(void *arg)
+{
+    struct sleeper *s = arg;
+    unsigned int seed = (uintptr_t)s;
+    uint64_t deadline, t;
+
+    while ( !stop )
+    {
+        if ( s->pipe[0] >= 0 )
+        {
+            if ( read(s->pipe[0], &deadline, sizeof(deadline)) !=
+                 sizeof(deadline) )
+            {
+                if ( !stop )
+                    s->err = errno ?: EIO;
+                break;
+            }
+        }
+        else
+            deadline = sleep_period(&seed);
+
+        t = now_nsec();
+        record(s, t > deadline ? t - deadline : 0);
+    }
+
+    return NULL;
+}
+
+static void *waker_fn(void *arg)
+{
+    struct sleeper *s = arg;
+    unsigned int seed = ~(uintptr_t)s;
+    uint64_t t;
+
+    while ( !stop )
+    {
+        sleep_period(&seed);
+        t = now_nsec();
+        if ( write(s->pipe[1], &t, sizeof(t)) != sizeof(t) )
+        {
+            s->err = errno ?: EIO;
+            break;
+        }
+    }
+
+    /* Let the sleeper see stop. */
+    close(s->pipe[1]);
+
+    return NULL;
+}
+
+static void *busy_fn(void *arg)
+{
+    volatile unsigned long spin = 0;
+
+    while ( !stop )
+        spin++;
+
+    return NULL;
+}
+
+static void report(struct sleeper *sleepers, unsigned int nr)
+{
+    static const double pct[] = { 50, 90, 99, 99.9, 99.99 };
+    unsigned long hist[NR_BUCKETS + 1] = { 0 }, samples = 0, sum;
+    uint64_t max = 0;
+    unsigned int i, b, p;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        for ( b = 0; b <= NR_BUCKETS; b++ )
+            hist[b] += sleepers[i].hist[b];
+        samples += sleepers[i].samples;
+        if ( sleepers[i].max > max )
+            max = sleepers[i].max;
+    }
+
+    printf("%lu wakeups\n", samples);
+    if ( !samples )
+        return;
+
+    for ( p = 0, b = 0, sum = 0; p < sizeof(pct) / sizeof(pct[0]); p++ )
+    {
+        while ( b < NR_BUCKETS && sum + hist[b] < samples * pct[p] / 100 )
+            sum += hist[b++];
+        if ( b < NR_BUCKETS )
+            printf("p%-6g %8u us\n", pct[p], b + 1);
+        else
+            printf("p%-6g   >%5u us\n", pct[p], NR_BUCKETS);
+    }
+    printf("max     %8.0f us\n", max / 1000.0);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t sleepers] [-b busy-threads] [-p period-us] "
+            "[-s seconds] [-P]\n"
+            "Reports wakeup-to-run latency percentiles of threads "
+            "sleeping for\n1-2 periods at a time.  -P wakes each sleeper "
+            "from another thread\nthrough a pipe instead of a timer.\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nr_threads = DEFAULT_THREADS, nr_busy = 0;
+    unsigned int seconds = DEFAULT_SECONDS, i;
+    struct sleeper *sleepers;
+    pthread_t *busy;
+    int opt, use_pipe = 0, rc = 0;
+
+    while ( (opt = getopt(argc, argv, "t:b:p:s:Ph")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 't':
+            nr_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            nr_busy = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            period_us = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            use_pipe = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( !nr_threads || !period_us || !seconds )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    sleepers = calloc(nr_threads, sizeof(*sleepers));
+    busy = calloc(nr_busy ?: 1, sizeof(*busy));
+    if ( !sleepers || !busy )
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for ( i = 0; i < nr_busy; i++ )
+        if ( pthread_create(&busy[i], NULL, busy_fn, NULL) )
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            stop = 1;
+            nr_busy = i;
+            rc = 1;
+            goto out;
+        }
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        struct sleeper *s = &sleepers[i];
+
+        s->pipe[0] = s->pipe[1] = -1;
+        if ( use_pipe && pipe(s->pipe) )
+        {
+            fprintf(stderr, "pipe: %s\n", strerror(errno));
+            stop = 1;
+            nr_threads = i;
+            rc = 1;
+            goto out;
+        }
+
+        if ( pthread_create(&s->thread, NULL, sleeper_fn, s) ||
+             (use_pipe && pthread_create(&s->waker, NULL, waker_fn, s)) )
+        {
+            /* Cannot unwind a half set up pair: give up. */
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    sleep(seconds);
+    stop = 1;
+
+ out:
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        if ( use_pipe )
+            pthread_join(sleepers[i].waker, NULL);
+        pthread_join(sleepers[i].thread, NULL);
+        if ( sleepers[i].pipe[0] >= 0 )
+            close(sleepers[i].pipe[0]);
+        if ( sleepers[i].err )
+        {
+            fprintf(stderr, "thread %u: %s\n", i,
+                    strerror(sleepers[i].err));
+            rc = 1;
+        }
+    }
+    for ( i = 0; i < nr_busy; i++ )
+        pthread_join(busy[i], NULL);
+
+    if ( !rc )
+        report(sleepers, nr_threads);
+
+    free(busy);
+    free(sleepers);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
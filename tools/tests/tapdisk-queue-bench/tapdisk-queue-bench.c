@@ -0,0 +1,326 @@
+/*
+ * tapdisk-queue-bench.c
+ *
+ * fio-style random I/O benchmark for the tapdisk I/O queue drivers
+ * (rwio, lio and uring), built from the blktap2 sources.
+ *
+ * A fixed number of requests is kept queued against an image file or
+ * block device, each completion issuing a new request at a random
+ * block-aligned offset, and the queue is driven through the tapdisk
+ * scheduler exactly as tapdisk2 does.  For every driver the achieved
+ * IOPS and the CPU time consumed per request (user + system, including
+ * any kernel worker threads of the process) are reported.
+ *
+ * Use a file on tmpfs or a ramdisk (e.g. /dev/ram0) to take the storage
+ * out of the picture and compare submission and completion overheads.
+ * Request buffers are registered with the queue, as tapdisk2 does with
+ * the blkif data pages, unless -n is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "tapdisk-queue.h"
+#include "tapdisk-server.h"
+#include "scheduler.h"
+
+#define DEFAULT_DRIVERS  "rwio,lio,uring"
+#define DEFAULT_BS        4096
+#define DEFAULT_DEPTH       32
+#define DEFAULT_SECONDS      5
+#define DEFAULT_SIZE_MB    256
+
+struct bench {
+    struct tqueue queue;
+    struct tiocb *tiocbs;
+    char *bufs;
+    int fd;
+    size_t bs;
+    unsigned long blocks;
+    unsigned int write_pct;
+    unsigned int seed;
+    int stop;
+    unsigned long inflight, done, errors;
+};
+
+static scheduler_t sched;
+
+/* tapdisk-queue.c registers its completion events with the server. */
+event_id_t tapdisk_server_register_event(char mode, int fd, int timeout,
+                                         event_cb_t cb, void *private)
+{
+    return scheduler_register_event(&sched, mode, fd, timeout, cb, private);
+}
+
+void tapdisk_server_unregister_event(event_id_t id)
+{
+    scheduler_unregister_event(&sched, id);
+}
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint64_t cpu_usec(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void complete(void *arg, struct tiocb *tiocb, int err);
+
+static void queue_request(struct bench *b, struct tiocb *tiocb)
+{
+    char *buf = b->bufs + (tiocb - b->tiocbs) * b->bs;
+    long long off = (long long)(rand_r(&b->seed) % b->blocks) * b->bs;
+    int rw = rand_r(&b->seed) % 100 < b->write_pct;
+
+    tapdisk_prep_tiocb(tiocb, b->fd, rw, buf, b->bs, off, complete, b);
+    tapdisk_queue_tiocb(&b->queue, tiocb);
+    b->inflight++;
+}
+
+static void complete(void *arg, struct tiocb *tiocb, int err)
+{
+    struct bench *b = arg;
+
+    b->inflight--;
+    b->done++;
+    if ( err )
+    {
+        /* Requeueing from a failed submission would corrupt its list. */
+        b->errors++;
+        b->stop = 1;
+    }
+
+    if ( !b->stop )
+        queue_request(b, tiocb);
+}
+
+static int run(struct bench *b, const char *name, unsigned int depth,
+               unsigned int seconds, int register_bufs)
+{
+    uint64_t start, cpu, end;
+    unsigned int i;
+    int drv, err;
+
+    drv = tapdisk_queue_driver(name);
+    if ( drv < 0 )
+    {
+        fprintf(stderr, "unknown driver '%s'\n", name);
+        return -1;
+    }
+
+    err = tapdisk_init_queue(&b->queue, depth, drv, NULL);
+    if ( err )
+    {
+        fprintf(stderr, "%s: cannot set up queue: %s\n", name,
+                strerror(-err));
+        return -1;
+    }
+
+    if ( register_bufs )
+        tapdisk_queue_register_buffer(&b->queue, b->bufs, depth * b->bs);
+
+    b->stop = 0;
+    b->inflight = b->done = b->errors = 0;
+
+    start = now_usec();
+    cpu = cpu_usec();
+
+    for ( i = 0; i < depth; i++ )
+        queue_request(b, &b->tiocbs[i]);
+
+    while ( b->inflight )
+    {
+        /* One batch at a time: rwio requeues from within submit. */
+        tapdisk_submit_tiocbs(&b->queue);
+
+        if ( !b->stop && now_usec() - start >= seconds * 1000000ull )
+            b->stop = 1;
+
+        /* rwio completes everything within submit. */
+        if ( b->queue.tiocbs_pending &&
+             scheduler_wait_for_events(&sched) < 0 && errno != EINTR )
+        {
+            fprintf(stderr, "%s: wait failed: %s\n", name, strerror(errno));
+            break;
+        }
+    }
+
+    end = now_usec();
+    cpu = cpu_usec() - cpu;
+
+    if ( register_bufs )
+        tapdisk_queue_unregister_buffer(&b->queue, b->bufs);
+    tapdisk_free_queue(&b->queue);
+
+    if ( b->inflight || b->errors )
+    {
+        fprintf(stderr, "%s: %lu requests failed\n", name,
+                b->errors + b->inflight);
+        return -1;
+    }
+
+    printf("%-6s %12.0f %10.1f %14.2f\n", name,
+           b->done * 1e6 / (end - start),
+           b->done * b->bs / (double)(end - start),
+           (double)cpu / b->done);
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d drivers] [-b block-size] [-q depth] "
+            "[-s seconds]\n"
+            "          [-w write-percent] [-S size-MB] [-D] [-n] image\n"
+            "Runs random I/O against image with each of the comma "
+            "separated\nqueue drivers (default %s) and reports IOPS, "
+            "MB/s and CPU usec\nper request.  A regular file smaller "
+            "than size-MB is extended first.\n-D opens the image "
+            "O_DIRECT, -n does not register the request buffers.\n",
+            prog, DEFAULT_DRIVERS);
+}
+
+int main(int argc, char **argv)
+{
+    char drivers[64] = DEFAULT_DRIVERS, *name, *next;
+    unsigned int depth = DEFAULT_DEPTH, seconds = DEFAULT_SECONDS;
+    unsigned long size_mb = DEFAULT_SIZE_MB;
+    int opt, flags = O_RDWR, register_bufs = 1, rc = 0;
+    struct bench b;
+    struct stat st;
+    off_t size;
+
+    memset(&b, 0, sizeof(b));
+    b.bs = DEFAULT_BS;
+    b.seed = 1;
+
+    while ( (opt = getopt(argc, argv, "d:b:q:s:w:S:Dnh")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'd':
+            snprintf(drivers, sizeof(drivers), "%s", optarg);
+            break;
+        case 'b':
+            b.bs = strtoul(optarg, NULL, 0);
+            break;
+        case 'q':
+            depth = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            b.write_pct = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            size_mb = strtoul(optarg, NULL, 0);
+            break;
+        case 'D':
+            flags |= O_DIRECT;
+            break;
+        case 'n':
+            register_bufs = 0;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( optind != argc - 1 || !depth || !seconds || !size_mb ||
+         !b.bs || (b.bs & 511) || b.write_pct > 100 )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    b.fd = open(argv[optind], flags | O_CREAT, 0644);
+    if ( b.fd < 0 || fstat(b.fd, &st) )
+    {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    size = S_ISBLK(st.st_mode) ? lseek(b.fd, 0, SEEK_END) : st.st_size;
+    if ( S_ISREG(st.st_mode) && size < (off_t)(size_mb << 20) )
+    {
+        size = size_mb << 20;
+        if ( ftruncate(b.fd, size) )
+        {
+            fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+            return 1;
+        }
+    }
+
+    b.blocks = size / b.bs;
+    if ( !b.blocks )
+    {
+        fprintf(stderr, "%s: smaller than one block\n", argv[optind]);
+        return 1;
+    }
+
+    b.tiocbs = calloc(depth, sizeof(*b.tiocbs));
+    b.bufs = mmap(NULL, depth * b.bs, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if ( !b.tiocbs || b.bufs == MAP_FAILED )
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    memset(b.bufs, 0x5a, depth * b.bs);
+
+    if ( scheduler_initialize(&sched) )
+    {
+        fprintf(stderr, "cannot set up scheduler\n");
+        return 1;
+    }
+
+    printf("%-6s %12s %10s %14s\n", "driver", "IOPS", "MB/s",
+           "CPU us/req");
+    for ( name = drivers; name; name = next )
+    {
+        next = strchr(name, ',');
+        if ( next )
+            *next++ = '\0';
+        if ( run(&b, name, depth, seconds, register_bufs) )
+            rc = 1;
+    }
+
+    scheduler_destroy(&sched);
+    munmap(b.bufs, depth * b.bs);
+    free(b.tiocbs);
+    close(b.fd);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
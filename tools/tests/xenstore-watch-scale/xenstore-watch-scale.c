@@ -0,0 +1,189 @@
+/*
+ * xenstore-watch-scale.c
+ *
+ * Measure xenstored write throughput as the number of guests, and thus
+ * of watches registered with the daemon, grows.
+ *
+ * Each simulated guest is a separate connection to xenstored with a
+ * number of watches on paths of its own, much like the watches frontend
+ * and backend drivers set up.  For each step the guest count doubles and
+ * a single connection writes to a path none of the watches covers, so
+ * that the cost measured is that of finding out which watches to fire.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <xenstore.h>
+
+#define DEFAULT_GUESTS   512
+#define DEFAULT_WATCHES    8
+#define DEFAULT_WRITES 10000
+
+#define BASE "/tool/xenstore-watch-scale"
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Connect a guest and register its watches. */
+static struct xs_handle *add_guest(unsigned int guest, unsigned int nr_watches)
+{
+    struct xs_handle *xsh;
+    char path[64];
+    unsigned int i;
+
+    xsh = xs_open(0);
+    if ( !xsh )
+        return NULL;
+
+    for ( i = 0; i < nr_watches; i++ )
+    {
+        snprintf(path, sizeof(path), BASE "/guest%u/device/%u/state",
+                 guest, i);
+        if ( !xs_watch(xsh, path, "scale") )
+        {
+            xs_close(xsh);
+            return NULL;
+        }
+    }
+
+    return xsh;
+}
+
+static int run(struct xs_handle *xsh, unsigned int nr_guests,
+               unsigned int nr_watches, unsigned int nr_writes)
+{
+    unsigned int i;
+    uint64_t start, elapsed;
+    char val[16];
+
+    start = now_usec();
+    for ( i = 0; i < nr_writes; i++ )
+    {
+        snprintf(val, sizeof(val), "%u", i);
+        if ( !xs_write(xsh, XBT_NULL, BASE "/target", val, strlen(val)) )
+        {
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    elapsed = now_usec() - start;
+
+    printf("%7u %9u %12.0f\n", nr_guests, nr_guests * nr_watches,
+           nr_writes * 1e6 / elapsed);
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-g max-guests] [-w watches-per-guest] "
+            "[-n writes-per-step]\n"
+            "Runs with 1, 2, 4, ... up to max-guests simulated guests and "
+            "reports\nxenstore writes per second for each step.\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int max_guests = DEFAULT_GUESTS, nr_watches = DEFAULT_WATCHES;
+    unsigned int nr_writes = DEFAULT_WRITES, nr_guests = 0, step;
+    struct xs_handle *xsh, **guests;
+    int opt, rc = 0;
+
+    while ( (opt = getopt(argc, argv, "g:w:n:h")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'g':
+            max_guests = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            nr_watches = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            nr_writes = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( !max_guests || !nr_writes )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    guests = calloc(max_guests, sizeof(*guests));
+    if ( !guests )
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    xsh = xs_open(0);
+    if ( !xsh )
+    {
+        fprintf(stderr, "failed to connect to xenstored: %s\n",
+                strerror(errno));
+        return 1;
+    }
+
+    printf("%7s %9s %12s\n", "guests", "watches", "writes/s");
+    for ( step = 1; ; step *= 2 )
+    {
+        if ( step > max_guests )
+            step = max_guests;
+
+        for ( ; nr_guests < step; nr_guests++ )
+        {
+            guests[nr_guests] = add_guest(nr_guests, nr_watches);
+            if ( !guests[nr_guests] )
+            {
+                fprintf(stderr, "failed to set up guest %u: %s\n",
+                        nr_guests, strerror(errno));
+                rc = 1;
+                goto out;
+            }
+        }
+
+        if ( run(xsh, nr_guests, nr_watches, nr_writes) )
+        {
+            rc = 1;
+            break;
+        }
+        if ( step == max_guests )
+            break;
+    }
+
+ out:
+    while ( nr_guests-- > 0 )
+        xs_close(guests[nr_guests]);
+    xs_rm(xsh, XBT_NULL, BASE);
+    xs_close(xsh);
+    free(guests);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
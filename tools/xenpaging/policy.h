@@ -33,7 +33,10 @@ unsigned long policy_choose_victim(struct xenpaging *paging);
 void policy_notify_paged_out(unsigned long gfn);
 void policy_notify_paged_in(unsigned long gfn);
 void policy_notify_paged_in_nomru(unsigned long gfn);
+void policy_notify_refault(unsigned long gfn);
 void policy_notify_dropped(unsigned long gfn);
+void policy_sample(struct xenpaging *paging);
+void policy_teardown(struct xenpaging *paging);
 
 #endif // __XEN_PAGING_POLICY_H__
 
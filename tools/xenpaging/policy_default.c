@@ -20,22 +20,59 @@
  */
 
 
+#include <time.h>
 #include "xc_bitops.h"
 #include "policy.h"
 
 
+/*
+ * Victims are chosen by a CLOCK hand sweeping over all gfns.  Each gfn
+ * carries a referenced bit and an active bit:
+ *
+ *  - the referenced bit is set when the guest wrote to the page since the
+ *    last sample (see policy_sample()) or when the page was paged in;
+ *  - the active bit is set when the guest faulted on the page after it was
+ *    evicted, or when the page was written in two consecutive samples.
+ *
+ * When the hand passes a gfn it first clears the referenced bit, then on
+ * the next pass the active bit, and only evicts the gfn on a pass where
+ * both are clear.  Pages touched between two passes of the hand therefore
+ * stay resident, and pages known to be part of the working set get one
+ * more revolution, as the Am queue of 2Q.  Recently paged-in pages are kept
+ * resident by the MRU list, which plays the part of the A1 queue.
+ *
+ * The hypervisor does not expose accessed bits, so the guest is sampled by
+ * enabling log-dirty mode and collecting the dirty bitmap.  Only writes are
+ * seen this way; reads are only seen through refaults.
+ */
+
 #define DEFAULT_MRU_SIZE (1024 * 16)
 
+/* Seconds between reports of the eviction and refault counters */
+#define STATS_INTERVAL 10
+
 
 static unsigned long *mru;
 static unsigned int i_mru;
 static unsigned int mru_size;
 static unsigned long *bitmap;
 static unsigned long *unconsumed;
+static unsigned long *referenced;
+static unsigned long *active;
 static unsigned int unconsumed_cleared;
 static unsigned long current_gfn;
 static unsigned long max_pages;
 
+/* Log-dirty sampling of guest writes */
+static xc_hypercall_buffer_t dirty_hbuf;
+static int dirty_enabled;
+static time_t next_sample;
+
+/* Counters */
+static unsigned long nr_evicted, nr_refaults, nr_promoted;
+static unsigned long last_evicted, last_refaults;
+static time_t next_stats;
+
 
 int policy_init(struct xenpaging *paging)
 {
@@ -52,6 +89,13 @@ int policy_init(struct xenpaging *paging)
     unconsumed = bitmap_alloc(max_pages);
     if ( !unconsumed )
         goto out;
+    /* Allocate bitmaps for the working set estimate */
+    referenced = bitmap_alloc(max_pages);
+    if ( !referenced )
+        goto out;
+    active = bitmap_alloc(max_pages);
+    if ( !active )
+        goto out;
 
     /* Initialise MRU list of paged in pages */
     if ( paging->policy_mru_size > 0 )
@@ -82,8 +126,11 @@ unsigned long policy_choose_victim(struct xenpaging *paging)
     xc_interface *xch = paging->xc_handle;
     unsigned long i;
 
-    /* One iteration over all possible gfns */
-    for ( i = 0; i < max_pages; i++ )
+    /*
+     * Up to three revolutions over all possible gfns: one to clear the
+     * referenced bits, one to clear the active bits and one to find a gfn.
+     */
+    for ( i = 0; i < 3 * max_pages; i++ )
     {
         /* Try next gfn */
         current_gfn++;
@@ -111,12 +158,20 @@ unsigned long policy_choose_victim(struct xenpaging *paging)
         if ( test_bit(current_gfn, unconsumed) )
             continue;
 
+        /* gfn used since the last pass, give it another chance */
+        if ( test_and_clear_bit(current_gfn, referenced) )
+            continue;
+
+        /* gfn in the working set, demote it */
+        if ( test_and_clear_bit(current_gfn, active) )
+            continue;
+
         /* gfn found */
         break;
     }
 
     /* Could not nominate any gfn */
-    if ( i >= max_pages )
+    if ( i >= 3 * max_pages )
     {
         /* No more pages, wait in poll */
         paging->use_poll_timeout = 1;
@@ -141,6 +196,7 @@ void policy_notify_paged_out(unsigned long gfn)
 {
     set_bit(gfn, bitmap);
     clear_bit(gfn, unconsumed);
+    nr_evicted++;
 }
 
 static void policy_handle_paged_in(unsigned long gfn, int do_mru)
@@ -152,6 +208,7 @@ static void policy_handle_paged_in(unsigned long gfn, int do_mru)
     
     if (do_mru) {
         mru[i_mru & (mru_size - 1)] = gfn;
+        set_bit(gfn, referenced);
     } else {
         clear_bit(gfn, bitmap);
         mru[i_mru & (mru_size - 1)] = INVALID_MFN;
@@ -170,9 +227,120 @@ void policy_notify_paged_in_nomru(unsigned long gfn)
     policy_handle_paged_in(gfn, 0);
 }
 
+void policy_notify_refault(unsigned long gfn)
+{
+    /* The guest needed the page again, so it belongs to the working set */
+    set_bit(gfn, referenced);
+    set_bit(gfn, active);
+    nr_refaults++;
+}
+
 void policy_notify_dropped(unsigned long gfn)
 {
     clear_bit(gfn, bitmap);
+    clear_bit(gfn, referenced);
+    clear_bit(gfn, active);
+}
+
+static int policy_sample_dirty(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty, (&dirty_hbuf));
+    unsigned long i, promoted;
+    int rc;
+
+    if ( !dirty_enabled )
+    {
+        dirty = xc_hypercall_buffer_alloc(xch, dirty, bitmap_size(max_pages));
+        if ( !dirty )
+        {
+            PERROR("Error allocating dirty bitmap");
+            return -1;
+        }
+
+        rc = xc_shadow_control(xch, paging->mem_event.domain_id,
+                               XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
+                               NULL, 0, NULL, 0, NULL);
+        if ( rc < 0 )
+        {
+            PERROR("Error enabling log-dirty mode");
+            xc_hypercall_buffer_free(xch, dirty);
+            return -1;
+        }
+
+        dirty_enabled = 1;
+        return 0;
+    }
+
+    rc = xc_shadow_control(xch, paging->mem_event.domain_id,
+                           XEN_DOMCTL_SHADOW_OP_CLEAN, HYPERCALL_BUFFER(dirty),
+                           max_pages, NULL, 0, NULL);
+    if ( rc < 0 )
+    {
+        PERROR("Error reading dirty bitmap");
+        return -1;
+    }
+
+    /* Pages written in two consecutive samples are in the working set */
+    for ( i = 0; i < bitmap_size(max_pages) / sizeof(*dirty); i++ )
+    {
+        promoted = dirty[i] & referenced[i] & ~active[i];
+        if ( promoted )
+            nr_promoted += __builtin_popcountl(promoted);
+        active[i] |= dirty[i] & referenced[i];
+        referenced[i] |= dirty[i];
+    }
+
+    return 0;
+}
+
+void policy_sample(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    time_t now = time(NULL);
+
+    if ( paging->policy_sample_interval > 0 && now >= next_sample )
+    {
+        next_sample = now + paging->policy_sample_interval;
+        if ( policy_sample_dirty(paging) )
+        {
+            ERROR("Disabling access sampling");
+            paging->policy_sample_interval = 0;
+        }
+    }
+
+    if ( now >= next_stats )
+    {
+        next_stats = now + STATS_INTERVAL;
+        if ( nr_evicted != last_evicted || nr_refaults != last_refaults )
+            DPRINTF("%lu pages evicted, %lu refaulted, %lu promoted by"
+                    " sampling; last %us: %lu evicted, %lu refaulted (%lu%%)\n",
+                    nr_evicted, nr_refaults, nr_promoted, STATS_INTERVAL,
+                    nr_evicted - last_evicted, nr_refaults - last_refaults,
+                    (nr_refaults - last_refaults) * 100 /
+                    (nr_evicted - last_evicted ?: 1));
+        last_evicted = nr_evicted;
+        last_refaults = nr_refaults;
+    }
+}
+
+void policy_teardown(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty, (&dirty_hbuf));
+
+    DPRINTF("%lu pages evicted, %lu refaulted, %lu promoted by sampling\n",
+            nr_evicted, nr_refaults, nr_promoted);
+
+    if ( !dirty_enabled )
+        return;
+
+    if ( xc_shadow_control(xch, paging->mem_event.domain_id,
+                           XEN_DOMCTL_SHADOW_OP_OFF,
+                           NULL, 0, NULL, 0, NULL) < 0 )
+        PERROR("Error disabling log-dirty mode");
+    xc_hypercall_buffer_free(xch, dirty);
+    dirty_enabled = 0;
 }
 
 
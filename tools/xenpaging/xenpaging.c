@@ -210,6 +210,7 @@ static void usage(void)
     printf(" -f <file>      --pagefile=<file>        pagefile to use. This option is required.\n");
     printf(" -m <max_memkb> --max_memkb=<max_memkb>  maximum amount of memory to handle.\n");
     printf(" -r <num>       --mru_size=<num>         number of paged-in pages to keep in memory.\n");
+    printf(" -s <secs>      --sample=<secs>          sample guest writes every <secs> seconds to find cold pages.\n");
     printf(" -v             --verbose                enable debug output.\n");
     printf(" -h             --help                   this output.\n");
 }
@@ -217,13 +218,14 @@ static void usage(void)
 static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
 {
     int ch;
-    static const char sopts[] = "hvd:f:m:r:";
+    static const char sopts[] = "hvd:f:m:r:s:";
     static const struct option lopts[] = {
         {"help", 0, NULL, 'h'},
         {"verbose", 0, NULL, 'v'},
         {"domain", 1, NULL, 'd'},
         {"pagefile", 1, NULL, 'f'},
         {"mru_size", 1, NULL, 'm'},
+        {"sample", 1, NULL, 's'},
         { }
     };
 
@@ -243,6 +245,9 @@ static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
         case 'r':
             paging->policy_mru_size = atoi(optarg);
             break;
+        case 's':
+            paging->policy_sample_interval = atoi(optarg);
+            break;
         case 'v':
             paging->debug = 1;
             break;
@@ -522,6 +527,9 @@ static void xenpaging_teardown(struct xenpaging *paging)
     xs_unwatch(paging->xs_handle, watch_target_tot_pages, "");
     xs_unwatch(paging->xs_handle, "@releaseDomain", watch_token);
 
+    /* Stop sampling guest accesses */
+    policy_teardown(paging);
+
     paging->xc_handle = NULL;
     /* Tear down domain paging in Xen */
     munmap(paging->mem_event.ring_page, PAGE_SIZE);
@@ -937,6 +945,10 @@ int main(int argc, char *argv[])
                 }
                 else
                 {
+                    /* A vcpu faulted on the page, the eviction was wrong */
+                    if ( req.flags & MEM_EVENT_FLAG_VCPU_PAUSED )
+                        policy_notify_refault(req.gfn);
+
                     /* Populate the page */
                     if ( xenpaging_populate_page(paging, req.gfn, slot) < 0 )
                     {
@@ -1006,6 +1018,9 @@ int main(int argc, char *argv[])
         if ( interrupted )
             break;
 
+        /* Update the working set estimate */
+        policy_sample(paging);
+
         /* Indicate possible error */
         rc = 1;
 
@@ -58,6 +58,7 @@ struct xenpaging {
     int num_paged_out;
     int target_tot_pages;
     int policy_mru_size;
+    int policy_sample_interval;
     int use_poll_timeout;
     int debug;
     int stack_count;
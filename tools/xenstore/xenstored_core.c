@@ -100,21 +100,63 @@ int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
+/* Generation to stamp on the next node record written to the store. */
+static uint64_t generation;
+
+/* If it fails, returns data.dptr == NULL and sets errno. */
+TDB_DATA fetch_record(const char *name)
 {
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
+	TDB_DATA key, data;
+
+	key.dptr = (void *)name;
+	key.dsize = strlen(name);
+	data = tdb_fetch(tdb_ctx, key);
+
+	if (data.dptr == NULL) {
+		if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST)
+			errno = ENOENT;
+		else {
+			log("TDB error on read: %s", tdb_errorstr(tdb_ctx));
+			errno = EIO;
+		}
+	} else if (data.dsize < sizeof(struct xs_tdb_record_hdr)) {
+		log("TDB record for %s truncated", name);
+		talloc_free(data.dptr);
+		data.dptr = NULL;
+		errno = EIO;
+	}
+
+	return data;
 }
 
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
+/* Stamps the record with a new generation.  Sets errno on failure. */
+bool store_record(const char *name, TDB_DATA data)
 {
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
+	TDB_DATA key;
+
+	key.dptr = (void *)name;
+	key.dsize = strlen(name);
+	((struct xs_tdb_record_hdr *)data.dptr)->generation = generation++;
+
+	/* TDB should set errno, but doesn't even set ecode AFAICT. */
+	if (tdb_store(tdb_ctx, key, data, TDB_REPLACE) != 0) {
+		errno = ENOSPC;
+		return false;
+	}
+	return true;
+}
+
+bool delete_record(const char *name)
+{
+	TDB_DATA key;
+
+	key.dptr = (void *)name;
+	key.dsize = strlen(name);
+
+	if (tdb_delete(tdb_ctx, key) != 0) {
+		errno = tdb_error(tdb_ctx) == TDB_ERR_NOEXIST ? ENOENT : EIO;
+		return false;
+	}
 	return true;
 }
 
@@ -403,42 +445,41 @@ bool is_child(const char *child, const char *parent)
 	return child[len] == '/' || child[len] == '\0';
 }
 
+static struct transaction *conn_transaction(struct connection *conn)
+{
+	/* conn = NULL used in manual_node at setup. */
+	return conn ? conn->transaction : NULL;
+}
+
 /* If it fails, returns NULL and sets errno. */
 static struct node *read_node(struct connection *conn, const char *name)
 {
-	TDB_DATA key, data;
-	uint32_t *p;
+	TDB_DATA data;
+	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
+	struct transaction *trans = conn_transaction(conn);
 
-	key.dptr = (void *)name;
-	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
-
-	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
-		}
+	if (trans)
+		data = transaction_fetch(trans, name);
+	else
+		data = fetch_record(name);
+	if (data.dptr == NULL)
 		return NULL;
-	}
 
 	node = talloc(name, struct node);
 	node->name = talloc_strdup(node, name);
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
+	node->trans = trans;
 	talloc_steal(node, data.dptr);
 
 	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
+	hdr = (void *)data.dptr;
+	node->num_perms = hdr->num_perms;
+	node->datalen = hdr->datalen;
+	node->childlen = hdr->childlen;
 
 	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
+	node->perms = hdr->perms;
 	/* Data is binary blob (usually ascii, no nul). */
 	node->data = node->perms + node->num_perms;
 	/* Children is strings, nul separated. */
@@ -451,16 +492,16 @@ static bool write_node(struct connection *conn, const struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * conn_transaction copes with this.
 	 */
 
-	TDB_DATA key, data;
+	TDB_DATA data;
+	struct xs_tdb_record_hdr *hdr;
+	struct transaction *trans = conn_transaction(conn);
 	void *p;
+	bool ok;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	data.dsize = 3*sizeof(uint32_t)
+	data.dsize = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
@@ -468,10 +509,12 @@ static bool write_node(struct connection *conn, const struct node *node)
 		goto error;
 
 	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
+	hdr = (void *)data.dptr;
+	hdr->generation = 0;
+	hdr->num_perms = node->num_perms;
+	hdr->datalen = node->datalen;
+	hdr->childlen = node->childlen;
+	p = hdr->perms;
 
 	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
 	p += node->num_perms*sizeof(node->perms[0]);
@@ -479,9 +522,12 @@ static bool write_node(struct connection *conn, const struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
-		corrupt(conn, "Write of %s failed", key.dptr);
+	if (trans)
+		ok = transaction_store(trans, node->name, data);
+	else
+		ok = store_record(node->name, data);
+	if (!ok) {
+		corrupt(conn, "Write of %s failed", node->name);
 		goto error;
 	}
 	return true;
@@ -797,12 +843,14 @@ static void do_read(struct connection *conn, const char *name)
 
 static void delete_node_single(struct connection *conn, struct node *node)
 {
-	TDB_DATA key;
-
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
+	struct transaction *trans = conn_transaction(conn);
+	bool ok;
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	if (trans)
+		ok = transaction_delete(trans, node->name);
+	else
+		ok = delete_record(node->name);
+	if (!ok) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -843,7 +891,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->trans = conn_transaction(conn);
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -864,15 +912,14 @@ static struct node *construct_node(struct connection *conn, const char *name)
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
+	if (node->trans)
+		transaction_delete(node->trans, node->name);
+	else
+		delete_record(node->name);
 	return 0;
 }
 
@@ -1479,6 +1526,18 @@ static void manual_node(const char *name, const char *child)
 	talloc_free(node);
 }
 
+/* Carry on with the generation count of an existing store. */
+static int max_generation_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
+			   void *private)
+{
+	struct xs_tdb_record_hdr *hdr = (void *)val.dptr;
+
+	if (val.dsize >= sizeof(*hdr) && hdr->generation >= generation)
+		generation = hdr->generation + 1;
+
+	return 0;
+}
+
 static void setup_structure(void)
 {
 	char *tdbname;
@@ -1504,6 +1563,7 @@ static void setup_structure(void)
 		*/
 		char *tlocal = talloc_strdup(NULL, "/local");
 
+		tdb_traverse(tdb_ctx, max_generation_, NULL);
 		check_store();
 
 		if (remove_local) {
@@ -1530,7 +1590,7 @@ static void setup_structure(void)
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1543,7 +1603,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
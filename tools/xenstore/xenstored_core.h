@@ -101,8 +101,8 @@ extern struct list_head connections;
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Transaction I came from (NULL: the store itself) */
+	struct transaction *trans;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -147,14 +147,10 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
-
-/* Destructor for tdbs: required for transaction code */
-int destroy_tdb(void *_tdb);
-
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* Access node records in the store, outside of any transaction. */
+TDB_DATA fetch_record(const char *name);
+bool store_record(const char *name, TDB_DATA data);
+bool delete_record(const char *name);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
@@ -162,6 +158,10 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 /* Is this a valid node name? */
 bool is_valid_nodename(const char *node);
 
+/* Hashtable callbacks for tables keyed by nul-terminated strings. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
+
 /* Tracing infrastructure. */
 void trace_create(const void *data, const char *type);
 void trace_destroy(const void *data, const char *type);
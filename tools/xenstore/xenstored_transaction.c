@@ -28,14 +28,50 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <syslog.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 
+/*
+ * Transactions don't copy the store.  Each node a transaction reads or
+ * writes is recorded as an accessed_node, along with the generation the
+ * node had in the store when the transaction first looked at it.  Writes
+ * and deletions only go to the accessed_node.  At commit the transaction
+ * fails with EAGAIN if any node it accessed has been changed in the store
+ * since; otherwise its modifications are written back.  So starting a
+ * transaction is O(1), and committing it is O(nodes accessed).
+ */
+
+/* Generation of a node which doesn't exist. */
+#define NO_GENERATION ~((uint64_t)0)
+
+struct accessed_node
+{
+	/* List of all nodes accessed in the context of this transaction. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* Generation of the node in the store when first accessed. */
+	uint64_t generation;
+
+	/* Has this transaction written or deleted the node? */
+	bool modified;
+
+	/* Record of the modified node: dptr is NULL if it was deleted. */
+	TDB_DATA data;
+
+	/* Record in the store before commit, to undo a failed commit. */
+	TDB_DATA old;
+};
+
 struct changed_node
 {
 	/* List of all changed nodes in the context of this transaction. */
@@ -68,12 +104,9 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
-	unsigned int generation;
-
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* List of accessed nodes, and the same indexed by name. */
+	struct list_head accessed;
+	struct hashtable *accessed_hash;
 
 	/* List of changed nodes. */
 	struct list_head changes;
@@ -83,12 +116,132 @@ struct transaction
 };
 
 extern int quota_max_transaction;
-static unsigned int generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+static struct accessed_node *find_accessed_node(struct transaction *trans,
+						const char *name)
+{
+	return hashtable_search(trans->accessed_hash, (void *)name);
+}
+
+/*
+ * Record the first access to a node, noting its generation in the store.
+ * If data is not NULL, the node's record in the store is returned there
+ * (dptr is NULL if the node doesn't exist).  Returns NULL and sets errno
+ * on failure.
+ */
+static struct accessed_node *add_accessed_node(struct transaction *trans,
+					       const char *name,
+					       TDB_DATA *data)
+{
+	struct accessed_node *i;
+	struct xs_tdb_record_hdr *hdr;
+	TDB_DATA rec;
+	char *key = NULL;
+
+	rec = fetch_record(name);
+	if (rec.dptr == NULL && errno != ENOENT)
+		return NULL;
+	hdr = (void *)rec.dptr;
+
+	i = talloc_zero(trans, struct accessed_node);
+	if (!i)
+		goto nomem;
+	i->node = talloc_strdup(i, name);
+	key = strdup(name);
+	if (!i->node || !key)
+		goto nomem;
+	i->generation = hdr ? hdr->generation : NO_GENERATION;
+	if (!hashtable_insert(trans->accessed_hash, key, i))
+		goto nomem;
+	list_add_tail(&i->list, &trans->accessed);
+
+	if (data)
+		*data = rec;
+	else
+		talloc_free(rec.dptr);
+	return i;
+
+ nomem:
+	free(key);
+	talloc_free(i);
+	talloc_free(rec.dptr);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* Read a node as seen by the transaction.  Sets errno on failure. */
+TDB_DATA transaction_fetch(struct transaction *trans, const char *name)
+{
+	struct accessed_node *i;
+	TDB_DATA data = { NULL, 0 };
+
+	i = find_accessed_node(trans, name);
+	if (!i) {
+		if (add_accessed_node(trans, name, &data) && !data.dptr)
+			errno = ENOENT;
+		return data;
+	}
+
+	/* Unmodified nodes are checked at commit: just look at the store. */
+	if (!i->modified)
+		return fetch_record(name);
+
+	if (!i->data.dptr) {
+		errno = ENOENT;
+		return data;
+	}
+
+	data.dptr = talloc_memdup(NULL, i->data.dptr, i->data.dsize);
+	if (!data.dptr) {
+		errno = ENOMEM;
+		return data;
+	}
+	data.dsize = i->data.dsize;
+	return data;
+}
+
+/* Write a node in the transaction only.  Sets errno on failure. */
+bool transaction_store(struct transaction *trans, const char *name,
+		       TDB_DATA data)
 {
-	return trans->tdb;
+	struct accessed_node *i;
+	void *dptr;
+
+	i = find_accessed_node(trans, name);
+	if (!i)
+		i = add_accessed_node(trans, name, NULL);
+	if (!i)
+		return false;
+
+	dptr = talloc_memdup(i, data.dptr, data.dsize);
+	if (!dptr) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	talloc_free(i->data.dptr);
+	i->data.dptr = dptr;
+	i->data.dsize = data.dsize;
+	i->modified = true;
+	return true;
+}
+
+/* Delete a node in the transaction only.  Sets errno on failure. */
+bool transaction_delete(struct transaction *trans, const char *name)
+{
+	struct accessed_node *i;
+
+	i = find_accessed_node(trans, name);
+	if (!i)
+		i = add_accessed_node(trans, name, NULL);
+	if (!i)
+		return false;
+
+	talloc_free(i->data.dptr);
+	i->data.dptr = NULL;
+	i->data.dsize = 0;
+	i->modified = true;
+	return true;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -97,11 +250,9 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 {
 	struct changed_node *i;
 
-	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+	/* They're changing the global database: nothing to track. */
+	if (!trans)
 		return;
-	}
 
 	list_for_each_entry(i, &trans->changes, list)
 		if (streq(i->node, node))
@@ -113,14 +264,79 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 	list_add_tail(&i->list, &trans->changes);
 }
 
+/* Put back a node's record as it was before the commit started. */
+static void restore_record(struct accessed_node *i)
+{
+	bool ok;
+
+	if (i->old.dptr)
+		ok = store_record(i->node, i->old);
+	else
+		ok = delete_record(i->node) || errno == ENOENT;
+	if (!ok)
+		syslog(LOG_ERR, "xenstored: failed to restore %s after failed "
+		       "transaction commit", i->node);
+}
+
+/*
+ * Write the transaction's modifications back to the store, unless one of
+ * the nodes it accessed has changed there meanwhile.  Either all of the
+ * modifications are written, or none: if a write fails, the nodes written
+ * so far get their old records back.  Returns an errno value on failure.
+ */
+static int commit_transaction(struct transaction *trans)
+{
+	struct accessed_node *i, *j;
+	struct xs_tdb_record_hdr *hdr;
+	TDB_DATA data;
+	uint64_t gen;
+	int ret;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		data = fetch_record(i->node);
+		if (data.dptr == NULL && errno != ENOENT)
+			return errno;
+		hdr = (void *)data.dptr;
+		gen = hdr ? hdr->generation : NO_GENERATION;
+		if (gen != i->generation) {
+			talloc_free(data.dptr);
+			return EAGAIN;
+		}
+		if (i->modified) {
+			i->old.dptr = talloc_steal(i, data.dptr);
+			i->old.dsize = data.dsize;
+		} else
+			talloc_free(data.dptr);
+	}
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified)
+			continue;
+		if (i->data.dptr) {
+			if (store_record(i->node, i->data))
+				continue;
+		} else if (delete_record(i->node) || errno == ENOENT)
+			continue;
+
+		ret = errno;
+		list_for_each_entry(j, &trans->accessed, list) {
+			if (j == i)
+				break;
+			if (j->modified)
+				restore_record(j);
+		}
+		return ret;
+	}
+
+	return 0;
+}
+
 static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+	hashtable_destroy(trans->accessed_hash, 0 /* Values are talloced */);
 	return 0;
 }
 
@@ -156,18 +372,16 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 
 	/* Attach transaction to input for autofree until it's complete */
 	trans = talloc(in, struct transaction);
+	INIT_LIST_HEAD(&trans->accessed);
 	INIT_LIST_HEAD(&trans->changes);
 	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	trans->accessed_hash = create_hashtable(16, hash_from_key_fn,
+						keys_equal_fn);
+	if (!trans->accessed_hash) {
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
+	talloc_set_destructor(trans, destroy_transaction);
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -178,7 +392,6 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	/* Now we own it. */
 	list_add_tail(&trans->list, &conn->transaction_list);
 	talloc_steal(conn, trans);
-	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
 
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
@@ -190,6 +403,7 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	struct changed_node *i;
 	struct changed_domain *d;
 	struct transaction *trans;
+	int ret;
 
 	if (!arg || (!streq(arg, "T") && !streq(arg, "F"))) {
 		send_error(conn, EINVAL);
@@ -209,17 +423,11 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
-			send_error(conn, EAGAIN);
-			return;
-		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
-			send_error(conn, errno);
+		ret = commit_transaction(trans);
+		if (ret) {
+			send_error(conn, ret);
 			return;
 		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
@@ -228,7 +436,6 @@ void do_transaction_end(struct connection *conn, const char *arg)
 		/* Fire off the watches for everything that changed. */
 		list_for_each_entry(i, &trans->changes, list)
 			fire_watches(conn, i->node, i->recurse);
-		generation++;
 	}
 	send_ack(conn, XS_TRANSACTION_END);
 }
@@ -21,6 +21,7 @@
 #include <sys/types.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
 #include <assert.h>
@@ -30,14 +31,45 @@
 #include "xenstore_lib.h"
 #include "utils.h"
 #include "xenstored_domain.h"
+#include "hashtable.h"
 
 extern int quota_nb_watch_per_domain;
 
+/*
+ * Watched paths are kept in a tree mirroring the store's, indexed by path,
+ * so that a write only looks at the watches on the written node and its
+ * ancestors, and a removal also at those on its descendants, rather than
+ * at every watch of every connection.  Paths without watches only stay in
+ * the tree while they have watched descendants.  "@" event names hang off
+ * "/", as a watch on "/" sees every event.
+ */
+struct watch_node
+{
+	/* Sibling watched paths. */
+	struct list_head list;
+
+	struct watch_node *parent;
+	struct list_head children;
+
+	/* Watches on this path. */
+	struct list_head watches;
+
+	char *path;
+};
+
+/* Watched paths (and their ancestors) to struct watch_node. */
+static struct hashtable *watch_nodes;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path, of all connections. */
+	struct list_head node_list;
+	struct watch_node *wnode;
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -46,6 +78,24 @@ struct watch
 
 	char *token;
 	char *node;
+
+	/* Order of registration, to fire watches in that order. */
+	uint64_t seq;
+};
+
+static uint64_t next_watch_seq;
+
+/* A watch matching a change, and the name its event reports. */
+struct fired_watch
+{
+	struct watch *watch;
+	const char *name;
+};
+
+struct fired_watches
+{
+	struct fired_watch *v;
+	unsigned int nr, max;
 };
 
 static void add_event(struct connection *conn,
@@ -86,28 +136,198 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
+/* Strip the last element of path in place, turning it into its parent. */
+static void parent_path(char *path)
+{
+	char *slash = strrchr(path, '/');
+
+	if (!slash || slash == path)
+		strcpy(path, "/");
+	else
+		*slash = '\0';
+}
+
+static struct watch_node *find_watch_node(const char *path)
+{
+	if (!watch_nodes)
+		return NULL;
+	return hashtable_search(watch_nodes, (void *)path);
+}
+
+static int destroy_watch_node(void *_wnode)
+{
+	struct watch_node *wnode = _wnode;
+
+	hashtable_remove(watch_nodes, wnode->path);
+	if (wnode->parent)
+		list_del(&wnode->list);
+	return 0;
+}
+
+/* Drop tree nodes which have neither watches nor watched descendants. */
+static void put_watch_node(struct watch_node *wnode)
+{
+	struct watch_node *parent;
+
+	while (wnode && list_empty(&wnode->watches) &&
+	       list_empty(&wnode->children)) {
+		parent = wnode->parent;
+		talloc_free(wnode);
+		wnode = parent;
+	}
+}
+
+/* Look up the tree node for path, creating it and its ancestors if needed. */
+static struct watch_node *get_watch_node(const char *path)
+{
+	struct watch_node *wnode, *parent = NULL;
+	char *key, *ppath;
+
+	wnode = find_watch_node(path);
+	if (wnode)
+		return wnode;
+
+	if (!watch_nodes) {
+		watch_nodes = create_hashtable(16, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_nodes)
+			return NULL;
+	}
+
+	if (!streq(path, "/")) {
+		ppath = talloc_strdup(NULL, path);
+		if (!ppath)
+			return NULL;
+		parent_path(ppath);
+		parent = get_watch_node(ppath);
+		talloc_free(ppath);
+		if (!parent)
+			return NULL;
+	}
+
+	wnode = talloc(parent, struct watch_node);
+	key = strdup(path);
+	if (!wnode || !key)
+		goto nomem;
+	wnode->path = talloc_strdup(wnode, path);
+	if (!wnode->path)
+		goto nomem;
+	wnode->parent = parent;
+	INIT_LIST_HEAD(&wnode->children);
+	INIT_LIST_HEAD(&wnode->watches);
+	if (!hashtable_insert(watch_nodes, key, wnode))
+		goto nomem;
+	if (parent)
+		list_add_tail(&wnode->list, &parent->children);
+	talloc_set_destructor(wnode, destroy_watch_node);
+
+	return wnode;
+
+ nomem:
+	free(key);
+	talloc_free(wnode);
+	put_watch_node(parent);
+	return NULL;
+}
+
+static void fire_watch(struct fired_watches *f, struct watch *watch,
+		       const char *name)
+{
+	struct fired_watch *v;
+	unsigned int max;
+
+	if (f->nr == f->max) {
+		max = f->max ? 2 * f->max : 16;
+		v = talloc_realloc(NULL, f->v, struct fired_watch, max);
+		if (!v) {
+			/* Out of memory: send it now, possibly out of order. */
+			add_event(watch->conn, watch, name);
+			return;
+		}
+		f->v = v;
+		f->max = max;
+	}
+
+	f->v[f->nr].watch = watch;
+	f->v[f->nr].name = name;
+	f->nr++;
+}
+
+/* Collect the watches on wnode's descendants (for a removal). */
+static void fire_watches_below(struct fired_watches *f,
+			       struct watch_node *wnode)
+{
+	struct watch_node *child;
+	struct watch *watch;
+
+	list_for_each_entry(child, &wnode->children, list) {
+		list_for_each_entry(watch, &child->watches, node_list)
+			fire_watch(f, watch, watch->node);
+		fire_watches_below(f, child);
+	}
+}
+
+static int fired_watch_cmp(const void *a, const void *b)
+{
+	const struct fired_watch *fa = a, *fb = b;
+
+	if (fa->watch->seq == fb->watch->seq)
+		return 0;
+	return fa->watch->seq < fb->watch->seq ? -1 : 1;
+}
+
 void fire_watches(struct connection *conn, const char *name, bool recurse)
 {
-	struct connection *i;
+	struct fired_watches f = { NULL, 0, 0 };
+	struct watch_node *wnode;
 	struct watch *watch;
+	unsigned int i;
+	char *path;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
-		}
+	if (!watch_nodes || !hashtable_count(watch_nodes))
+		return;
+
+	/* Find each watch on name or one of its parents. */
+	path = talloc_strdup(NULL, name);
+	if (!path)
+		return;
+	for (;;) {
+		wnode = find_watch_node(path);
+		if (wnode)
+			list_for_each_entry(watch, &wnode->watches, node_list)
+				fire_watch(&f, watch, name);
+		if (streq(path, "/"))
+			break;
+		parent_path(path);
 	}
+	talloc_free(path);
+
+	/* ... and if it is going away, on any of its children. */
+	if (recurse && (wnode = find_watch_node(name)))
+		fire_watches_below(&f, wnode);
+
+	/*
+	 * Create the events in the order the watches were registered, which
+	 * is the order a connection has always seen them in.
+	 */
+	if (f.nr)
+		qsort(f.v, f.nr, sizeof(*f.v), fired_watch_cmp);
+	for (i = 0; i < f.nr; i++)
+		add_event(f.v[i].watch->conn, f.v[i].watch, f.v[i].name);
+	talloc_free(f.v);
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
+	list_del(&watch->node_list);
+	put_watch_node(watch->wnode);
+
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -161,10 +381,20 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 	else
 		watch->relative_path = NULL;
 
+	watch->wnode = get_watch_node(watch->node);
+	if (!watch->wnode) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
+	watch->conn = conn;
+	watch->seq = next_watch_seq++;
+
 	INIT_LIST_HEAD(&watch->events);
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->node_list, &watch->wnode->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
@@ -496,10 +496,16 @@ static int hpet_range(struct vcpu *v, unsigned long addr)
             (addr < (HPET_BASE_ADDRESS + HPET_MMAP_SIZE)));
 }
 
+static void hpet_ranges(struct domain *d, struct hvm_mmio_table *t)
+{
+    hvm_mmio_add_range(t, HPET_BASE_ADDRESS, HPET_MMAP_SIZE);
+}
+
 const struct hvm_mmio_handler hpet_mmio_handler = {
     .check_handler = hpet_range,
     .read_handler  = hpet_read,
-    .write_handler = hpet_write
+    .write_handler = hpet_write,
+    .ranges        = hpet_ranges
 };
 
 
@@ -820,6 +820,7 @@ static int hvm_ioreq_server_alloc_rangesets(struct hvm_ioreq_server *s,
                       (i == HVMOP_IO_RANGE_PORT) ? "port" :
                       (i == HVMOP_IO_RANGE_MEMORY) ? "memory" :
                       (i == HVMOP_IO_RANGE_PCI) ? "pci" :
+                      (i == HVMOP_IO_RANGE_POSTED) ? "posted" :
                       "");
         if ( rc )
             goto fail;
@@ -1125,6 +1126,14 @@ static int hvm_map_io_range_to_ioreq_server(struct domain *d, ioservid_t id,
 
             switch ( type )
             {
+            case HVMOP_IO_RANGE_POSTED:
+                /* Posted writes are queued in the buffered ring. */
+                if ( !s->bufioreq.va )
+                {
+                    r = NULL;
+                    break;
+                }
+                /* fallthrough */
             case HVMOP_IO_RANGE_PORT:
             case HVMOP_IO_RANGE_MEMORY:
             case HVMOP_IO_RANGE_PCI:
@@ -1144,6 +1153,15 @@ static int hvm_map_io_range_to_ioreq_server(struct domain *d, ioservid_t id,
             if ( rangeset_overlaps_range(r, start, end) )
                 break;
 
+            /* A memory range is either posted or synchronous, not both. */
+            if ( (type == HVMOP_IO_RANGE_MEMORY &&
+                  rangeset_overlaps_range(s->range[HVMOP_IO_RANGE_POSTED],
+                                          start, end)) ||
+                 (type == HVMOP_IO_RANGE_POSTED &&
+                  rangeset_overlaps_range(s->range[HVMOP_IO_RANGE_MEMORY],
+                                          start, end)) )
+                break;
+
             rc = rangeset_add_range(r, start, end);
             break;
         }
@@ -1179,6 +1197,7 @@ static int hvm_unmap_io_range_from_ioreq_server(struct domain *d, ioservid_t id,
             case HVMOP_IO_RANGE_PORT:
             case HVMOP_IO_RANGE_MEMORY:
             case HVMOP_IO_RANGE_PCI:
+            case HVMOP_IO_RANGE_POSTED:
                 r = s->range[type];
                 break;
 
@@ -1426,6 +1445,7 @@ int hvm_domain_initialise(struct domain *d)
     INIT_LIST_HEAD(&d->arch.hvm_domain.ioreq_server.list);
     spin_lock_init(&d->arch.hvm_domain.irq_lock);
     spin_lock_init(&d->arch.hvm_domain.uc_lock);
+    spin_lock_init(&d->arch.hvm_domain.mmio_table_lock);
 
     INIT_LIST_HEAD(&d->arch.hvm_domain.msixtbl_list);
     spin_lock_init(&d->arch.hvm_domain.msixtbl_list_lock);
@@ -1467,6 +1487,8 @@ int hvm_domain_initialise(struct domain *d)
     register_portio_handler(d, 0xe9, 1, hvm_print_line);
     register_portio_handler(d, 0xcf8, 4, hvm_access_cf8);
 
+    hvm_mmio_update_ranges(d);
+
     rc = hvm_funcs.domain_initialise(d);
     if ( rc != 0 )
         goto fail2;
@@ -1474,6 +1496,7 @@ int hvm_domain_initialise(struct domain *d)
     return 0;
 
  fail2:
+    hvm_mmio_destroy_ranges(d);
     rtc_deinit(d);
     stdvga_deinit(d);
     vioapic_deinit(d);
@@ -1517,6 +1540,7 @@ void hvm_domain_destroy(struct domain *d)
         return;
 
     hvm_funcs.domain_destroy(d);
+    hvm_mmio_destroy_ranges(d);
     rtc_deinit(d);
     stdvga_deinit(d);
     vioapic_deinit(d);
@@ -2399,7 +2423,9 @@ static struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
             break;
         case IOREQ_TYPE_COPY:
             end = addr + (p->size * p->count) - 1;
-            if ( rangeset_contains_range(r, addr, end) )
+            if ( rangeset_contains_range(r, addr, end) ||
+                 rangeset_contains_range(s->range[HVMOP_IO_RANGE_POSTED],
+                                         addr, end) )
                 return s;
 
             break;
@@ -2423,10 +2449,26 @@ static struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
 #undef CF8_BDF
 }
 
-int hvm_buffered_io_send(ioreq_t *p)
+/*
+ * Can @p be queued in the buffered ring of @s as a posted write?  Only
+ * single writes of immediate data which fall entirely within one of the
+ * server's posted-write ranges qualify.
+ */
+static bool_t hvm_ioreq_server_posted(struct hvm_ioreq_server *s, ioreq_t *p)
 {
-    struct domain *d = current->domain;
-    struct hvm_ioreq_server *s = hvm_select_ioreq_server(d, p);
+    if ( p->type != IOREQ_TYPE_COPY || p->dir != IOREQ_WRITE ||
+         p->data_is_ptr || p->count != 1 || !s->bufioreq.va ||
+         s == s->domain->arch.hvm_domain.default_ioreq_server )
+        return 0;
+
+    return rangeset_contains_range(s->range[HVMOP_IO_RANGE_POSTED],
+                                   p->addr, p->addr + p->size - 1);
+}
+
+static int hvm_send_buffered_ioreq(struct hvm_ioreq_server *s, ioreq_t *p,
+                                   bool_t posted)
+{
+    struct domain *d = s->domain;
     struct hvm_ioreq_page *iorp;
     buffered_iopage_t *pg;
     buf_ioreq_t bp = { .data = p->data,
@@ -2435,13 +2477,13 @@ int hvm_buffered_io_send(ioreq_t *p)
                        .dir = p->dir };
     /* Timeoffset sends 64b data, but no address. Use two consecutive slots. */
     int qw = 0;
+    /* Posted writes beyond 1MB carry the rest of the address in a slot. */
+    int xa = 0;
+    unsigned int wp, slots;
 
     /* Ensure buffered_iopage fits in a page */
     BUILD_BUG_ON(sizeof(buffered_iopage_t) > PAGE_SIZE);
 
-    if ( !s )
-        return 0;
-
     iorp = &s->bufioreq;
     pg = iorp->va;
 
@@ -2451,12 +2493,21 @@ int hvm_buffered_io_send(ioreq_t *p)
     /*
      * Return 0 for the cases we can't deal with:
      *  - 'addr' is only a 20-bit field, so we cannot address beyond 1MB
+     *    unless the server understands the posted write encoding
      *  - we cannot buffer accesses to guest memory buffers, as the guest
      *    may expect the memory buffer to be synchronously accessed
      *  - the count field is usually used with data_is_ptr and since we don't
      *    support data_is_ptr we do not waste space for the count field either
      */
-    if ( (p->addr > 0xffffful) || p->data_is_ptr || (p->count != 1) )
+    if ( p->data_is_ptr || (p->count != 1) )
+        return 0;
+
+    if ( posted )
+    {
+        bp.pad = 1;
+        xa = 1;
+    }
+    else if ( p->addr > 0xffffful )
         return 0;
 
     switch ( p->size )
@@ -2479,34 +2530,62 @@ int hvm_buffered_io_send(ioreq_t *p)
         return 0;
     }
 
+    slots = 1 + qw + xa;
+
     spin_lock(&s->bufioreq_lock);
 
-    if ( (pg->write_pointer - pg->read_pointer) >=
-         (IOREQ_BUFFER_SLOT_NUM - qw) )
+    wp = pg->write_pointer;
+    if ( (wp - pg->read_pointer) > (IOREQ_BUFFER_SLOT_NUM - slots) )
     {
         /* The queue is full: send the iopacket through the normal path. */
         spin_unlock(&s->bufioreq_lock);
         return 0;
     }
 
-    pg->buf_ioreq[pg->write_pointer % IOREQ_BUFFER_SLOT_NUM] = bp;
+    pg->buf_ioreq[wp % IOREQ_BUFFER_SLOT_NUM] = bp;
 
     if ( qw )
     {
         bp.data = p->data >> 32;
-        pg->buf_ioreq[(pg->write_pointer+1) % IOREQ_BUFFER_SLOT_NUM] = bp;
+        pg->buf_ioreq[(wp + 1) % IOREQ_BUFFER_SLOT_NUM] = bp;
+    }
+
+    if ( xa )
+    {
+        bp.data = p->addr >> 20;
+        pg->buf_ioreq[(wp + 1 + qw) % IOREQ_BUFFER_SLOT_NUM] = bp;
     }
 
     /* Make the ioreq_t visible /before/ write_pointer. */
     wmb();
-    pg->write_pointer += qw ? 2 : 1;
+    pg->write_pointer = wp + slots;
 
-    notify_via_xen_event_channel(d, s->bufioreq_evtchn);
+    /*
+     * Posted writes batch the kick: an emulator which is still draining
+     * the ring will find this entry without one.  The barrier orders the
+     * write_pointer update against the read_pointer check below, pairing
+     * with the barrier the emulator issues after its last read_pointer
+     * update and before re-checking write_pointer.
+     */
+    if ( posted )
+        smp_mb();
+    if ( !posted || pg->read_pointer == wp )
+        notify_via_xen_event_channel(d, s->bufioreq_evtchn);
     spin_unlock(&s->bufioreq_lock);
 
     return 1;
 }
 
+int hvm_buffered_io_send(ioreq_t *p)
+{
+    struct hvm_ioreq_server *s = hvm_select_ioreq_server(current->domain, p);
+
+    if ( !s )
+        return 0;
+
+    return hvm_send_buffered_ioreq(s, p, 0);
+}
+
 bool_t hvm_has_dm(struct domain *d)
 {
     return !list_empty(&d->arch.hvm_domain.ioreq_server.list);
@@ -2608,6 +2687,14 @@ bool_t hvm_send_assist_req(ioreq_t *p)
     if ( !s )
         return hvm_complete_assist_req(p);
 
+    /* Posted writes complete as soon as they are in the buffered ring. */
+    if ( hvm_ioreq_server_posted(s, p) && hvm_send_buffered_ioreq(s, p, 1) )
+    {
+        p->state = STATE_IORESP_READY;
+        hvm_io_assist(p);
+        return 1;
+    }
+
     return hvm_send_assist_req_to_ioreq_server(s, p);
 }
 
@@ -31,6 +31,8 @@
 #include <io_ports.h>
 #include <xen/event.h>
 #include <xen/iommu.h>
+#include <xen/rcupdate.h>
+#include <asm/hvm/trace.h>
 
 static const struct hvm_mmio_handler *const
 hvm_mmio_handlers[HVM_MMIO_HANDLER_NR] =
@@ -42,6 +44,141 @@ hvm_mmio_handlers[HVM_MMIO_HANDLER_NR] =
     &iommu_mmio_handler
 };
 
+static DEFINE_RCU_READ_LOCK(hvm_mmio_rcu_lock);
+
+void hvm_mmio_add_range(
+    struct hvm_mmio_table *t, unsigned long start, unsigned long size)
+{
+    struct hvm_mmio_range *r;
+    unsigned int i;
+
+    if ( !size )
+        return;
+
+    /* Ranges are reported by all vcpus, so expect duplicates. */
+    for ( i = 0; i < t->nr_ranges; i++ )
+    {
+        r = &t->range[i];
+        if ( r->start == start && r->end == start + size - 1 &&
+             r->handler == t->handler )
+            return;
+    }
+
+    if ( t->nr_ranges == HVM_MMIO_MAX_RANGES )
+    {
+        t->overflow = 1;
+        return;
+    }
+
+    /* Insertion sort: the table is small and rarely rebuilt. */
+    for ( i = t->nr_ranges++; i > 0 && t->range[i - 1].start > start; i-- )
+        t->range[i] = t->range[i - 1];
+
+    r = &t->range[i];
+    r->start = start;
+    r->end = start + size - 1;
+    r->handler = t->handler;
+}
+
+static void free_mmio_table(struct rcu_head *rcu)
+{
+    xfree(container_of(rcu, struct hvm_mmio_table, rcu));
+}
+
+/*
+ * Rebuild the table of ranges claimed by the mmio handlers.  If they
+ * overlap (the guest may move its LAPIC anywhere) or there are too many
+ * of them, no table is installed and every handler gets probed in turn.
+ */
+void hvm_mmio_update_ranges(struct domain *d)
+{
+    struct hvm_domain *hd = &d->arch.hvm_domain;
+    struct hvm_mmio_table *t, *old;
+    unsigned int i;
+
+    spin_lock(&hd->mmio_table_lock);
+
+    t = xmalloc(struct hvm_mmio_table);
+    if ( t != NULL )
+    {
+        t->nr_ranges = 0;
+        t->overflow = 0;
+        for ( i = 0; i < HVM_MMIO_HANDLER_NR; i++ )
+        {
+            t->handler = i;
+            hvm_mmio_handlers[i]->ranges(d, t);
+        }
+
+        for ( i = 1; i < t->nr_ranges && !t->overflow; i++ )
+            if ( t->range[i].start <= t->range[i - 1].end )
+                t->overflow = 1;
+
+        if ( t->overflow )
+        {
+            xfree(t);
+            t = NULL;
+        }
+    }
+
+    old = hd->mmio_table;
+    rcu_assign_pointer(hd->mmio_table, t);
+
+    spin_unlock(&hd->mmio_table_lock);
+
+    if ( old != NULL )
+        call_rcu(&old->rcu, free_mmio_table);
+}
+
+void hvm_mmio_destroy_ranges(struct domain *d)
+{
+    xfree(d->arch.hvm_domain.mmio_table);
+    d->arch.hvm_domain.mmio_table = NULL;
+}
+
+/* Return the index of the handler claiming gpa, or HVM_MMIO_HANDLER_NR. */
+static unsigned int hvm_find_mmio_handler(struct vcpu *v, paddr_t gpa)
+{
+    struct hvm_mmio_table *t;
+    unsigned int i = HVM_MMIO_HANDLER_NR, lo, hi, mid;
+
+    rcu_read_lock(&hvm_mmio_rcu_lock);
+
+    t = rcu_dereference(v->domain->arch.hvm_domain.mmio_table);
+    if ( likely(t != NULL) )
+    {
+        for ( lo = 0, hi = t->nr_ranges; lo < hi; )
+        {
+            mid = (lo + hi) / 2;
+            if ( gpa < t->range[mid].start )
+                hi = mid;
+            else if ( gpa > t->range[mid].end )
+                lo = mid + 1;
+            else
+            {
+                i = t->range[mid].handler;
+                break;
+            }
+        }
+
+        rcu_read_unlock(&hvm_mmio_rcu_lock);
+
+        /* The ranges are a superset: the handler may still decline. */
+        if ( i < HVM_MMIO_HANDLER_NR &&
+             !hvm_mmio_handlers[i]->check_handler(v, gpa) )
+            i = HVM_MMIO_HANDLER_NR;
+
+        return i;
+    }
+
+    rcu_read_unlock(&hvm_mmio_rcu_lock);
+
+    for ( i = 0; i < HVM_MMIO_HANDLER_NR; i++ )
+        if ( hvm_mmio_handlers[i]->check_handler(v, gpa) )
+            break;
+
+    return i;
+}
+
 static int hvm_mmio_access(struct vcpu *v,
                            ioreq_t *p,
                            hvm_mmio_read_t read_handler,
@@ -165,42 +302,34 @@ static int hvm_mmio_access(struct vcpu *v,
 
 bool_t hvm_mmio_internal(paddr_t gpa)
 {
-    struct vcpu *curr = current;
-    unsigned int i;
-
-    for ( i = 0; i < HVM_MMIO_HANDLER_NR; ++i )
-        if ( hvm_mmio_handlers[i]->check_handler(curr, gpa) )
-            return 1;
-
-    return 0;
+    return hvm_find_mmio_handler(current, gpa) < HVM_MMIO_HANDLER_NR;
 }
 
 int hvm_mmio_intercept(ioreq_t *p)
 {
     struct vcpu *v = current;
-    int i;
-
-    for ( i = 0; i < HVM_MMIO_HANDLER_NR; i++ )
-    {
-        hvm_mmio_check_t check_handler =
-            hvm_mmio_handlers[i]->check_handler;
-
-        if ( check_handler(v, p->addr) )
-        {
-            if ( unlikely(p->count > 1) &&
-                 !check_handler(v, unlikely(p->df)
-                                   ? p->addr - (p->count - 1L) * p->size
-                                   : p->addr + (p->count - 1L) * p->size) )
-                p->count = 1;
-
-            return hvm_mmio_access(
-                v, p,
-                hvm_mmio_handlers[i]->read_handler,
-                hvm_mmio_handlers[i]->write_handler);
-        }
-    }
-
-    return X86EMUL_UNHANDLEABLE;
+    unsigned int i = hvm_find_mmio_handler(v, p->addr);
+    hvm_mmio_check_t check_handler;
+    unsigned long exits;
+
+    if ( i == HVM_MMIO_HANDLER_NR )
+        return X86EMUL_UNHANDLEABLE;
+
+    check_handler = hvm_mmio_handlers[i]->check_handler;
+    if ( unlikely(p->count > 1) &&
+         !check_handler(v, unlikely(p->df)
+                           ? p->addr - (p->count - 1L) * p->size
+                           : p->addr + (p->count - 1L) * p->size) )
+        p->count = 1;
+
+    exits = ++v->arch.hvm_vcpu.hvm_io.mmio_exits[i];
+    HVMTRACE_4D(MMIO_INTERCEPT, i, exits, (uint32_t)p->addr,
+                (uint32_t)(p->addr >> 32));
+
+    return hvm_mmio_access(
+        v, p,
+        hvm_mmio_handlers[i]->read_handler,
+        hvm_mmio_handlers[i]->write_handler);
 }
 
 static int process_portio_intercept(portio_action_t action, ioreq_t *p)
@@ -21,7 +21,7 @@
 #include <xen/types.h>
 #include <asm/e820.h>
 #include <asm/iocap.h>
-#include <asm/mm.h>
+#include <xen/mm.h>
 #include <asm/paging.h>
 #include <asm/p2m.h>
 #include <xen/domain_page.h>
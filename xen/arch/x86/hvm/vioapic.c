@@ -244,10 +244,18 @@ static int vioapic_range(struct vcpu *v, unsigned long addr)
              (addr < vioapic->base_address + VIOAPIC_MEM_LENGTH)));
 }
 
+static void vioapic_ranges(struct domain *d, struct hvm_mmio_table *t)
+{
+    if ( d->arch.hvm_domain.vioapic )
+        hvm_mmio_add_range(t, domain_vioapic(d)->base_address,
+                           VIOAPIC_MEM_LENGTH);
+}
+
 const struct hvm_mmio_handler vioapic_mmio_handler = {
     .check_handler = vioapic_range,
     .read_handler = vioapic_read,
-    .write_handler = vioapic_write
+    .write_handler = vioapic_write,
+    .ranges = vioapic_ranges
 };
 
 static void ioapic_inj_irq(
@@ -425,7 +433,13 @@ static int ioapic_save(struct domain *d, hvm_domain_context_t *h)
 static int ioapic_load(struct domain *d, hvm_domain_context_t *h)
 {
     struct hvm_hw_vioapic *s = domain_vioapic(d);
-    return hvm_load_entry(IOAPIC, h, s);
+    uint64_t old_base = s->base_address;
+    int rc = hvm_load_entry(IOAPIC, h, s);
+
+    if ( !rc && s->base_address != old_base )
+        hvm_mmio_update_ranges(d);
+
+    return rc;
 }
 
 HVM_REGISTER_SAVE_RESTORE(IOAPIC, ioapic_save, ioapic_load, 1, HVMSR_PER_DOM);
@@ -433,12 +447,16 @@ HVM_REGISTER_SAVE_RESTORE(IOAPIC, ioapic_save, ioapic_load, 1, HVMSR_PER_DOM);
 void vioapic_reset(struct domain *d)
 {
     struct hvm_vioapic *vioapic = d->arch.hvm_domain.vioapic;
+    uint64_t old_base = vioapic->hvm_hw_vioapic.base_address;
     int i;
 
     memset(&vioapic->hvm_hw_vioapic, 0, sizeof(vioapic->hvm_hw_vioapic));
     for ( i = 0; i < VIOAPIC_NUM_PINS; i++ )
         vioapic->hvm_hw_vioapic.redirtbl[i].fields.mask = 1;
     vioapic->hvm_hw_vioapic.base_address = VIOAPIC_DEFAULT_BASE_ADDRESS;
+
+    if ( old_base != VIOAPIC_DEFAULT_BASE_ADDRESS )
+        hvm_mmio_update_ranges(d);
 }
 
 int vioapic_init(struct domain *d)
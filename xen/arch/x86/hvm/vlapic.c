@@ -1005,10 +1005,22 @@ static int vlapic_range(struct vcpu *v, unsigned long addr)
            (offset < PAGE_SIZE);
 }
 
+static void vlapic_ranges(struct domain *d, struct hvm_mmio_table *t)
+{
+    struct vcpu *v;
+
+    /* Vcpus still being created aren't on the list, but use this base. */
+    hvm_mmio_add_range(t, APIC_DEFAULT_PHYS_BASE, PAGE_SIZE);
+
+    for_each_vcpu ( d, v )
+        hvm_mmio_add_range(t, vlapic_base_address(vcpu_vlapic(v)), PAGE_SIZE);
+}
+
 const struct hvm_mmio_handler vlapic_mmio_handler = {
     .check_handler = vlapic_range,
     .read_handler = vlapic_read,
-    .write_handler = vlapic_write
+    .write_handler = vlapic_write,
+    .ranges = vlapic_ranges
 };
 
 static void set_x2apic_id(struct vlapic *vlapic)
@@ -1022,6 +1034,8 @@ static void set_x2apic_id(struct vlapic *vlapic)
 
 bool_t vlapic_msr_set(struct vlapic *vlapic, uint64_t value)
 {
+    unsigned long old_base = vlapic_base_address(vlapic);
+
     if ( (vlapic->hw.apic_base_msr ^ value) & MSR_IA32_APICBASE_ENABLE )
     {
         if ( unlikely(value & MSR_IA32_APICBASE_EXTD) )
@@ -1052,6 +1066,9 @@ bool_t vlapic_msr_set(struct vlapic *vlapic, uint64_t value)
 
     vmx_vlapic_msr_changed(vlapic_vcpu(vlapic));
 
+    if ( vlapic_base_address(vlapic) != old_base )
+        hvm_mmio_update_ranges(vlapic_domain(vlapic));
+
     HVM_DBG_LOG(DBG_LEVEL_VLAPIC,
                 "apic base msr is 0x%016"PRIx64, vlapic->hw.apic_base_msr);
 
@@ -1357,6 +1374,7 @@ static int lapic_load_hidden(struct domain *d, hvm_domain_context_t *h)
     uint16_t vcpuid;
     struct vcpu *v;
     struct vlapic *s;
+    unsigned long old_base;
     
     /* Which vlapic to load? */
     vcpuid = hvm_load_instance(h); 
@@ -1367,10 +1385,14 @@ static int lapic_load_hidden(struct domain *d, hvm_domain_context_t *h)
         return -EINVAL;
     }
     s = vcpu_vlapic(v);
+    old_base = vlapic_base_address(s);
     
     if ( hvm_load_entry_zeroextend(LAPIC, h, &s->hw) != 0 ) 
         return -EINVAL;
 
+    if ( vlapic_base_address(s) != old_base )
+        hvm_mmio_update_ranges(d);
+
     s->loaded.hw = 1;
     if ( s->loaded.regs )
         lapic_load_fixup(s);
@@ -369,10 +369,23 @@ static int msixtbl_range(struct vcpu *v, unsigned long addr)
     return !!virt;
 }
 
+static void msixtbl_ranges(struct domain *d, struct hvm_mmio_table *t)
+{
+    struct msixtbl_entry *entry;
+
+    rcu_read_lock(&msixtbl_rcu_lock);
+
+    list_for_each_entry( entry, &d->arch.hvm_domain.msixtbl_list, list )
+        hvm_mmio_add_range(t, entry->gtable, entry->table_len);
+
+    rcu_read_unlock(&msixtbl_rcu_lock);
+}
+
 const struct hvm_mmio_handler msixtbl_mmio_handler = {
     .check_handler = msixtbl_range,
     .read_handler = msixtbl_read,
-    .write_handler = msixtbl_write
+    .write_handler = msixtbl_write,
+    .ranges = msixtbl_ranges
 };
 
 static void add_msixtbl_entry(struct domain *d,
@@ -417,6 +430,7 @@ int msixtbl_pt_register(struct domain *d, struct pirq *pirq, uint64_t gtable)
     struct msi_desc *msi_desc;
     struct pci_dev *pdev;
     struct msixtbl_entry *entry, *new_entry;
+    bool_t added = 0;
     int r = -EINVAL;
 
     ASSERT(spin_is_locked(&pcidevs_lock));
@@ -455,6 +469,7 @@ int msixtbl_pt_register(struct domain *d, struct pirq *pirq, uint64_t gtable)
     entry = new_entry;
     new_entry = NULL;
     add_msixtbl_entry(d, pdev, gtable, entry);
+    added = 1;
 
 found:
     atomic_inc(&entry->refcnt);
@@ -464,6 +479,11 @@ found:
 out:
     spin_unlock_irq(&irq_desc->lock);
     xfree(new_entry);
+
+    /* Can't be done above: it allocates memory. */
+    if ( added )
+        hvm_mmio_update_ranges(d);
+
     return r;
 }
 
@@ -505,7 +525,13 @@ out:
 
 found:
     if ( !atomic_dec_and_test(&entry->refcnt) )
+    {
         del_msixtbl_entry(entry);
+        spin_unlock(&d->arch.hvm_domain.msixtbl_list_lock);
+        spin_unlock_irq(&irq_desc->lock);
+        hvm_mmio_update_ranges(d);
+        return;
+    }
 
     spin_unlock(&d->arch.hvm_domain.msixtbl_list_lock);
     spin_unlock_irq(&irq_desc->lock);
@@ -27,6 +27,14 @@
 #define mode_is(d, name) \
     ((d)->arch.hvm_domain.params[HVM_PARAM_TIMER_MODE] == HVMPTM_##name)
 
+/*
+ * Coalescing window for periodic timer expiries, in microseconds.  Ticks
+ * are deferred to the next multiple of the window, so that the ticks of
+ * all vCPUs on a pCPU are handled by one timer interrupt.
+ */
+static unsigned int __read_mostly opt_vpt_coalesce;
+integer_param("vpt_coalesce", opt_vpt_coalesce);
+
 void hvm_init_guest_time(struct domain *d)
 {
     struct pl_time *pl = &d->arch.hvm_domain.pl_time;
@@ -154,6 +162,18 @@ static void pt_process_missed_ticks(struct periodic_time *pt)
     pt->scheduled += missed_ticks * pt->period;
 }
 
+static void pt_arm_timer(struct periodic_time *pt)
+{
+    s_time_t expires = pt->scheduled;
+    uint64_t window = MICROSECS(opt_vpt_coalesce);
+
+    /* A window as long as the period would merge consecutive ticks. */
+    if ( !pt->one_shot && window < pt->period )
+        expires = align_timer(expires, window);
+
+    set_timer(&pt->timer, expires);
+}
+
 static void pt_freeze_time(struct vcpu *v)
 {
     if ( !mode_is(v->domain, delay_for_missed_ticks) )
@@ -184,8 +204,12 @@ void pt_save_timer(struct vcpu *v)
 
     spin_lock(&v->arch.hvm_vcpu.tm_lock);
 
+    /*
+     * When coalescing, don't keep waking this pCPU for a vCPU which cannot
+     * run: pt_restore_timer() accounts for the ticks it missed instead.
+     */
     list_for_each_entry ( pt, head, list )
-        if ( !pt->do_not_freeze )
+        if ( !pt->do_not_freeze || opt_vpt_coalesce )
             stop_timer(&pt->timer);
 
     pt_freeze_time(v);
@@ -205,7 +229,14 @@ void pt_restore_timer(struct vcpu *v)
         if ( pt->pending_intr_nr == 0 )
         {
             pt_process_missed_ticks(pt);
-            set_timer(&pt->timer, pt->scheduled);
+            if ( opt_vpt_coalesce && pt->do_not_freeze )
+            {
+                /* Deliver the tick the stopped timer would have raised. */
+                pt->do_not_freeze = 0;
+                pt->pending_intr_nr = 1;
+            }
+            else
+                pt_arm_timer(pt);
         }
     }
 
@@ -344,7 +375,7 @@ void pt_intr_post(struct vcpu *v, struct hvm_intack intack)
         pt->last_plt_gtime = hvm_get_guest_time(v);
         pt_process_missed_ticks(pt);
         pt->pending_intr_nr = 0; /* 'collapse' all missed ticks */
-        set_timer(&pt->timer, pt->scheduled);
+        pt_arm_timer(pt);
     }
     else
     {
@@ -353,7 +384,7 @@ void pt_intr_post(struct vcpu *v, struct hvm_intack intack)
         {
             pt_process_missed_ticks(pt);
             if ( pt->pending_intr_nr == 0 )
-                set_timer(&pt->timer, pt->scheduled);
+                pt_arm_timer(pt);
         }
     }
 
@@ -438,7 +469,7 @@ void create_periodic_time(
     list_add(&pt->list, &v->arch.hvm_vcpu.tm_list);
 
     init_timer(&pt->timer, pt_timer_fn, pt, v->processor);
-    set_timer(&pt->timer, pt->scheduled);
+    pt_arm_timer(pt);
 
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
 }
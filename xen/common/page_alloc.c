@@ -23,6 +23,7 @@
 
 #include <xen/config.h>
 #include <xen/init.h>
+#include <xen/cpu.h>
 #include <xen/types.h>
 #include <xen/lib.h>
 #include <xen/sched.h>
@@ -59,10 +60,28 @@ static char __initdata opt_badpage[100] = "";
 string_param("badpage", opt_badpage);
 
 /*
- * no-bootscrub -> Free pages are not zeroed during boot.
+ * bootscrub -> Free pages are zeroed during boot (the default), not at all
+ * (no-bootscrub), or in the background by idle CPUs (bootscrub=idle).
  */
-static bool_t opt_bootscrub __initdata = 1;
-boolean_param("bootscrub", opt_bootscrub);
+enum bootscrub_mode {
+    BOOTSCRUB_OFF,
+    BOOTSCRUB_ON,
+    BOOTSCRUB_IDLE,
+};
+static enum bootscrub_mode __initdata opt_bootscrub = BOOTSCRUB_ON;
+
+static void __init parse_bootscrub_param(char *s)
+{
+    if ( !*s )
+        opt_bootscrub = BOOTSCRUB_ON;
+    else if ( !strcmp(s, "idle") )
+        opt_bootscrub = BOOTSCRUB_IDLE;
+    else if ( parse_bool(s) >= 0 )
+        opt_bootscrub = parse_bool(s) ? BOOTSCRUB_ON : BOOTSCRUB_OFF;
+    else
+        printk("Unknown bootscrub mode '%s'\n", s);
+}
+custom_param("bootscrub", parse_bootscrub_param);
 
 /*
  * bootscrub_chunk -> Amount of bytes to scrub lockstep on non-SMT CPUs
@@ -81,10 +100,11 @@ integer_param("dma_bits", dma_bitsize);
 #define round_pgdown(_p)  ((_p)&PAGE_MASK)
 #define round_pgup(_p)    (((_p)+(PAGE_SIZE-1))&PAGE_MASK)
 
-/* Offlined page list, protected by heap_lock. */
+/* Offlined page list, protected by page_offline_lock. */
 PAGE_LIST_HEAD(page_offlined_list);
-/* Broken page list, protected by heap_lock. */
+/* Broken page list, protected by page_offline_lock. */
 PAGE_LIST_HEAD(page_broken_list);
+static DEFINE_SPINLOCK(page_offline_lock);
 
 /*************************
  * BOOT-TIME ALLOCATOR
@@ -285,43 +305,130 @@ static heap_by_zone_and_order_t *_heap[MAX_NUMNODES];
 #define heap(node, zone, order) ((*_heap[node])[zone][order])
 
 static unsigned long *avail[MAX_NUMNODES];
-static long total_avail_pages;
+static long total_avail_pages; /* updated atomically, without any lock */
+
+/* Pages in the per-CPU page caches; these count as free, too. */
+static atomic_t page_cache_pages;
 
 /* TMEM: Reserve a fraction of memory for mid-size (0<order<9) allocations.*/
 static long midsize_alloc_zone_pages;
 #define MIDSIZE_ALLOC_FRAC 128
 
+/*
+ * Each node's heap (its free lists, avail[] counters and node_need_scrub[]
+ * entry) is protected by a lock of its own, so that CPUs allocating from
+ * and freeing to different nodes don't contend.  Buddies never span nodes,
+ * so no operation needs more than one node lock at a time (boot-time
+ * scrubbing, which locks them all in node order, excepted).
+ *
+ * heap_lock protects the low memory virq thresholds.  page_offline_lock
+ * nests inside the node locks.
+ */
+static struct {
+    spinlock_t lock;
+} __cacheline_aligned node_heap[MAX_NUMNODES] = {
+    [0 ... MAX_NUMNODES - 1] = { .lock = SPIN_LOCK_UNLOCKED }
+};
+#define node_heap_lock(node) (&node_heap[node].lock)
+
 static DEFINE_SPINLOCK(heap_lock);
-static long outstanding_claims; /* total outstanding claims by all domains */
+
+/*
+ * Total outstanding claims by all domains.  Claims need no lock: like
+ * total_avail_pages, outstanding_claims is only updated with cmpxchg,
+ * which is a full barrier, and claims and allocations update the two in
+ * opposite orders.  An allocation takes its pages off total_avail_pages
+ * before checking them against outstanding_claims; a claim is added to
+ * outstanding_claims before being checked against total_avail_pages.  Of
+ * an allocation and a claim racing with each other, at least one thus
+ * sees the other's update, and backs off if together they would eat into
+ * claimed memory.
+ */
+static long outstanding_claims;
+
+/*
+ * Pages freed by dying domains and Xen heap pages are not scrubbed when
+ * they are freed.  They are marked PGC_need_scrub instead, and scrubbed
+ * later either by idle CPUs (see scrub_free_pages()) or when allocated.
+ * Within each free list, buddies which may contain such pages are kept
+ * at the tail, so that allocations prefer clean memory.
+ * node_need_scrub[] counts the pages still to be scrubbed, per node;
+ * protected by the node's heap lock.
+ */
+static unsigned long node_need_scrub[MAX_NUMNODES];
+
+/* Nodes being scrubbed by an idle CPU (at most one CPU per node). */
+static nodemask_t node_scrubbing;
+
+static void total_avail_pages_add(long pages)
+{
+    long x, y = read_atomic(&total_avail_pages);
+
+    do {
+        x = y;
+        ASSERT(x + pages >= 0);
+    } while ( (y = cmpxchg(&total_avail_pages, x, x + pages)) != x );
+}
+
+/* Take @pages off total_avail_pages, if that many are available. */
+static bool_t total_avail_pages_reserve(long pages)
+{
+    long x, y = read_atomic(&total_avail_pages);
+
+    do {
+        x = y;
+        if ( x < pages )
+            return 0;
+    } while ( (y = cmpxchg(&total_avail_pages, x, x - pages)) != x );
+
+    return 1;
+}
+
+static void outstanding_claims_add(long pages)
+{
+    long x, y = read_atomic(&outstanding_claims);
+
+    do {
+        x = y;
+        /* flag accounting bug if outstanding_claims would go negative */
+        BUG_ON(x + pages < 0);
+    } while ( (y = cmpxchg(&outstanding_claims, x, x + pages)) != x );
+}
+
+/* TMEM: grow the mid-size reserve along with free memory, never shrink it. */
+static void update_midsize_alloc_zone_pages(void)
+{
+    long x, y = read_atomic(&midsize_alloc_zone_pages);
+    long pages = read_atomic(&total_avail_pages) / MIDSIZE_ALLOC_FRAC;
+
+    do {
+        x = y;
+        if ( x >= pages )
+            return;
+    } while ( (y = cmpxchg(&midsize_alloc_zone_pages, x, pages)) != x );
+}
 
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
-    long dom_before, dom_after, dom_claimed, sys_before, sys_after;
+    long dom_before, dom_after, dom_claimed;
 
     ASSERT(spin_is_locked(&d->page_alloc_lock));
     d->tot_pages += pages;
 
     /*
-     * can test d->claimed_pages race-free because it can only change
-     * if d->page_alloc_lock and heap_lock are both held, see also
-     * domain_set_outstanding_pages below
+     * can test d->outstanding_pages race-free because it only changes
+     * with d->page_alloc_lock held, see also domain_set_outstanding_pages
+     * below
      */
     if ( !d->outstanding_pages )
         goto out;
 
-    spin_lock(&heap_lock);
     /* adjust domain outstanding pages; may not go negative */
     dom_before = d->outstanding_pages;
     dom_after = dom_before - pages;
-    BUG_ON(dom_before < 0);
     dom_claimed = dom_after < 0 ? 0 : dom_after;
-    d->outstanding_pages = dom_claimed;
-    /* flag accounting bug if system outstanding_claims would go negative */
-    sys_before = outstanding_claims;
-    sys_after = sys_before - (dom_before - dom_claimed);
-    BUG_ON(sys_after < 0);
-    outstanding_claims = sys_after;
-    spin_unlock(&heap_lock);
+    write_atomic(&d->outstanding_pages, dom_claimed);
+    outstanding_claims_add(dom_claimed - dom_before);
 
 out:
     return d->tot_pages;
@@ -333,18 +440,16 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
     unsigned long claim, avail_pages;
 
     /*
-     * take the domain's page_alloc_lock, else all d->tot_page adjustments
-     * must always take the global heap_lock rather than only in the much
-     * rarer case that d->outstanding_pages is non-zero
+     * take the domain's page_alloc_lock, which d->tot_pages adjustments
+     * hold when updating d->outstanding_pages
      */
     spin_lock(&d->page_alloc_lock);
-    spin_lock(&heap_lock);
 
     /* pages==0 means "unset" the claim. */
     if ( pages == 0 )
     {
-        outstanding_claims -= d->outstanding_pages;
-        d->outstanding_pages = 0;
+        outstanding_claims_add(-(long)d->outstanding_pages);
+        write_atomic(&d->outstanding_pages, 0);
         ret = 0;
         goto out;
     }
@@ -363,8 +468,22 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
         goto out;
     }
 
+    /*
+     * Note, if domain has already allocated memory before making a claim
+     * then the claim must take tot_pages into account
+     */
+    claim = pages - d->tot_pages;
+
+    /*
+     * Stake the claim before finding out how much memory is available, so
+     * that allocations racing with us either see the claim, or have taken
+     * their pages off total_avail_pages by the time we look.
+     */
+    outstanding_claims_add(claim);
+
     /* how much memory is available? */
-    avail_pages = total_avail_pages;
+    avail_pages = read_atomic(&total_avail_pages) +
+                  atomic_read(&page_cache_pages);
 
     /* Note: The usage of claim means that allocation from a guest *might*
      * have to come from freeable memory. Using free memory is always better, if
@@ -376,33 +495,27 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
      * not persistent pages).
      */
     avail_pages += tmem_freeable_pages();
-    avail_pages -= outstanding_claims;
 
-    /*
-     * Note, if domain has already allocated memory before making a claim
-     * then the claim must take tot_pages into account
-     */
-    claim = pages - d->tot_pages;
-    if ( claim > avail_pages )
+    /* all claims, ours included, must fit in available memory */
+    if ( read_atomic(&outstanding_claims) > avail_pages )
+    {
+        outstanding_claims_add(-(long)claim);
         goto out;
+    }
 
-    /* yay, claim fits in available memory, stake the claim, success! */
-    d->outstanding_pages = claim;
-    outstanding_claims += d->outstanding_pages;
+    /* yay, claim fits in available memory, success! */
+    write_atomic(&d->outstanding_pages, claim);
     ret = 0;
 
 out:
-    spin_unlock(&heap_lock);
     spin_unlock(&d->page_alloc_lock);
     return ret;
 }
 
 void get_outstanding_claims(uint64_t *free_pages, uint64_t *outstanding_pages)
 {
-    spin_lock(&heap_lock);
-    *outstanding_pages = outstanding_claims;
+    *outstanding_pages = read_atomic(&outstanding_claims);
     *free_pages =  avail_domheap_pages();
-    spin_unlock(&heap_lock);
 }
 
 static unsigned long init_node_heap(int node, unsigned long mfn,
@@ -540,11 +653,25 @@ static void __init setup_low_mem_virq(void)
             low_mem_virq_th);
 }
 
+static unsigned long low_mem_avail_pages(void)
+{
+    return read_atomic(&total_avail_pages) + atomic_read(&page_cache_pages) +
+        (opt_tmem ? tmem_freeable_pages() : 0) -
+        read_atomic(&outstanding_claims);
+}
+
 static void check_low_mem_virq(void)
 {
-    unsigned long avail_pages = total_avail_pages +
-        (opt_tmem ? tmem_freeable_pages() : 0) - outstanding_claims;
+    unsigned long avail_pages = low_mem_avail_pages();
+
+    /* The thresholds rarely change: only take heap_lock near one of them. */
+    if ( likely(avail_pages > read_atomic(&low_mem_virq_th)) &&
+         likely(avail_pages < read_atomic(&low_mem_virq_high)) )
+        return;
+
+    spin_lock(&heap_lock);
 
+    avail_pages = low_mem_avail_pages();
     if ( unlikely(avail_pages <= low_mem_virq_th) )
     {
         send_global_virq(VIRQ_ENOMEM);
@@ -556,10 +683,8 @@ static void check_low_mem_virq(void)
         if ( low_mem_virq_th_order > 0 )
             low_mem_virq_th_order--;
         low_mem_virq_th     = 1UL << low_mem_virq_th_order;
-        return;
     }
-
-    if ( unlikely(avail_pages >= low_mem_virq_high) )
+    else if ( unlikely(avail_pages >= low_mem_virq_high) )
     {
         /* Reset hysteresis. Bring threshold up one order.
          * If we are back where originally set, set high
@@ -572,6 +697,68 @@ static void check_low_mem_virq(void)
         else
             low_mem_virq_high = 1UL << (low_mem_virq_th_order + 2);
     }
+
+    spin_unlock(&heap_lock);
+}
+
+/* Add a buddy to its free list: clean buddies at the head, dirty ones last. */
+static void page_list_add_scrub(struct page_info *pg, unsigned int node,
+                                unsigned int zone, unsigned int order,
+                                unsigned int first_dirty)
+{
+    PFN_ORDER(pg) = order;
+    pg->u.free.first_dirty = first_dirty;
+    pg->u.free.scrub_state = BUDDY_NOT_SCRUBBING;
+
+    if ( first_dirty != INVALID_DIRTY_IDX )
+        page_list_add_tail(pg, &heap(node, zone, order));
+    else
+        page_list_add(pg, &heap(node, zone, order));
+}
+
+/*
+ * An idle CPU scrubbing a buddy does so without holding the heap lock, but
+ * leaves the buddy on its free list.  Anybody wanting to take the buddy
+ * off the list (with the heap lock held) must first ask the scrubber to
+ * stop, and wait for it to record how far it got.
+ */
+static void check_and_stop_scrub(struct page_info *head)
+{
+    typeof(head->u.free) pgfree;
+
+    ASSERT(spin_is_locked(node_heap_lock(phys_to_nid(page_to_maddr(head)))));
+
+    pgfree.val = read_atomic(&head->u.free.val);
+    if ( pgfree.scrub_state != BUDDY_SCRUBBING )
+        return;
+
+    pgfree.scrub_state = BUDDY_SCRUB_ABORT;
+    write_atomic(&head->u.free.val, pgfree.val);
+
+    do {
+        cpu_relax();
+        pgfree.val = read_atomic(&head->u.free.val);
+    } while ( pgfree.scrub_state == BUDDY_SCRUB_ABORT );
+    smp_rmb();
+}
+
+/*
+ * Unlocked hint: may @node have a free 2^@order buddy in the given zones?
+ * Saves taking the locks of nodes which obviously can't help.
+ */
+static bool_t node_may_have_pages(unsigned int node, unsigned int zone_lo,
+                                  unsigned int zone_hi, unsigned int order)
+{
+    unsigned int zone;
+
+    if ( !avail[node] )
+        return 0;
+
+    for ( zone = zone_lo; zone <= zone_hi; zone++ )
+        if ( read_atomic(&avail[node][zone]) >= (1UL << order) )
+            return 1;
+
+    return 0;
 }
 
 /* Allocate 2^@order contiguous pages. */
@@ -581,11 +768,13 @@ static struct page_info *alloc_heap_pages(
     struct domain *d)
 {
     unsigned int first_node, i, j, zone = 0, nodemask_retry = 0;
+    unsigned int first_dirty, dirty_cnt = 0, dirty_order;
     unsigned int node = (uint8_t)((memflags >> _MEMF_node) - 1);
     unsigned long request = 1UL << order;
     struct page_info *pg;
     nodemask_t nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
-    bool_t need_tlbflush = 0;
+    bool_t need_tlbflush = 0, reserved;
+    long claims;
     uint32_t tlbflush_timestamp = 0;
 
     if ( node == NUMA_NO_NODE )
@@ -609,15 +798,22 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
-    spin_lock(&heap_lock);
+    /*
+     * Take the pages off total_avail_pages before looking at the claims,
+     * see outstanding_claims.  If there aren't that many, only tmem may
+     * still help.
+     */
+    reserved = total_avail_pages_reserve(request);
 
     /*
      * Claimed memory is considered unavailable unless the request
      * is made by a domain with sufficient unclaimed pages.
      */
-    if ( (outstanding_claims + request >
-          total_avail_pages + tmem_freeable_pages()) &&
-          (d == NULL || d->outstanding_pages < request) )
+    claims = read_atomic(&outstanding_claims);
+    if ( unlikely(claims) &&
+         (claims + (reserved ? 0 : request) >
+          read_atomic(&total_avail_pages) + tmem_freeable_pages()) &&
+         (d == NULL || read_atomic(&d->outstanding_pages) < request) )
         goto not_found;
 
     /*
@@ -627,28 +823,62 @@ static struct page_info *alloc_heap_pages(
      * post-dom0-creation-multi-page allocations can be eliminated.
      */
     if ( opt_tmem && ((order == 0) || (order >= 9)) &&
-         (total_avail_pages <= midsize_alloc_zone_pages) &&
+         (read_atomic(&total_avail_pages) <=
+          read_atomic(&midsize_alloc_zone_pages)) &&
          tmem_freeable_pages() )
         goto try_tmem;
 
+    if ( !reserved )
+        goto not_found;
+
     /*
      * Start with requested node, but exhaust all node memory in requested 
      * zone before failing, only calc new node value if we fail to find memory 
      * in target node, this avoids needless computation on fast-path.
+     * Only one node's lock is held at a time.
      */
     for ( ; ; )
     {
-        zone = zone_hi;
-        do {
-            /* Check if target node can support the allocation. */
-            if ( !avail[node] || (avail[node][zone] < request) )
-                continue;
-
-            /* Find smallest order which can satisfy the request. */
-            for ( j = order; j <= MAX_ORDER; j++ )
-                if ( (pg = page_list_remove_head(&heap(node, zone, j))) )
+        if ( node_may_have_pages(node, zone_lo, zone_hi, order) )
+        {
+            spin_lock(node_heap_lock(node));
+
+            zone = zone_hi;
+            do {
+                /* Check if target node can support the allocation. */
+                if ( avail[node][zone] < request )
+                    continue;
+
+                /*
+                 * Find smallest order which can satisfy the request.
+                 * For order > 0, clean buddies (at the head of their lists)
+                 * are preferred, even if larger, so that e.g. dom0 doesn't
+                 * wait for memory left dirty at boot to be scrubbed.  Single
+                 * pages are cheap to scrub, and splitting a large clean
+                 * buddy for one would fragment the heap.
+                 */
+                dirty_order = MAX_ORDER + 1;
+                for ( j = order; j <= MAX_ORDER; j++ )
+                {
+                    if ( page_list_empty(&heap(node, zone, j)) )
+                        continue;
+                    pg = page_list_first(&heap(node, zone, j));
+                    if ( order == 0 ||
+                         pg->u.free.first_dirty == INVALID_DIRTY_IDX )
+                        goto found;
+                    if ( dirty_order > MAX_ORDER )
+                        dirty_order = j;
+                }
+                if ( dirty_order <= MAX_ORDER )
+                {
+                    j = dirty_order;
+                    pg = page_list_first(&heap(node, zone, j));
                     goto found;
-        } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+                }
+            } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+
+            spin_unlock(node_heap_lock(node));
+        }
 
         if ( memflags & MEMF_exact_node )
             goto not_found;
@@ -681,30 +911,43 @@ static struct page_info *alloc_heap_pages(
     if ( (pg = tmem_relinquish_pages(order, memflags)) != NULL )
     {
         /* reassigning an already allocated anonymous heap page */
-        spin_unlock(&heap_lock);
+        if ( reserved )
+            total_avail_pages_add(request);
         return pg;
     }
 
  not_found:
     /* No suitable memory blocks. Fail the request. */
-    spin_unlock(&heap_lock);
+    if ( reserved )
+        total_avail_pages_add(request);
     return NULL;
 
  found: 
+    page_list_del(pg, &heap(node, zone, j));
+    check_and_stop_scrub(pg);
+    first_dirty = pg->u.free.first_dirty;
+
     /* We may have to halve the chunk a number of times. */
     while ( j != order )
     {
-        PFN_ORDER(pg) = --j;
-        page_list_add_tail(pg, &heap(node, zone, j));
+        j--;
+        page_list_add_scrub(pg, node, zone, j,
+                            (1U << j) > first_dirty ?
+                            first_dirty : INVALID_DIRTY_IDX);
         pg += 1 << j;
+
+        if ( first_dirty != INVALID_DIRTY_IDX )
+        {
+            /* The part we keep may be dirty from its start onwards. */
+            if ( first_dirty >= (1U << j) )
+                first_dirty -= 1U << j;
+            else
+                first_dirty = 0;
+        }
     }
 
     ASSERT(avail[node][zone] >= request);
     avail[node][zone] -= request;
-    total_avail_pages -= request;
-    ASSERT(total_avail_pages >= 0);
-
-    check_low_mem_virq();
 
     if ( d != NULL )
         d->last_alloc_node = node;
@@ -712,8 +955,16 @@ static struct page_info *alloc_heap_pages(
     for ( i = 0; i < (1 << order); i++ )
     {
         /* Reference count must continuously be zero for free pages. */
-        BUG_ON(pg[i].count_info != PGC_state_free);
-        pg[i].count_info = PGC_state_inuse;
+        BUG_ON((pg[i].count_info & ~PGC_need_scrub) != PGC_state_free);
+
+        /* Pages needing a scrub keep their flag until scrubbed below. */
+        if ( pg[i].count_info & PGC_need_scrub )
+        {
+            dirty_cnt++;
+            pg[i].count_info = PGC_state_inuse | PGC_need_scrub;
+        }
+        else
+            pg[i].count_info = PGC_state_inuse;
 
         if ( pg[i].u.free.need_tlbflush &&
              (pg[i].tlbflush_timestamp <= tlbflush_current_time()) &&
@@ -734,7 +985,23 @@ static struct page_info *alloc_heap_pages(
         flush_page_to_ram(page_to_mfn(&pg[i]));
     }
 
-    spin_unlock(&heap_lock);
+    node_need_scrub[node] -= dirty_cnt;
+
+    spin_unlock(node_heap_lock(node));
+
+    check_low_mem_virq();
+
+    if ( first_dirty != INVALID_DIRTY_IDX )
+    {
+        for ( i = first_dirty; i < (1U << order); i++ )
+        {
+            if ( !(pg[i].count_info & PGC_need_scrub) )
+                continue;
+            scrub_one_page(&pg[i]);
+            pg[i].count_info &= ~PGC_need_scrub;
+            perfc_incr(scrub_alloc_pages);
+        }
+    }
 
     if ( need_tlbflush )
     {
@@ -757,8 +1024,14 @@ static int reserve_offlined_page(struct page_info *head)
     int zone = page_to_zone(head), i, head_order = PFN_ORDER(head), count = 0;
     struct page_info *cur_head;
     int cur_order;
+    unsigned int first_dirty;
 
-    ASSERT(spin_is_locked(&heap_lock));
+    ASSERT(spin_is_locked(node_heap_lock(node)));
+
+    check_and_stop_scrub(head);
+    /* Any of the remaining chunks may be dirty if the buddy was. */
+    first_dirty = (head->u.free.first_dirty == INVALID_DIRTY_IDX) ?
+                  INVALID_DIRTY_IDX : 0;
 
     cur_head = head;
 
@@ -798,8 +1071,8 @@ static int reserve_offlined_page(struct page_info *head)
             {
             merge:
                 /* We don't consider merging outside the head_order. */
-                page_list_add_tail(cur_head, &heap(node, zone, cur_order));
-                PFN_ORDER(cur_head) = cur_order;
+                page_list_add_scrub(cur_head, node, zone, cur_order,
+                                    first_dirty);
                 cur_head += (1 << cur_order);
                 break;
             }
@@ -812,31 +1085,39 @@ static int reserve_offlined_page(struct page_info *head)
             continue;
 
         avail[node][zone]--;
-        total_avail_pages--;
-        ASSERT(total_avail_pages >= 0);
 
+        /* The flag is kept, so that online_page() frees it as dirty. */
+        if ( cur_head->count_info & PGC_need_scrub )
+            node_need_scrub[node]--;
+
+        spin_lock(&page_offline_lock);
         page_list_add_tail(cur_head,
                            test_bit(_PGC_broken, &cur_head->count_info) ?
                            &page_broken_list : &page_offlined_list);
+        spin_unlock(&page_offline_lock);
 
         count++;
     }
 
+    if ( count )
+        total_avail_pages_add(-count);
+
     return count;
 }
 
-/* Free 2^@order set of pages. */
+/* Free 2^@order set of pages, marking them as dirty if @need_scrub. */
 static void free_heap_pages(
-    struct page_info *pg, unsigned int order)
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
 {
     unsigned long mask, mfn = page_to_mfn(pg);
     unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
     unsigned int zone = page_to_zone(pg);
+    unsigned int first_dirty = need_scrub ? 0 : INVALID_DIRTY_IDX;
 
     ASSERT(order <= MAX_ORDER);
     ASSERT(node >= 0);
 
-    spin_lock(&heap_lock);
+    spin_lock(node_heap_lock(node));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -855,7 +1136,8 @@ static void free_heap_pages(
         pg[i].count_info =
             ((pg[i].count_info & PGC_broken) |
              (page_state_is(&pg[i], offlining)
-              ? PGC_state_offlined : PGC_state_free));
+              ? PGC_state_offlined : PGC_state_free) |
+             (need_scrub ? PGC_need_scrub : 0));
         if ( page_state_is(&pg[i], offlined) )
             tainted = 1;
 
@@ -870,11 +1152,12 @@ static void free_heap_pages(
     }
 
     avail[node][zone] += 1 << order;
-    total_avail_pages += 1 << order;
+    total_avail_pages_add(1 << order);
+    if ( need_scrub )
+        node_need_scrub[node] += 1 << order;
 
     if ( opt_tmem )
-        midsize_alloc_zone_pages = max(
-            midsize_alloc_zone_pages, total_avail_pages / MIDSIZE_ALLOC_FRAC);
+        update_midsize_alloc_zone_pages();
 
     /* Merge chunks as far as possible. */
     while ( order < MAX_ORDER )
@@ -889,8 +1172,15 @@ static void free_heap_pages(
                  (PFN_ORDER(pg-mask) != order) ||
                  (phys_to_nid(page_to_maddr(pg-mask)) != node) )
                 break;
+            check_and_stop_scrub(pg - mask);
             pg -= mask;
             page_list_del(pg, &heap(node, zone, order));
+
+            /* The merged buddy's dirty part starts in its lower half... */
+            if ( pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = pg->u.free.first_dirty;
+            else if ( first_dirty != INVALID_DIRTY_IDX )
+                first_dirty += mask;
         }
         else
         {
@@ -900,21 +1190,214 @@ static void free_heap_pages(
                  (PFN_ORDER(pg+mask) != order) ||
                  (phys_to_nid(page_to_maddr(pg+mask)) != node) )
                 break;
+            check_and_stop_scrub(pg + mask);
             page_list_del(pg + mask, &heap(node, zone, order));
+
+            /* ... or in its upper half. */
+            if ( first_dirty == INVALID_DIRTY_IDX &&
+                 (pg + mask)->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = mask + (pg + mask)->u.free.first_dirty;
         }
 
         order++;
     }
 
-    PFN_ORDER(pg) = order;
-    page_list_add_tail(pg, &heap(node, zone, order));
+    page_list_add_scrub(pg, node, zone, order, first_dirty);
 
     if ( tainted )
         reserve_offlined_page(pg);
 
-    spin_unlock(&heap_lock);
+    spin_unlock(node_heap_lock(node));
 }
 
+/*
+ * Pick a node for an idle CPU to scrub: its own, or else a node without
+ * CPUs of its own.  With @get_node set, the node is also claimed in
+ * node_scrubbing, so that only one CPU scrubs any given node.
+ */
+static unsigned int node_to_scrub(bool_t get_node)
+{
+    unsigned int local_node = cpu_to_node(smp_processor_id()), node;
+
+    if ( local_node == NUMA_NO_NODE )
+        local_node = 0;
+
+    if ( node_need_scrub[local_node] &&
+         (!get_node || !node_test_and_set(local_node, node_scrubbing)) )
+        return local_node;
+
+    for_each_online_node ( node )
+    {
+        if ( node == local_node || !node_need_scrub[node] ||
+             !cpumask_empty(&node_to_cpumask(node)) )
+            continue;
+        if ( !get_node || !node_test_and_set(node, node_scrubbing) )
+            return node;
+    }
+
+    return NUMA_NO_NODE;
+}
+
+/*
+ * Update a buddy being scrubbed without the heap lock held: only its
+ * scrubber and, while holding the lock, check_and_stop_scrub() write to it.
+ */
+static void scrub_done(struct page_info *head, unsigned int first_dirty)
+{
+    typeof(head->u.free) pgfree;
+
+    pgfree.val = head->u.free.val;
+    pgfree.first_dirty = first_dirty;
+    pgfree.scrub_state = BUDDY_NOT_SCRUBBING;
+    smp_wmb();
+    write_atomic(&head->u.free.val, pgfree.val);
+}
+
+static unsigned int scrub_state(struct page_info *head)
+{
+    typeof(head->u.free) pgfree;
+
+    pgfree.val = read_atomic(&head->u.free.val);
+    return pgfree.scrub_state;
+}
+
+/*
+ * Scrub free pages of one node from the idle loop.  Buddies are scrubbed
+ * with the node's heap lock dropped; the work is preempted as soon as the CPU has
+ * anything else to do.  Returns whether there is more scrubbing to do,
+ * i.e. whether the caller should refrain from going to sleep.
+ */
+bool_t scrub_free_pages(void)
+{
+    struct page_info *pg;
+    unsigned int zone, order, i, node, first_dirty, dirty_cnt;
+    unsigned int cpu = smp_processor_id();
+    unsigned long cnt = 0;
+    bool_t aborted;
+
+    /* Softirqs, tasklets or going offline take precedence. */
+    if ( !cpu_is_haltable(cpu) )
+        return 1;
+
+    node = node_to_scrub(1);
+    if ( node == NUMA_NO_NODE )
+        return 0;
+
+    spin_lock(node_heap_lock(node));
+
+    for ( zone = 0; zone < NR_ZONES; zone++ )
+    {
+        order = MAX_ORDER;
+        do {
+            while ( !page_list_empty(&heap(node, zone, order)) )
+            {
+                /* Dirty buddies are always at the end of the list. */
+                pg = page_list_last(&heap(node, zone, order));
+                if ( pg->u.free.first_dirty == INVALID_DIRTY_IDX )
+                    break;
+
+                ASSERT(pg->u.free.scrub_state == BUDDY_NOT_SCRUBBING);
+                pg->u.free.scrub_state = BUDDY_SCRUBBING;
+
+                spin_unlock(node_heap_lock(node));
+
+                dirty_cnt = 0;
+                aborted = 0;
+                for ( i = pg->u.free.first_dirty; i < (1U << order); i++ )
+                {
+                    if ( test_bit(_PGC_need_scrub, &pg[i].count_info) )
+                    {
+                        scrub_one_page(&pg[i]);
+                        clear_bit(_PGC_need_scrub, &pg[i].count_info);
+                        dirty_cnt++;
+                        /* Scrubbed pages weigh more than clean ones. */
+                        cnt += 100;
+                    }
+                    else
+                        cnt++;
+
+                    if ( scrub_state(pg) == BUDDY_SCRUB_ABORT )
+                    {
+                        /* Somebody wants this buddy: let go of it. */
+                        aborted = 1;
+                        i++;
+                        break;
+                    }
+
+                    /*
+                     * Do a little work (a few pages, or many clean ones)
+                     * before checking for preemption.
+                     */
+                    if ( cnt > 800 && !cpu_is_haltable(cpu) )
+                    {
+                        i++;
+                        break;
+                    }
+                }
+
+                first_dirty = (i < (1U << order)) ? i : INVALID_DIRTY_IDX;
+
+                if ( aborted )
+                    scrub_done(pg, first_dirty);
+                else
+                {
+                    /* Don't deadlock against check_and_stop_scrub(). */
+                    while ( !spin_trylock(node_heap_lock(node)) )
+                    {
+                        if ( scrub_state(pg) == BUDDY_SCRUB_ABORT )
+                        {
+                            scrub_done(pg, first_dirty);
+                            aborted = 1;
+                            break;
+                        }
+                        cpu_relax();
+                    }
+                }
+
+                if ( aborted )
+                {
+                    /* The buddy may be gone from the list by now. */
+                    spin_lock(node_heap_lock(node));
+                    node_need_scrub[node] -= dirty_cnt;
+                    perfc_add(scrub_idle_pages, dirty_cnt);
+                    goto out;
+                }
+
+                pg->u.free.first_dirty = first_dirty;
+                pg->u.free.scrub_state = BUDDY_NOT_SCRUBBING;
+                node_need_scrub[node] -= dirty_cnt;
+                perfc_add(scrub_idle_pages, dirty_cnt);
+
+                if ( first_dirty == INVALID_DIRTY_IDX )
+                {
+                    /* Now clean: move it to the front of its list. */
+                    page_list_del(pg, &heap(node, zone, order));
+                    page_list_add(pg, &heap(node, zone, order));
+                }
+
+                if ( !node_need_scrub[node] || !cpu_is_haltable(cpu) )
+                    goto out;
+            }
+        } while ( order-- != 0 );
+    }
+
+ out:
+    spin_unlock(node_heap_lock(node));
+    node_clear(node, node_scrubbing);
+
+    return node_to_scrub(0) != NUMA_NO_NODE;
+}
+
+unsigned long total_scrub_pages(void)
+{
+    unsigned int node;
+    unsigned long pages = 0;
+
+    for_each_online_node ( node )
+        pages += node_need_scrub[node];
+
+    return pages;
+}
 
 /*
  * Following rules applied for page offline:
@@ -927,7 +1410,7 @@ static unsigned long mark_page_offline(struct page_info *pg, int broken)
     unsigned long nx, x, y = pg->count_info;
 
     ASSERT(page_is_ram_type(page_to_mfn(pg), RAM_TYPE_CONVENTIONAL));
-    ASSERT(spin_is_locked(&heap_lock));
+    ASSERT(spin_is_locked(node_heap_lock(phys_to_nid(page_to_maddr(pg)))));
 
     do {
         nx = x = y;
@@ -980,6 +1463,7 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
     unsigned long old_info = 0;
     struct domain *owner;
     struct page_info *pg;
+    unsigned int node;
 
     if ( !mfn_valid(mfn) )
     {
@@ -1021,7 +1505,8 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
         return 0;
     }
 
-    spin_lock(&heap_lock);
+    node = phys_to_nid(page_to_maddr(pg));
+    spin_lock(node_heap_lock(node));
 
     old_info = mark_page_offline(pg, broken);
 
@@ -1029,14 +1514,14 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
     {
         reserve_heap_page(pg);
 
-        spin_unlock(&heap_lock);
+        spin_unlock(node_heap_lock(node));
 
         *status = broken ? PG_OFFLINE_OFFLINED | PG_OFFLINE_BROKEN
                          : PG_OFFLINE_OFFLINED;
         return 0;
     }
 
-    spin_unlock(&heap_lock);
+    spin_unlock(node_heap_lock(node));
 
     if ( (owner = page_get_owner_and_reference(pg)) )
     {
@@ -1062,8 +1547,8 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
     else
     {
         /*
-         * assign_pages does not hold heap_lock, so small window that the owner
-         * may be set later, but please notice owner will only change from
+         * assign_pages does not hold the heap lock, so small window that the
+         * owner may be set later, but please notice owner will only change from
          * NULL to be set, not verse, since page is offlining now.
          * No windows If called from #MC handler, since all CPU are in softirq
          * If called from user space like CE handling, tools can wait some time
@@ -1088,6 +1573,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
 {
     unsigned long x, nx, y;
     struct page_info *pg;
+    unsigned int node;
     int ret;
 
     if ( !mfn_valid(mfn) )
@@ -1097,8 +1583,9 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
     }
 
     pg = mfn_to_page(mfn);
+    node = phys_to_nid(page_to_maddr(pg));
 
-    spin_lock(&heap_lock);
+    spin_lock(node_heap_lock(node));
 
     y = pg->count_info;
     do {
@@ -1113,7 +1600,9 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
 
         if ( (y & PGC_state) == PGC_state_offlined )
         {
+            spin_lock(&page_offline_lock);
             page_list_del(pg, &page_offlined_list);
+            spin_unlock(&page_offline_lock);
             *status = PG_ONLINE_ONLINED;
         }
         else if ( (y & PGC_state) == PGC_state_offlining )
@@ -1129,10 +1618,10 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
         nx = (x & ~PGC_state) | PGC_state_inuse;
     } while ( (y = cmpxchg(&pg->count_info, x, nx)) != x );
 
-    spin_unlock(&heap_lock);
+    spin_unlock(node_heap_lock(node));
 
     if ( (y & PGC_state) == PGC_state_offlined )
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, !!(y & PGC_need_scrub));
 
     return ret;
 }
@@ -1140,6 +1629,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
 int query_page_offline(unsigned long mfn, uint32_t *status)
 {
     struct page_info *pg;
+    unsigned int node;
 
     if ( !mfn_valid(mfn) || !page_is_ram_type(mfn, RAM_TYPE_CONVENTIONAL) )
     {
@@ -1148,9 +1638,10 @@ int query_page_offline(unsigned long mfn, uint32_t *status)
     }
 
     *status = 0;
-    spin_lock(&heap_lock);
-
     pg = mfn_to_page(mfn);
+    node = phys_to_nid(page_to_maddr(pg));
+
+    spin_lock(node_heap_lock(node));
 
     if ( page_state_is(pg, offlining) )
         *status |= PG_OFFLINE_STATUS_OFFLINE_PENDING;
@@ -1159,7 +1650,7 @@ int query_page_offline(unsigned long mfn, uint32_t *status)
     if ( page_state_is(pg, offlined) )
         *status |= PG_OFFLINE_STATUS_OFFLINED;
 
-    spin_unlock(&heap_lock);
+    spin_unlock(node_heap_lock(node));
 
     return 0;
 }
@@ -1168,10 +1659,11 @@ int query_page_offline(unsigned long mfn, uint32_t *status)
  * Hand the specified arbitrary page range to the specified heap zone
  * checking the node_id of the previous page.  If they differ and the
  * latter is not on a MAX_ORDER boundary, then we reserve the page by
- * not freeing it to the buddy allocator.
+ * not freeing it to the buddy allocator.  The pages are marked as
+ * needing a scrub if @need_scrub.
  */
 static void init_heap_pages(
-    struct page_info *pg, unsigned long nr_pages)
+    struct page_info *pg, unsigned long nr_pages, bool_t need_scrub)
 {
     unsigned long i;
 
@@ -1201,7 +1693,7 @@ static void init_heap_pages(
             nr_pages -= n;
         }
 
-        free_heap_pages(pg+i, 0);
+        free_heap_pages(pg+i, 0, need_scrub);
     }
 }
 
@@ -1228,12 +1720,15 @@ static unsigned long avail_heap_pages(
 
 unsigned long total_free_pages(void)
 {
-    return total_avail_pages - midsize_alloc_zone_pages;
+    return read_atomic(&total_avail_pages) + atomic_read(&page_cache_pages) -
+           read_atomic(&midsize_alloc_zone_pages);
 }
 
 void __init end_boot_allocator(void)
 {
     unsigned int i;
+    /* With bootscrub=idle, all free memory starts off dirty. */
+    bool_t need_scrub = (opt_bootscrub == BOOTSCRUB_IDLE);
 
     /* Pages that are free now go to the domain sub-allocator. */
     for ( i = 0; i < nr_bootmem_regions; i++ )
@@ -1242,7 +1737,7 @@ void __init end_boot_allocator(void)
         if ( (r->s < r->e) &&
              (phys_to_nid(pfn_to_paddr(r->s)) == cpu_to_node(0)) )
         {
-            init_heap_pages(mfn_to_page(r->s), r->e - r->s);
+            init_heap_pages(mfn_to_page(r->s), r->e - r->s, need_scrub);
             r->e = r->s;
             break;
         }
@@ -1251,9 +1746,9 @@ void __init end_boot_allocator(void)
     {
         struct bootmem_region *r = &bootmem_region_list[i];
         if ( r->s < r->e )
-            init_heap_pages(mfn_to_page(r->s), r->e - r->s);
+            init_heap_pages(mfn_to_page(r->s), r->e - r->s, need_scrub);
     }
-    init_heap_pages(virt_to_page(bootmem_region_list), 1);
+    init_heap_pages(virt_to_page(bootmem_region_list), 1, need_scrub);
 
     if ( !dma_bitsize && (num_online_nodes() > 1) )
     {
@@ -1325,6 +1820,23 @@ static void __init smp_scrub_heap_pages(void *data)
     }
 }
 
+/* Keep the heap still while it gets scrubbed. */
+static void __init lock_all_heaps(void)
+{
+    unsigned int node;
+
+    for_each_online_node ( node )
+        spin_lock(node_heap_lock(node));
+}
+
+static void __init unlock_all_heaps(void)
+{
+    unsigned int node;
+
+    for_each_online_node ( node )
+        spin_unlock(node_heap_lock(node));
+}
+
 static int __init find_non_smt(unsigned int node, cpumask_t *dest)
 {
     cpumask_t node_cpus;
@@ -1356,9 +1868,22 @@ void __init scrub_heap_pages(void)
     int last_distance, best_node;
     int cpus;
 
-    if ( !opt_bootscrub )
+    if ( opt_bootscrub == BOOTSCRUB_OFF )
         return;
 
+    if ( opt_bootscrub == BOOTSCRUB_IDLE )
+    {
+        /*
+         * All free memory was marked dirty by end_boot_allocator(): idle
+         * CPUs scrub it node by node, while allocations of more than one
+         * page prefer whatever is clean already; anything dirty handed out
+         * is scrubbed first.
+         */
+        printk("Scrubbing Free RAM in background\n");
+        setup_low_mem_virq();
+        return;
+    }
+
     cpumask_clear(&all_worker_cpus);
     /* Scrub block size. */
     chunk_size = opt_bootscrub_chunk >> PAGE_SHIFT;
@@ -1407,9 +1932,9 @@ void __init scrub_heap_pages(void)
 
         process_pending_softirqs();
 
-        spin_lock(&heap_lock);
+        lock_all_heaps();
         on_selected_cpus(&all_worker_cpus, smp_scrub_heap_pages, NULL, 1);
-        spin_unlock(&heap_lock);
+        unlock_all_heaps();
 
         printk(".");
     }
@@ -1464,9 +1989,9 @@ void __init scrub_heap_pages(void)
 
             process_pending_softirqs();
 
-            spin_lock(&heap_lock);
+            lock_all_heaps();
             on_selected_cpus(&node_cpus, smp_scrub_heap_pages, &region[i], 1);
-            spin_unlock(&heap_lock);
+            unlock_all_heaps();
 
             printk(".");
         }
@@ -1505,7 +2030,7 @@ void init_xenheap_pages(paddr_t ps, paddr_t pe)
 
     memguard_guard_range(maddr_to_virt(ps), pe - ps);
 
-    init_heap_pages(maddr_to_page(ps), (pe - ps) >> PAGE_SHIFT);
+    init_heap_pages(maddr_to_page(ps), (pe - ps) >> PAGE_SHIFT, 0);
 }
 
 
@@ -1535,7 +2060,7 @@ void free_xenheap_pages(void *v, unsigned int order)
 
     memguard_guard_range(v, 1 << (order + PAGE_SHIFT));
 
-    free_heap_pages(virt_to_page(v), order);
+    free_heap_pages(virt_to_page(v), order, 0);
 }
 
 #else
@@ -1587,12 +2112,9 @@ void free_xenheap_pages(void *v, unsigned int order)
     pg = virt_to_page(v);
 
     for ( i = 0; i < (1u << order); i++ )
-    {
-        scrub_one_page(&pg[i]);
         pg[i].count_info &= ~PGC_xen_heap;
-    }
 
-    free_heap_pages(pg, order);
+    free_heap_pages(pg, order, 1);
 }
 
 #endif
@@ -1603,6 +2125,309 @@ void free_xenheap_pages(void *v, unsigned int order)
  * DOMAIN-HEAP SUB-ALLOCATOR
  */
 
+/*
+ * Per-CPU caches ("magazines") of free single pages in front of the heap,
+ * so that the most frequent allocations and frees (p2m, shadow and page
+ * table pages, ballooning) neither take a heap lock nor split and merge
+ * buddies.  A CPU only caches pages of its own node, at most
+ * opt_page_cache of them.  An empty cache is refilled with a chunk of
+ * 2^PAGE_CACHE_BATCH_ORDER pages from the heap, and an overflowing one
+ * returns that many of its coldest pages.  Should the heap run out, all
+ * caches are drained before an allocation is allowed to fail.
+ *
+ * Cached pages look like anonymous pages allocated by Xen (in use, with
+ * neither owner nor references), so that offlining one only completes
+ * once it goes back to the heap.  Their u.free.first_dirty (0 if the
+ * page needs scrubbing), u.free.need_tlbflush and tlbflush_timestamp are
+ * kept as for free pages.
+ */
+#define PAGE_CACHE_BATCH_ORDER 3
+
+static unsigned int __read_mostly opt_page_cache = 64;
+integer_param("page_cache", opt_page_cache);
+
+struct page_cache {
+    spinlock_t lock;
+    struct page_list_head pages;
+    unsigned int count;
+    bool_t enabled;
+};
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+
+/* Return a list of cached pages to the heap. */
+static void page_cache_flush(struct page_list_head *list)
+{
+    struct page_info *pg;
+    bool_t need_tlbflush = 0;
+    uint32_t tlbflush_timestamp = 0;
+
+    /*
+     * The pages have no owner any more, so the heap wouldn't know to flush
+     * TLBs before reusing them: do it now, if needed at all.
+     */
+    page_list_for_each ( pg, list )
+        if ( pg->u.free.need_tlbflush &&
+             (pg->tlbflush_timestamp <= tlbflush_current_time()) &&
+             (!need_tlbflush ||
+              (pg->tlbflush_timestamp > tlbflush_timestamp)) )
+        {
+            need_tlbflush = 1;
+            tlbflush_timestamp = pg->tlbflush_timestamp;
+        }
+
+    if ( need_tlbflush )
+    {
+        cpumask_t mask = cpu_online_map;
+        tlbflush_filter(mask, tlbflush_timestamp);
+        if ( !cpumask_empty(&mask) )
+        {
+            perfc_incr(need_flush_tlb_flush);
+            flush_tlb_mask(&mask);
+        }
+    }
+
+    while ( (pg = page_list_remove_head(list)) != NULL )
+        free_heap_pages(pg, 0, pg->u.free.first_dirty != INVALID_DIRTY_IDX);
+}
+
+/*
+ * Allocate a page from this CPU's cache, refilling it if empty.  Returns
+ * NULL if the cache can't be used for this request.
+ */
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int memflags, struct domain *d)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    unsigned int node = cpu_to_node(smp_processor_id());
+    unsigned int req_node = (uint8_t)((memflags >> _MEMF_node) - 1);
+    unsigned int i, zone;
+    struct page_info *pg = NULL;
+
+    /* Claims are checked, and kept exact, by the heap. */
+    if ( !pc->enabled || node == NUMA_NO_NODE ||
+         (req_node != NUMA_NO_NODE && req_node != node) ||
+         (d != NULL && !node_isset(node, d->node_affinity)) ||
+         read_atomic(&outstanding_claims) )
+        return NULL;
+
+    spin_lock(&pc->lock);
+    if ( !page_list_empty(&pc->pages) )
+    {
+        pg = page_list_first(&pc->pages);
+        zone = page_to_zone(pg);
+        if ( zone >= zone_lo && zone <= zone_hi )
+        {
+            page_list_del(pg, &pc->pages);
+            pc->count--;
+            atomic_dec(&page_cache_pages);
+        }
+        else
+            pg = NULL;
+        spin_unlock(&pc->lock);
+
+        if ( pg == NULL )
+            return NULL;
+
+        /*
+         * A claim staked since we checked may have counted this page as
+         * available (see outstanding_claims), so check again now that it is
+         * off page_cache_pages.  Being offlined: let the heap complete that.
+         */
+        smp_mb();
+        if ( unlikely(read_atomic(&outstanding_claims)) ||
+             unlikely(page_state_is(pg, offlining)) )
+        {
+            free_heap_pages(pg, 0,
+                            pg->u.free.first_dirty != INVALID_DIRTY_IDX);
+            return NULL;
+        }
+
+        if ( pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+        {
+            scrub_one_page(pg);
+            perfc_incr(scrub_alloc_pages);
+        }
+
+        if ( pg->u.free.need_tlbflush &&
+             (pg->tlbflush_timestamp <= tlbflush_current_time()) )
+        {
+            cpumask_t mask = cpu_online_map;
+            tlbflush_filter(mask, pg->tlbflush_timestamp);
+            if ( !cpumask_empty(&mask) )
+            {
+                perfc_incr(need_flush_tlb_flush);
+                flush_tlb_mask(&mask);
+            }
+        }
+
+        pg->u.inuse.type_info = 0;
+        flush_page_to_ram(page_to_mfn(pg));
+        perfc_incr(page_cache_hits);
+
+        return pg;
+    }
+    spin_unlock(&pc->lock);
+
+    /* Refill from the local node, keeping the first page for the caller. */
+    pg = alloc_heap_pages(zone_lo, zone_hi, PAGE_CACHE_BATCH_ORDER,
+                          MEMF_node(node) | MEMF_exact_node, NULL);
+    if ( pg == NULL )
+        return NULL;
+
+    spin_lock(&pc->lock);
+    for ( i = 1; i < (1U << PAGE_CACHE_BATCH_ORDER); i++ )
+    {
+        /* Clean, and TLBs already flushed as needed by the heap. */
+        pg[i].u.free.first_dirty = INVALID_DIRTY_IDX;
+        pg[i].u.free.need_tlbflush = 0;
+        page_list_add_tail(&pg[i], &pc->pages);
+    }
+    pc->count += i - 1;
+    atomic_add(i - 1, &page_cache_pages);
+    spin_unlock(&pc->lock);
+
+    return pg;
+}
+
+/*
+ * Free a page into this CPU's cache, to be scrubbed when next allocated if
+ * @need_scrub.  Returns whether the cache took the page.
+ */
+static bool_t page_cache_free(struct page_info *pg, bool_t need_scrub)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    unsigned int i, node = cpu_to_node(smp_processor_id());
+    unsigned long x = pg->count_info;
+    PAGE_LIST_HEAD(flush);
+
+    if ( !pc->enabled || phys_to_nid(page_to_maddr(pg)) != node )
+        return 0;
+
+    /* Pages being offlined, or broken ones, go back to the heap. */
+    if ( ((x & (PGC_state | PGC_broken)) != PGC_state_inuse) ||
+         (cmpxchg(&pg->count_info, x, PGC_state_inuse) != x) )
+        return 0;
+
+    pg->u.inuse.type_info = 0;
+    pg->u.free.first_dirty = need_scrub ? 0 : INVALID_DIRTY_IDX;
+    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
+    if ( pg->u.free.need_tlbflush )
+        pg->tlbflush_timestamp = tlbflush_current_time();
+
+    /* This page is not a guest frame any more. */
+    page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
+    set_gpfn_from_mfn(page_to_mfn(pg), INVALID_M2P_ENTRY);
+
+    spin_lock(&pc->lock);
+    page_list_add(pg, &pc->pages);
+    atomic_inc(&page_cache_pages);
+    if ( ++pc->count > opt_page_cache )
+    {
+        for ( i = 0; i < (1U << PAGE_CACHE_BATCH_ORDER); i++ )
+        {
+            pg = page_list_last(&pc->pages);
+            page_list_del(pg, &pc->pages);
+            page_list_add_tail(pg, &flush);
+        }
+        pc->count -= i;
+        atomic_sub(i, &page_cache_pages);
+    }
+    spin_unlock(&pc->lock);
+
+    page_cache_flush(&flush);
+
+    return 1;
+}
+
+/* Return all pages in @cpu's cache to the heap. */
+static unsigned int page_cache_drain_cpu(unsigned int cpu)
+{
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    PAGE_LIST_HEAD(flush);
+    unsigned int count;
+
+    spin_lock(&pc->lock);
+    count = pc->count;
+    page_list_move(&flush, &pc->pages);
+    pc->count = 0;
+    atomic_sub(count, &page_cache_pages);
+    spin_unlock(&pc->lock);
+
+    page_cache_flush(&flush);
+
+    return count;
+}
+
+/* Memory is short: drain all caches.  Returns whether that freed anything. */
+static bool_t page_cache_drain(void)
+{
+    unsigned int cpu, count = 0;
+
+    if ( !atomic_read(&page_cache_pages) || !get_cpu_maps() )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+        if ( per_cpu(page_cache, cpu).enabled )
+            count += page_cache_drain_cpu(cpu);
+
+    put_cpu_maps();
+
+    perfc_incr(page_cache_drains);
+
+    return count != 0;
+}
+
+static int page_cache_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        if ( !opt_page_cache || pc->enabled )
+            break;
+        spin_lock_init(&pc->lock);
+        INIT_PAGE_LIST_HEAD(&pc->pages);
+        pc->count = 0;
+        smp_wmb();
+        pc->enabled = 1;
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        if ( !pc->enabled )
+            break;
+        page_cache_drain_cpu(cpu);
+        pc->enabled = 0;
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block page_cache_cpu_nfb = {
+    .notifier_call = page_cache_cpu_callback
+};
+
+static int __init page_cache_init(void)
+{
+    void *hcpu = (void *)(long)smp_processor_id();
+
+    /* Must be able to take a whole batch when full. */
+    if ( opt_page_cache && opt_page_cache < (2U << PAGE_CACHE_BATCH_ORDER) )
+        opt_page_cache = 2U << PAGE_CACHE_BATCH_ORDER;
+
+    page_cache_cpu_callback(&page_cache_cpu_nfb, CPU_UP_PREPARE, hcpu);
+    register_cpu_notifier(&page_cache_cpu_nfb);
+
+    return 0;
+}
+presmp_initcall(page_cache_init);
+
 void init_domheap_pages(paddr_t ps, paddr_t pe)
 {
     unsigned long smfn, emfn;
@@ -1615,7 +2440,7 @@ void init_domheap_pages(paddr_t ps, paddr_t pe)
     if ( emfn <= smfn )
         return;
 
-    init_heap_pages(mfn_to_page(smfn), emfn - smfn);
+    init_heap_pages(mfn_to_page(smfn), emfn - smfn, 0);
 }
 
 
@@ -1678,6 +2503,7 @@ struct page_info *alloc_domheap_pages(
     struct page_info *pg = NULL;
     unsigned int bits = memflags >> _MEMF_bits, zone_hi = NR_ZONES - 1;
     unsigned int dma_zone;
+    bool_t drained = 0;
 
     ASSERT(!in_irq());
 
@@ -1685,18 +2511,31 @@ struct page_info *alloc_domheap_pages(
     if ( (zone_hi = min_t(unsigned int, bits_to_zone(bits), zone_hi)) == 0 )
         return NULL;
 
+ retry:
     if ( dma_bitsize && ((dma_zone = bits_to_zone(dma_bitsize)) < zone_hi) )
-        pg = alloc_heap_pages(dma_zone + 1, zone_hi, order, memflags, d);
+    {
+        if ( order == 0 )
+            pg = page_cache_alloc(dma_zone + 1, zone_hi, memflags, d);
+        if ( pg == NULL )
+            pg = alloc_heap_pages(dma_zone + 1, zone_hi, order, memflags, d);
+    }
+    else if ( order == 0 )
+        pg = page_cache_alloc(MEMZONE_XEN + 1, zone_hi, memflags, d);
 
     if ( (pg == NULL) &&
          ((memflags & MEMF_no_dma) ||
           ((pg = alloc_heap_pages(MEMZONE_XEN + 1, zone_hi, order,
                                   memflags, d)) == NULL)) )
-         return NULL;
+    {
+        /* Free memory may be sitting in the per-CPU caches. */
+        if ( !drained && (drained = page_cache_drain()) )
+            goto retry;
+        return NULL;
+    }
 
     if ( (d != NULL) && assign_pages(d, pg, order, memflags) )
     {
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         return NULL;
     }
     
@@ -1764,11 +2603,8 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
             scrub = 1;
         }
 
-        if ( unlikely(scrub) )
-            for ( i = 0; i < (1 << order); i++ )
-                scrub_one_page(&pg[i]);
-
-        free_heap_pages(pg, order);
+        if ( order || !page_cache_free(pg, scrub) )
+            free_heap_pages(pg, order, scrub);
     }
 
     if ( drop_dom_ref )
@@ -1793,7 +2629,7 @@ unsigned long avail_domheap_pages(void)
 {
     return avail_heap_pages(MEMZONE_XEN + 1,
                             NR_ZONES - 1,
-                            -1);
+                            -1) + atomic_read(&page_cache_pages);
 }
 
 unsigned long avail_node_heap_pages(unsigned int nodeid)
@@ -1827,6 +2663,10 @@ static void pagealloc_info(unsigned char key)
     }
 
     printk("    Dom heap: %lukB free\n", total << (PAGE_SHIFT-10));
+    printk("    Free pages to scrub: %lukB\n",
+           total_scrub_pages() << (PAGE_SHIFT-10));
+    printk("    Per-CPU cached pages: %lukB\n",
+           (unsigned long)atomic_read(&page_cache_pages) << (PAGE_SHIFT-10));
 }
 
 static struct keyhandler pagealloc_info_keyhandler = {
@@ -1878,6 +2718,8 @@ static void dump_heap(unsigned char key)
         for ( j = 0; j < NR_ZONES; j++ )
             printk("heap[node=%d][zone=%d] -> %lu pages\n",
                    i, j, avail[i][j]);
+        printk("heap[node=%d] -> %lu pages to scrub\n",
+               i, node_need_scrub[i]);
     }
 }
 
@@ -45,6 +45,9 @@
 #include <xen/softirq.h>
 #include <xen/cpu.h>
 #include <xen/stop_machine.h>
+#include <xen/keyhandler.h>
+#include <xen/perfc.h>
+#include <xen/time.h>
 
 /* Global control variables for rcupdate callback mechanism. */
 static struct rcu_ctrlblk {
@@ -55,6 +58,12 @@ static struct rcu_ctrlblk {
     spinlock_t  lock __cacheline_aligned;
     cpumask_t   cpumask; /* CPUs that need to switch in order    */
     /* for current batch to proceed.        */
+
+    /* Grace period statistics, protected by lock. */
+    s_time_t    gp_start;      /* Start of the current grace period   */
+    s_time_t    gp_total;      /* Total length of completed periods   */
+    s_time_t    gp_max;        /* Longest completed grace period      */
+    unsigned long gp_count;    /* Number of completed grace periods   */
 } __cacheline_aligned rcu_ctrlblk = {
     .cur = -300,
     .completed = -300,
@@ -65,6 +74,8 @@ static struct rcu_ctrlblk {
  * Per-CPU data for Read-Copy Update.
  * nxtlist - new callbacks are added here
  * curlist - current batch for which quiescent cycle started if any
+ * donelist - callbacks whose grace period has completed
+ * offload - completed callbacks handed over by other, busier CPUs
  */
 struct rcu_data {
     /* 1) quiescent state handling : */
@@ -84,6 +95,16 @@ struct rcu_data {
     int cpu;
     struct rcu_head barrier;
     long            last_rs_qlen;     /* qlen during the last resched */
+    long            qlen_max;         /* Largest qlen seen */
+
+    /* 3) callback offload */
+    spinlock_t      offload_lock;     /* Protects offload list and qlen */
+    struct rcu_head *offload;
+    struct rcu_head **offloadtail;
+    long            offload_qlen;     /* # of callbacks on offload list */
+    long            offloaded;        /* # of donelist head from offload */
+    unsigned long   offload_out;      /* # of callbacks given away */
+    unsigned long   offload_in;       /* # of callbacks taken over */
 };
 
 static DEFINE_PER_CPU(struct rcu_data, rcu_data);
@@ -92,6 +113,11 @@ static int blimit = 10;
 static int qhimark = 10000;
 static int qlowmark = 100;
 static int rsinterval = 1000;
+static int qoffload = 1000;
+static int batch_us = 100;
+
+/* Offloaded callbacks which have not been invoked yet. */
+static atomic_t rcu_offload_pending = ATOMIC_INIT(0);
 
 struct rcu_barrier_data {
     struct rcu_head head;
@@ -119,7 +145,12 @@ static int rcu_barrier_action(void *_cpu_count)
      */
     call_rcu(&data.head, rcu_barrier_callback);
 
-    while ( atomic_read(data.cpu_count) != num_online_cpus() )
+    /*
+     * Callbacks offloaded to another CPU may run after that CPU's barrier
+     * callback, so also wait for all of those to have been invoked.
+     */
+    while ( atomic_read(data.cpu_count) != num_online_cpus() ||
+            atomic_read(&rcu_offload_pending) )
     {
         process_pending_softirqs();
         cpu_relax();
@@ -187,6 +218,8 @@ void call_rcu(struct rcu_head *head,
     rdp = &__get_cpu_var(rcu_data);
     *rdp->nxttail = head;
     rdp->nxttail = &head->next;
+    if (rdp->qlen >= rdp->qlen_max)
+        rdp->qlen_max = rdp->qlen + 1;
     if (unlikely(++rdp->qlen > qhimark)) {
         rdp->blimit = INT_MAX;
         force_quiescent_state(rdp, &rcu_ctrlblk);
@@ -194,6 +227,112 @@ void call_rcu(struct rcu_head *head,
     local_irq_restore(flags);
 }
 
+/*
+ * Pick the online cpu with the shortest callback queue, if it is
+ * sufficiently shorter than ours to be worth handing work over to.
+ */
+static unsigned int rcu_offload_target(const struct rcu_data *rdp)
+{
+    unsigned int cpu, target = nr_cpu_ids;
+    long qlen, best = rdp->qlen / 2;
+
+    for_each_online_cpu(cpu) {
+        struct rcu_data *trdp = &per_cpu(rcu_data, cpu);
+
+        if (cpu == rdp->cpu)
+            continue;
+        qlen = read_atomic(&trdp->qlen) + read_atomic(&trdp->offload_qlen);
+        if (qlen < best) {
+            best = qlen;
+            target = cpu;
+        }
+    }
+
+    return target;
+}
+
+/*
+ * Hand a chunk of completed callbacks over to a less loaded cpu, so that a
+ * burst of call_rcu() (e.g. from mass domain destruction) on one cpu is not
+ * processed by that cpu alone.
+ */
+static void rcu_offload(struct rcu_data *rdp)
+{
+    struct rcu_head *list, *head, **tail;
+    struct rcu_data *trdp;
+    unsigned int cpu;
+    long n;
+
+    /*
+     * Only offload when all callbacks taken over from other cpus are among
+     * those kept here, so that each is accounted in rcu_offload_pending once.
+     */
+    if (rdp->qlen <= qoffload || rdp->offloaded > qoffload)
+        return;
+
+    cpu = rcu_offload_target(rdp);
+    if (cpu >= nr_cpu_ids)
+        return;
+    trdp = &per_cpu(rcu_data, cpu);
+
+    /* Keep the first qoffload callbacks, and hand over the rest. */
+    for (n = 1, list = rdp->donelist; n < qoffload && list->next; n++)
+        list = list->next;
+    if (!list->next)
+        return;
+    head = list->next;
+    list->next = NULL;
+    tail = rdp->donetail;
+    rdp->donetail = &list->next;
+    for (n = 0, list = head; list; list = list->next)
+        n++;
+
+    local_irq_disable();
+    rdp->qlen -= n;
+    local_irq_enable();
+    rdp->offload_out += n;
+    atomic_add(n, &rcu_offload_pending);
+    perfc_add(rcu_offloaded, n);
+
+    spin_lock(&trdp->offload_lock);
+    *trdp->offloadtail = head;
+    trdp->offloadtail = tail;
+    trdp->offload_qlen += n;
+    spin_unlock(&trdp->offload_lock);
+
+    cpu_raise_softirq(cpu, RCU_SOFTIRQ);
+}
+
+/* Put callbacks offloaded to this cpu at the head of its donelist. */
+static void rcu_take_offload(struct rcu_data *rdp)
+{
+    struct rcu_head *list, **tail;
+    long n;
+
+    spin_lock(&rdp->offload_lock);
+    list = rdp->offload;
+    tail = rdp->offloadtail;
+    n = rdp->offload_qlen;
+    rdp->offload = NULL;
+    rdp->offloadtail = &rdp->offload;
+    rdp->offload_qlen = 0;
+    spin_unlock(&rdp->offload_lock);
+
+    if (!list)
+        return;
+
+    *tail = rdp->donelist;
+    if (!rdp->donelist)
+        rdp->donetail = tail;
+    rdp->donelist = list;
+    rdp->offloaded += n;
+    rdp->offload_in += n;
+
+    local_irq_disable();
+    rdp->qlen += n;
+    local_irq_enable();
+}
+
 /*
  * Invoke the completed RCU callbacks. They are expected to be in
  * a per-cpu list.
@@ -201,23 +340,41 @@ void call_rcu(struct rcu_head *head,
 static void rcu_do_batch(struct rcu_data *rdp)
 {
     struct rcu_head *next, *list;
+    s_time_t deadline = NOW() + MICROSECS(batch_us);
     int count = 0;
 
+    if (rdp->offload)
+        rcu_take_offload(rdp);
+
     list = rdp->donelist;
     while (list) {
         next = rdp->donelist = list->next;
         list->func(list);
         list = next;
         rdp->qlen--;
+        if (rdp->offloaded) {
+            rdp->offloaded--;
+            atomic_dec(&rcu_offload_pending);
+        }
         if (++count >= rdp->blimit)
             break;
+        /*
+         * Even with the batch limit lifted, don't hog the cpu: let other
+         * softirqs run and pick up the rest on the next invocation.
+         */
+        if (!(count & 15) && NOW() > deadline) {
+            perfc_incr(rcu_batch_resched);
+            break;
+        }
     }
     if (rdp->blimit == INT_MAX && rdp->qlen <= qlowmark)
         rdp->blimit = blimit;
     if (!rdp->donelist)
         rdp->donetail = &rdp->donelist;
-    else
+    else {
+        rcu_offload(rdp);
         raise_softirq(RCU_SOFTIRQ);
+    }
 }
 
 /*
@@ -254,6 +411,7 @@ static void rcu_start_batch(struct rcu_ctrlblk *rcp)
          */
         smp_wmb();
         rcp->cur++;
+        rcp->gp_start = NOW();
 
         cpumask_copy(&rcp->cpumask, &cpu_online_map);
     }
@@ -269,6 +427,12 @@ static void cpu_quiet(int cpu, struct rcu_ctrlblk *rcp)
     cpumask_clear_cpu(cpu, &rcp->cpumask);
     if (cpumask_empty(&rcp->cpumask)) {
         /* batch completed ! */
+        s_time_t len = NOW() - rcp->gp_start;
+
+        rcp->gp_count++;
+        rcp->gp_total += len;
+        if (len > rcp->gp_max)
+            rcp->gp_max = len;
         rcp->completed = rcp->cur;
         rcu_start_batch(rcp);
     }
@@ -353,7 +517,7 @@ static void __rcu_process_callbacks(struct rcu_ctrlblk *rcp,
         local_irq_enable();
     }
     rcu_check_quiescent_state(rcp, rdp);
-    if (rdp->donelist)
+    if (rdp->donelist || rdp->offload)
         rcu_do_batch(rdp);
 }
 
@@ -375,7 +539,7 @@ static int __rcu_pending(struct rcu_ctrlblk *rcp, struct rcu_data *rdp)
         return 1;
 
     /* This cpu has finished callbacks to invoke */
-    if (rdp->donelist)
+    if (rdp->donelist || rdp->offload)
         return 1;
 
     /* The rcu core waits for a quiescent state from the cpu */
@@ -433,10 +597,14 @@ static void rcu_offline_cpu(struct rcu_data *this_rdp,
     rcu_move_batch(this_rdp, rdp->donelist, rdp->donetail);
     rcu_move_batch(this_rdp, rdp->curlist, rdp->curtail);
     rcu_move_batch(this_rdp, rdp->nxtlist, rdp->nxttail);
+    rcu_move_batch(this_rdp, rdp->offload, rdp->offloadtail);
 
     local_irq_disable();
-    this_rdp->qlen += rdp->qlen;
+    this_rdp->qlen += rdp->qlen + rdp->offload_qlen;
     local_irq_enable();
+
+    /* Anything offloaded to the dead cpu is now queued normally here. */
+    atomic_sub(rdp->offloaded + rdp->offload_qlen, &rcu_offload_pending);
 }
 
 static void rcu_init_percpu_data(int cpu, struct rcu_ctrlblk *rcp,
@@ -450,6 +618,8 @@ static void rcu_init_percpu_data(int cpu, struct rcu_ctrlblk *rcp,
     rdp->qs_pending = 0;
     rdp->cpu = cpu;
     rdp->blimit = blimit;
+    spin_lock_init(&rdp->offload_lock);
+    rdp->offloadtail = &rdp->offload;
 }
 
 static int cpu_callback(
@@ -478,10 +648,45 @@ static struct notifier_block cpu_nfb = {
     .notifier_call = cpu_callback
 };
 
+static void dump_rcu(unsigned char key)
+{
+    struct rcu_ctrlblk *rcp = &rcu_ctrlblk;
+    unsigned long count;
+    s_time_t total, max;
+    unsigned int cpu;
+
+    spin_lock(&rcp->lock);
+    count = rcp->gp_count;
+    total = rcp->gp_total;
+    max = rcp->gp_max;
+    spin_unlock(&rcp->lock);
+
+    printk("RCU: batch %ld completed %ld, %lu grace periods, "
+           "avg %"PRI_stime"us max %"PRI_stime"us\n",
+           rcp->cur, rcp->completed, count,
+           count ? total / count / 1000 : 0, max / 1000);
+
+    for_each_online_cpu ( cpu )
+    {
+        struct rcu_data *rdp = &per_cpu(rcu_data, cpu);
+
+        printk("CPU%u: qlen %ld (max %ld) blimit %ld offload out %lu in %lu\n",
+               cpu, rdp->qlen, rdp->qlen_max, rdp->blimit,
+               rdp->offload_out, rdp->offload_in);
+    }
+}
+
+static struct keyhandler dump_rcu_keyhandler = {
+    .diagnostic = 1,
+    .u.fn = dump_rcu,
+    .desc = "dump RCU statistics"
+};
+
 void __init rcu_init(void)
 {
     void *cpu = (void *)(long)smp_processor_id();
     cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
     register_cpu_notifier(&cpu_nfb);
     open_softirq(RCU_SOFTIRQ, rcu_process_callbacks);
+    register_keyhandler('b', &dump_rcu_keyhandler);
 }
@@ -137,6 +137,20 @@
 static int __read_mostly sched_credit_tslice_ms = CSCHED_DEFAULT_TSLICE_MS;
 integer_param("sched_credit_tslice_ms", sched_credit_tslice_ms);
 
+/*
+ * Per-node summary of the work waiting on the runqueues of the node's
+ * pcpus, so that load balancing only visits peers which have something
+ * worth stealing.  A pcpu's bits describe the head of its runqueue and are
+ * only updated with its runqueue lock held.  Readers use them as a hint,
+ * and csched_runq_steal() checks again under the lock.  Priorities changed
+ * by csched_acct() are picked up by the next csched_runq_sort(), so a hint
+ * is at most one tick out of date.
+ */
+struct csched_node_work {
+    cpumask_t over;             /* Head of runq is at least TS_OVER */
+    cpumask_t under;            /* Head of runq is at least TS_UNDER */
+};
+
 /*
  * Physical CPU
  */
@@ -148,6 +162,10 @@ struct csched_pcpu {
     unsigned int idle_bias;
     /* Store this here to avoid having too many cpumask_var_t-s on stack */
     cpumask_var_t balance_mask;
+    /* Summary of waiting work for this pcpu's node */
+    struct csched_node_work *node_work;
+    /* Peers locked and searched by load balancing, and vcpus stolen */
+    unsigned long steal_attempts, steals;
 };
 
 /*
@@ -209,6 +227,7 @@ struct csched_private {
     unsigned int master;
     cpumask_var_t idlers;
     cpumask_var_t cpus;
+    struct csched_node_work *node_work;  /* Indexed by node */
     uint32_t weight;
     uint32_t credit;
     int credit_balance;
@@ -234,6 +253,31 @@ __runq_elem(struct list_head *elem)
     return list_entry(elem, struct csched_vcpu, runq_elem);
 }
 
+static inline void
+__note_work(unsigned int cpu, cpumask_t *mask, bool_t work)
+{
+    /* Avoid bouncing the cache line when nothing changes. */
+    if ( work )
+    {
+        if ( !cpumask_test_cpu(cpu, mask) )
+            cpumask_set_cpu(cpu, mask);
+    }
+    else if ( cpumask_test_cpu(cpu, mask) )
+        cpumask_clear_cpu(cpu, mask);
+}
+
+/* Update cpu's bits in its node's work summary.  Runqueue lock held. */
+static inline void
+__runq_note_work(unsigned int cpu)
+{
+    const struct csched_pcpu * const spc = CSCHED_PCPU(cpu);
+    int pri = list_empty(&spc->runq) ? CSCHED_PRI_IDLE
+                                     : __runq_elem(spc->runq.next)->pri;
+
+    __note_work(cpu, &spc->node_work->over, pri >= CSCHED_PRI_TS_OVER);
+    __note_work(cpu, &spc->node_work->under, pri >= CSCHED_PRI_TS_UNDER);
+}
+
 static inline void
 __runq_insert(unsigned int cpu, struct csched_vcpu *svc)
 {
@@ -263,6 +307,7 @@ __runq_insert(unsigned int cpu, struct csched_vcpu *svc)
     }
 
     list_add_tail(&svc->runq_elem, iter);
+    __runq_note_work(cpu);
 }
 
 static inline void
@@ -270,6 +315,7 @@ __runq_remove(struct csched_vcpu *svc)
 {
     BUG_ON( !__vcpu_on_runq(svc) );
     list_del_init(&svc->runq_elem);
+    __runq_note_work(svc->vcpu->processor);
 }
 
 
@@ -474,6 +520,8 @@ csched_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
     prv->ncpus--;
     cpumask_clear_cpu(cpu, prv->idlers);
     cpumask_clear_cpu(cpu, prv->cpus);
+    cpumask_clear_cpu(cpu, &spc->node_work->over);
+    cpumask_clear_cpu(cpu, &spc->node_work->under);
     if ( (prv->master == cpu) && (prv->ncpus > 0) )
     {
         prv->master = cpumask_first(prv->cpus);
@@ -495,6 +543,7 @@ csched_alloc_pdata(const struct scheduler *ops, int cpu)
     struct csched_pcpu *spc;
     struct csched_private *prv = CSCHED_PRIV(ops);
     unsigned long flags;
+    unsigned int node = cpu_to_node(cpu);
 
     /* Allocate per-PCPU info */
     spc = xzalloc(struct csched_pcpu);
@@ -527,6 +576,8 @@ csched_alloc_pdata(const struct scheduler *ops, int cpu)
     INIT_LIST_HEAD(&spc->runq);
     spc->runq_sort_last = prv->runq_sort;
     spc->idle_bias = nr_cpu_ids - 1;
+    /* The node may not be known yet for a cpu being brought up. */
+    spc->node_work = &prv->node_work[node < MAX_NUMNODES ? node : 0];
     if ( per_cpu(schedule_data, cpu).sched_priv == NULL )
         per_cpu(schedule_data, cpu).sched_priv = spc;
 
@@ -1187,6 +1238,8 @@ csched_runq_sort(struct csched_private *prv, unsigned int cpu)
         elem = next;
     }
 
+    __runq_note_work(cpu);
+
     pcpu_schedule_unlock_irqrestore(lock, flags, cpu);
 }
 
@@ -1494,11 +1547,13 @@ static struct csched_vcpu *
 csched_load_balance(struct csched_private *prv, int cpu,
     struct csched_vcpu *snext, bool_t *stolen)
 {
+    struct csched_pcpu * const spc = CSCHED_PCPU(cpu);
     struct csched_vcpu *speer;
+    struct csched_node_work *work;
     cpumask_t workers;
     cpumask_t *online;
     int peer_cpu, peer_node, bstep;
-    int node = cpu_to_node(cpu);
+    int node = spc->node_work - prv->node_work;
 
     BUG_ON( cpu != snext->vcpu->processor );
     online = cpupool_scheduler_cpumask(per_cpu(cpupool, cpu));
@@ -1516,8 +1571,9 @@ csched_load_balance(struct csched_private *prv, int cpu,
 
     /*
      * Let's look around for work to steal, taking both hard affinity
-     * and soft affinity into account. More specifically, we check all
-     * the non-idle CPUs' runq, looking for:
+     * and soft affinity into account. More specifically, we check the
+     * runq of all the non-idle CPUs which have work of a priority higher
+     * than snext's waiting, looking for:
      *  1. any "soft-affine work" to steal first,
      *  2. if not finding anything, any "hard-affine work" to steal.
      */
@@ -1533,9 +1589,12 @@ csched_load_balance(struct csched_private *prv, int cpu,
         peer_node = node;
         do
         {
-            /* Find out what the !idle are in this node */
-            cpumask_andnot(&workers, online, prv->idlers);
-            cpumask_and(&workers, &workers, &node_to_cpumask(peer_node));
+            /* Find out what the !idle with useful work are in this node */
+            work = &prv->node_work[peer_node];
+            cpumask_and(&workers, online,
+                        snext->pri == CSCHED_PRI_IDLE ? &work->over
+                                                      : &work->under);
+            cpumask_andnot(&workers, &workers, prv->idlers);
             cpumask_clear_cpu(cpu, &workers);
 
             peer_cpu = cpumask_first(&workers);
@@ -1560,6 +1619,7 @@ csched_load_balance(struct csched_private *prv, int cpu,
                 }
 
                 /* Any work over there to steal? */
+                spc->steal_attempts++;
                 speer = cpumask_test_cpu(peer_cpu, online) ?
                     csched_runq_steal(peer_cpu, cpu, snext->pri, bstep) : NULL;
                 pcpu_schedule_unlock(lock, peer_cpu);
@@ -1567,6 +1627,7 @@ csched_load_balance(struct csched_private *prv, int cpu,
                 /* As soon as one vcpu is found, balancing ends */
                 if ( speer != NULL )
                 {
+                    spc->steals++;
                     *stolen = 1;
                     return speer;
                 }
@@ -1762,7 +1823,8 @@ csched_dump_pcpu(const struct scheduler *ops, int cpu)
     cpumask_scnprintf(cpustr, sizeof(cpustr), per_cpu(cpu_sibling_mask, cpu));
     printk(" sort=%d, sibling=%s, ", spc->runq_sort_last, cpustr);
     cpumask_scnprintf(cpustr, sizeof(cpustr), per_cpu(cpu_core_mask, cpu));
-    printk("core=%s\n", cpustr);
+    printk("core=%s, steals=%lu/%lu\n", cpustr, spc->steals,
+           spc->steal_attempts);
 
     /* current VCPU */
     svc = CSCHED_VCPU(curr_on_cpu(cpu));
@@ -1855,10 +1917,13 @@ csched_init(struct scheduler *ops)
     prv = xzalloc(struct csched_private);
     if ( prv == NULL )
         return -ENOMEM;
-    if ( !zalloc_cpumask_var(&prv->cpus) ||
+    prv->node_work = xzalloc_array(struct csched_node_work, MAX_NUMNODES);
+    if ( prv->node_work == NULL ||
+         !zalloc_cpumask_var(&prv->cpus) ||
          !zalloc_cpumask_var(&prv->idlers) )
     {
         free_cpumask_var(prv->cpus);
+        xfree(prv->node_work);
         xfree(prv);
         return -ENOMEM;
     }
@@ -1903,6 +1968,7 @@ csched_deinit(const struct scheduler *ops)
     {
         free_cpumask_var(prv->cpus);
         free_cpumask_var(prv->idlers);
+        xfree(prv->node_work);
         xfree(prv);
     }
 }
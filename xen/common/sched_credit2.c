@@ -104,6 +104,17 @@
  *  must never grab private if a schedule lock is held.
  */
 
+/*
+ * Runqueue arrangement:
+ * - By default all the pcpus of a socket share one runqueue.  On big
+ *  sockets that runqueue's lock is taken by every wakeup and schedule
+ *  on the socket, so credit2_runqueue=core or credit2_runqueue=cpu give
+ *  smaller runqueues instead.
+ * - With smaller runqueues, balance_load() alone reacts too slowly to
+ *  short-running vcpus, so a pcpu about to go idle first tries to steal
+ *  a waiting vcpu from another runqueue (see steal_work()).
+ */
+
 /*
  * Basic constants
  */
@@ -194,6 +205,42 @@ integer_param("credit2_balance_under", opt_underload_balance_tolerance);
 int opt_overload_balance_tolerance=-3;
 integer_param("credit2_balance_over", opt_overload_balance_tolerance);
 
+/*
+ * Which pcpus share a runqueue.
+ */
+#define OPT_RUNQUEUE_CPU    0
+#define OPT_RUNQUEUE_CORE   1
+#define OPT_RUNQUEUE_SOCKET 2
+static const char *const opt_runqueue_str[] = {
+    [OPT_RUNQUEUE_CPU] = "cpu",
+    [OPT_RUNQUEUE_CORE] = "core",
+    [OPT_RUNQUEUE_SOCKET] = "socket"
+};
+static int __read_mostly opt_runqueue = OPT_RUNQUEUE_SOCKET;
+
+static void __init parse_credit2_runqueue(const char *s)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(opt_runqueue_str); i++ )
+    {
+        if ( !strcmp(s, opt_runqueue_str[i]) )
+        {
+            opt_runqueue = i;
+            return;
+        }
+    }
+
+    printk("WARNING, unrecognized value of credit2_runqueue option!\n");
+}
+custom_param("credit2_runqueue", parse_credit2_runqueue);
+
+/*
+ * Pull work from other runqueues when going idle.
+ */
+static bool_t __read_mostly opt_steal = 1;
+boolean_param("credit2_steal", opt_steal);
+
 /*
  * Per-runqueue data
  */
@@ -1590,6 +1637,94 @@ csched2_runtime(const struct scheduler *ops, int cpu, struct csched2_vcpu *snext
 
 void __dump_execstate(void *unused);
 
+/*
+ * Steal a vcpu waiting on another runqueue for cpu, which is about to go
+ * idle, and queue it on cpu's runqueue.  Returns whether anything was
+ * stolen.
+ *
+ * Other runqueues are first checked without their lock, and only ever
+ * trylocked, as cpu's runqueue lock is already held.  Runqueues on the
+ * same socket are tried first, to keep the vcpu's cache footprint close;
+ * a runqueue on another socket is only stolen from if it has more
+ * runnable vcpus than pcpus.  Starting the scan at cpu spreads concurrent
+ * stealers over different victims.
+ */
+static bool_t
+steal_work(const struct scheduler *ops, int cpu, s_time_t now)
+{
+    struct csched2_private *prv = CSCHED2_PRIV(ops);
+    struct csched2_runqueue_data *lrqd = RQD(ops, cpu);
+    unsigned int remote;
+    int rqi, first, peer;
+
+    first = cpumask_cycle(c2r(ops, cpu), &prv->active_queues);
+
+    for ( remote = 0; remote < 2; remote++ )
+    {
+        rqi = first;
+        do {
+            struct csched2_runqueue_data *orqd = prv->rqd + rqi;
+            struct csched2_vcpu *svc = NULL;
+            struct list_head *iter;
+
+            rqi = cpumask_cycle(rqi, &prv->active_queues);
+
+            /* Lockless checks; confirmed below with the lock held. */
+            if ( orqd == lrqd || list_empty(&orqd->runq) )
+                continue;
+
+            peer = cpumask_first(&orqd->active);
+            if ( peer >= nr_cpu_ids ||
+                 (cpu_to_socket(peer) != cpu_to_socket(cpu)) != remote )
+                continue;
+
+            if ( remote && orqd->load <= (int)cpumask_weight(&orqd->active) )
+                continue;
+
+            if ( !spin_trylock(&orqd->lock) )
+                continue;
+
+            /* The runqueue may have been deactivated in the meantime. */
+            if ( likely(orqd->id >= 0) )
+            {
+                list_for_each( iter, &orqd->runq )
+                {
+                    struct csched2_vcpu *osvc = __runq_elem(iter);
+
+                    if ( cpumask_test_cpu(cpu, osvc->vcpu->cpu_hard_affinity) )
+                    {
+                        svc = osvc;
+                        break;
+                    }
+                }
+            }
+
+            if ( svc )
+            {
+                d2printk("%pv %d-%d s\n", svc->vcpu, orqd->id, lrqd->id);
+                __runq_remove(svc);
+                update_load(ops, orqd, svc, -1, now);
+                __runq_deassign(svc);
+                /* Both runqueue locks are held, so processor can change. */
+                svc->vcpu->processor = cpu;
+                __runq_assign(svc, lrqd);
+                update_load(ops, lrqd, svc, 1, now);
+                runq_insert(ops, cpu, svc);
+            }
+
+            spin_unlock(&orqd->lock);
+
+            if ( svc )
+            {
+                SCHED_STAT_CRANK(csched2_steal);
+                return 1;
+            }
+        } while ( rqi != first );
+    }
+
+    return 0;
+}
+
 /*
  * Find a candidate.
  */
@@ -1642,7 +1777,7 @@ csched2_schedule(
     struct csched2_runqueue_data *rqd;
     struct csched2_vcpu * const scurr = CSCHED2_VCPU(current);
     struct csched2_vcpu *snext = NULL;
-    struct task_slice ret;
+    struct task_slice ret = { .migrated = 0 };
 
     SCHED_STAT_CRANK(schedule);
     CSCHED2_VCPU_CHECK(current);
@@ -1713,8 +1848,18 @@ csched2_schedule(
         snext = CSCHED2_VCPU(idle_vcpu[cpu]);
     }
     else
+    {
         snext=runq_candidate(rqd, scurr, cpu, now);
 
+        /* About to go idle: look for work on other runqueues first. */
+        if ( is_idle_vcpu(snext->vcpu) && opt_steal &&
+             steal_work(ops, cpu, now) )
+        {
+            snext = runq_candidate(rqd, scurr, cpu, now);
+            ret.migrated = !is_idle_vcpu(snext->vcpu);
+        }
+    }
+
     /* If switching from a non-idle runnable vcpu, put it
      * back on the runqueue. */
     if ( snext != scurr
@@ -1722,8 +1867,6 @@ csched2_schedule(
          && vcpu_runnable(current) )
         set_bit(__CSFLAG_delayed_runq_add, &scurr->flags);
 
-    ret.migrated = 0;
-
     /* Accounting for non-idle tasks */
     if ( !is_idle_vcpu(snext->vcpu) )
     {
@@ -1918,6 +2061,45 @@ static void deactivate_runqueue(struct csched2_private *prv, int rqi)
     cpumask_clear_cpu(rqi, &prv->active_queues);
 }
 
+static bool_t same_runqueue(unsigned int cpua, unsigned int cpub)
+{
+    switch ( opt_runqueue )
+    {
+    case OPT_RUNQUEUE_SOCKET:
+        return cpu_to_socket(cpua) == cpu_to_socket(cpub);
+    case OPT_RUNQUEUE_CORE:
+        return cpu_to_socket(cpua) == cpu_to_socket(cpub) &&
+               cpu_to_core(cpua) == cpu_to_core(cpub);
+    }
+
+    return 0;
+}
+
+/*
+ * Find the runqueue cpu belongs to, comparing it against the first cpu of
+ * each active runqueue; if none matches, use the first inactive one.
+ * Called with prv->lock held.
+ */
+static int cpu_to_runqueue(struct csched2_private *prv, unsigned int cpu)
+{
+    int rqi, free_rqi = -1;
+
+    for ( rqi = 0; rqi < nr_cpu_ids; rqi++ )
+    {
+        if ( !cpumask_test_cpu(rqi, &prv->active_queues) )
+        {
+            if ( free_rqi < 0 )
+                free_rqi = rqi;
+            continue;
+        }
+
+        if ( same_runqueue(cpumask_first(&prv->rqd[rqi].active), cpu) )
+            return rqi;
+    }
+
+    return free_rqi;
+}
+
 static void init_pcpu(const struct scheduler *ops, int cpu)
 {
     int rqi;
@@ -1935,20 +2117,18 @@ static void init_pcpu(const struct scheduler *ops, int cpu)
         return;
     }
 
-    /* Figure out which runqueue to put it in */
-    rqi = 0;
-
-    /* Figure out which runqueue to put it in */
-    /* NB: cpu 0 doesn't get a STARTING callback, so we hard-code it to runqueue 0. */
-    if ( cpu == 0 )
-        rqi = 0;
-    else
-        rqi = cpu_to_socket(cpu);
+    /*
+     * Figure out which runqueue to put it in.
+     * NB: cpu 0 doesn't get a STARTING callback, and its topology is not
+     * known yet when it is added at boot.  It is the first cpu though, so
+     * it gets a runqueue of its own, and the cpus brought up later are
+     * compared against it once its topology has been filled in.
+     */
+    rqi = cpu_to_runqueue(prv, cpu);
 
     if ( rqi < 0 )
     {
-        printk("%s: cpu_to_socket(%d) returned %d!\n",
-               __func__, cpu, rqi);
+        printk("%s: no runqueue left for cpu %d!\n", __func__, cpu);
         BUG();
     }
 
@@ -2101,6 +2281,8 @@ csched2_init(struct scheduler *ops)
     printk(" load_window_shift: %d\n", opt_load_window_shift);
     printk(" underload_balance_tolerance: %d\n", opt_underload_balance_tolerance);
     printk(" overload_balance_tolerance: %d\n", opt_overload_balance_tolerance);
+    printk(" runqueues: per %s\n", opt_runqueue_str[opt_runqueue]);
+    printk(" work stealing: %s\n", opt_steal ? "enabled" : "disabled");
 
     if ( opt_load_window_shift < LOADAVG_WINDOW_SHIFT_MIN )
     {
@@ -87,24 +87,119 @@ void spin_debug_disable(void)
 
 #ifdef LOCK_PROFILE
 
+/*
+ * Profiling can be limited to a time window and to a sample of the lock
+ * acquisitions, to bound its overhead on a production system.
+ */
+static bool_t __read_mostly lock_profile_enabled = 1;
+static unsigned int __read_mostly lock_profile_sample_shift;
+static s_time_t __read_mostly lock_profile_until;
+
+struct lock_profile_cpu {
+    unsigned int seq;        /* # of acquisitions, for sampling */
+    u64          block_cnt;  /* # of waits for any lock */
+    s64          time_block; /* cumulated wait time for any lock */
+};
+
+static DEFINE_PER_CPU(struct lock_profile_cpu, lock_profile_cpu);
+
+static unsigned int lock_profile_bucket(s_time_t t)
+{
+    if ( t < 256 )
+        return 0;
+    if ( t >= (1 << (LOCKPROF_HIST_N + 6)) )
+        return LOCKPROF_HIST_N - 1;
+    return fls(t >> 7) - 1;
+}
+
+/* Returns the current time if this acquisition is to be profiled, else 0. */
+static s_time_t lock_profile_sample(void)
+{
+    s_time_t now;
+
+    if ( !lock_profile_enabled ||
+         (this_cpu(lock_profile_cpu).seq++ &
+          ((1u << lock_profile_sample_shift) - 1)) )
+        return 0;
+
+    now = NOW();
+    if ( lock_profile_until && now > lock_profile_until )
+    {
+        lock_profile_enabled = 0;
+        return 0;
+    }
+
+    return now;
+}
+
+/*
+ * Keep the call sites which waited longest for the lock.  A new site takes
+ * over the counts of the entry it replaces ("space saving"), so that sites
+ * often waiting do not get evicted by occasional ones.
+ */
+static void lock_profile_site(struct lock_profile *prof, void *addr,
+                              s_time_t block)
+{
+    struct lock_profile_site *site, *min = &prof->sites[0];
+
+    for ( site = prof->sites; site < prof->sites + LOCKPROF_SITES_N; site++ )
+    {
+        if ( site->addr == addr )
+        {
+            min = site;
+            break;
+        }
+        if ( site->time_block < min->time_block )
+            min = site;
+    }
+
+    min->addr = addr;
+    min->block_cnt++;
+    min->time_block += block;
+}
+
+static void lock_profile_got(struct lock_profile *prof, s_time_t block,
+                             void *addr)
+{
+    struct lock_profile_cpu *pcpu;
+    s_time_t now = lock_profile_sample();
+
+    prof->time_locked = now;
+    if ( !now || !block )
+        return;
+
+    block = now - block;
+    prof->time_block += block;
+    prof->block_cnt++;
+    prof->block_hist[lock_profile_bucket(block)]++;
+    lock_profile_site(prof, addr, block);
+
+    pcpu = &this_cpu(lock_profile_cpu);
+    pcpu->block_cnt++;
+    pcpu->time_block += block;
+}
+
+static void lock_profile_rel(struct lock_profile *prof)
+{
+    s_time_t hold;
+
+    if ( !prof->time_locked )
+        return;
+
+    hold = NOW() - prof->time_locked;
+    prof->time_hold += hold;
+    prof->lock_cnt++;
+    prof->hold_hist[lock_profile_bucket(hold)]++;
+}
+
 #define LOCK_PROFILE_REL                                                     \
     if (lock->profile)                                                       \
-    {                                                                        \
-        lock->profile->time_hold += NOW() - lock->profile->time_locked;      \
-        lock->profile->lock_cnt++;                                           \
-    }
+        lock_profile_rel(lock->profile);
 #define LOCK_PROFILE_VAR    s_time_t block = 0
 #define LOCK_PROFILE_BLOCK  block = block ? : NOW();
 #define LOCK_PROFILE_GOT                                                     \
     if (lock->profile)                                                       \
-    {                                                                        \
-        lock->profile->time_locked = NOW();                                  \
-        if (block)                                                           \
-        {                                                                    \
-            lock->profile->time_block += lock->profile->time_locked - block; \
-            lock->profile->block_cnt++;                                      \
-        }                                                                    \
-    }
+        lock_profile_got(lock->profile, block, __builtin_return_address(0));
 
 #else
 
@@ -205,7 +300,7 @@ int _spin_trylock(spinlock_t *lock)
         return 0;
 #ifdef LOCK_PROFILE
     if (lock->profile)
-        lock->profile->time_locked = NOW();
+        lock->profile->time_locked = lock_profile_sample();
 #endif
     preempt_disable();
     return 1;
@@ -219,7 +314,7 @@ void _spin_barrier(spinlock_t *lock)
 
     check_barrier(&lock->debug);
     do { smp_mb(); loop++;} while ( _raw_spin_is_locked(&lock->raw) );
-    if ((loop > 1) && lock->profile)
+    if ((loop > 1) && lock->profile && lock_profile_enabled)
     {
         lock->profile->time_block += NOW() - block;
         lock->profile->block_cnt++;
@@ -479,6 +574,7 @@ extern struct lock_profile *__lock_profile_start;
 extern struct lock_profile *__lock_profile_end;
 
 static s_time_t lock_profile_start;
+static s_time_t lock_profile_stopped = STIME_MAX;
 static struct lock_profile_anc lock_profile_ancs[LOCKPROF_TYPE_N];
 static struct lock_profile_qhead lock_profile_glb_q;
 static spinlock_t lock_profile_lock = SPIN_LOCK_UNLOCKED;
@@ -500,6 +596,8 @@ static void spinlock_profile_iterate(lock_profile_subfunc *sub, void *par)
 static void spinlock_profile_print_elem(struct lock_profile *data,
     int32_t type, int32_t idx, void *par)
 {
+    unsigned int i;
+
     if ( type == LOCKPROF_TYPE_GLOBAL )
         printk("%s %s:\n", lock_profile_ancs[type].name, data->name);
     else
@@ -508,6 +606,20 @@ static void spinlock_profile_print_elem(struct lock_profile *data,
            data->lock_cnt, (u32)(data->time_hold >> 32), (u32)data->time_hold,
            data->block_cnt, (u32)(data->time_block >> 32),
            (u32)data->time_block);
+    for ( i = 0; i < LOCKPROF_SITES_N && data->sites[i].addr; i++ )
+        printk("    waiter %ps: %"PRId64" waits, %"PRId64"ns\n",
+               data->sites[i].addr, data->sites[i].block_cnt,
+               data->sites[i].time_block);
+}
+
+static s_time_t lock_profile_elapsed(void)
+{
+    s_time_t end = min(NOW(), lock_profile_stopped);
+
+    if ( lock_profile_until && end > lock_profile_until )
+        end = lock_profile_until;
+
+    return end - lock_profile_start;
 }
 
 void spinlock_profile_printall(unsigned char key)
@@ -515,7 +627,7 @@ void spinlock_profile_printall(unsigned char key)
     s_time_t now = NOW();
     s_time_t diff;
 
-    diff = now - lock_profile_start;
+    diff = lock_profile_elapsed();
     printk("Xen lock profile info SHOW  (now = %08X:%08X, "
         "total = %08X:%08X)\n", (u32)(now>>32), (u32)now,
         (u32)(diff>>32), (u32)diff);
@@ -529,17 +641,26 @@ static void spinlock_profile_reset_elem(struct lock_profile *data,
     data->block_cnt = 0;
     data->time_hold = 0;
     data->time_block = 0;
+    memset(data->block_hist, 0, sizeof(data->block_hist));
+    memset(data->hold_hist, 0, sizeof(data->hold_hist));
+    memset(data->sites, 0, sizeof(data->sites));
 }
 
 void spinlock_profile_reset(unsigned char key)
 {
     s_time_t now = NOW();
+    unsigned int cpu;
 
     if ( key != '\0' )
         printk("Xen lock profile info RESET (now = %08X:%08X)\n",
             (u32)(now>>32), (u32)now);
     lock_profile_start = now;
     spinlock_profile_iterate(spinlock_profile_reset_elem, NULL);
+    for_each_online_cpu ( cpu )
+    {
+        per_cpu(lock_profile_cpu, cpu).block_cnt = 0;
+        per_cpu(lock_profile_cpu, cpu).time_block = 0;
+    }
 }
 
 typedef struct {
@@ -552,6 +673,7 @@ static void spinlock_profile_ucopy_elem(struct lock_profile *data,
 {
     spinlock_profile_ucopy_t *p = par;
     xen_sysctl_lockprof_data_t elem;
+    unsigned int i;
 
     if ( p->rc )
         return;
@@ -565,6 +687,17 @@ static void spinlock_profile_ucopy_elem(struct lock_profile *data,
         elem.block_cnt = data->block_cnt;
         elem.lock_time = data->time_hold;
         elem.block_time = data->time_block;
+        for ( i = 0; i < LOCKPROF_HIST_N; i++ )
+        {
+            elem.block_hist[i] = data->block_hist[i];
+            elem.hold_hist[i] = data->hold_hist[i];
+        }
+        for ( i = 0; i < LOCKPROF_SITES_N; i++ )
+        {
+            elem.sites[i].addr = (unsigned long)data->sites[i].addr;
+            elem.sites[i].block_cnt = data->sites[i].block_cnt;
+            elem.sites[i].block_time = data->sites[i].time_block;
+        }
         if ( copy_to_guest_offset(p->pc->data, p->pc->nr_elem, &elem, 1) )
             p->rc = -EFAULT;
     }
@@ -573,6 +706,28 @@ static void spinlock_profile_ucopy_elem(struct lock_profile *data,
         p->pc->nr_elem++;
 }
 
+static int spinlock_profile_ucopy_cpu(xen_sysctl_lockprof_op_t *pc)
+{
+    xen_sysctl_lockprof_cpu_t elem;
+    unsigned int cpu;
+
+    for ( cpu = 0; cpu < nr_cpu_ids && cpu < pc->max_elem; cpu++ )
+    {
+        if ( cpu_online(cpu) )
+        {
+            elem.block_cnt = per_cpu(lock_profile_cpu, cpu).block_cnt;
+            elem.block_time = per_cpu(lock_profile_cpu, cpu).time_block;
+        }
+        else
+            elem.block_cnt = elem.block_time = 0;
+        if ( copy_to_guest_offset(pc->cpu_data, cpu, &elem, 1) )
+            return -EFAULT;
+    }
+    pc->nr_elem = nr_cpu_ids;
+
+    return 0;
+}
+
 /* Dom0 control of lock profiling */
 int spinlock_profile_control(xen_sysctl_lockprof_op_t *pc)
 {
@@ -589,9 +744,35 @@ int spinlock_profile_control(xen_sysctl_lockprof_op_t *pc)
         par.rc = 0;
         par.pc = pc;
         spinlock_profile_iterate(spinlock_profile_ucopy_elem, &par);
-        pc->time = NOW() - lock_profile_start;
+        pc->time = lock_profile_elapsed();
+        pc->sample_shift = lock_profile_sample_shift;
         rc = par.rc;
         break;
+    case XEN_SYSCTL_LOCKPROF_query_cpu:
+        rc = spinlock_profile_ucopy_cpu(pc);
+        pc->time = lock_profile_elapsed();
+        pc->sample_shift = lock_profile_sample_shift;
+        break;
+    case XEN_SYSCTL_LOCKPROF_start:
+        if ( pc->sample_shift >= 32 )
+        {
+            rc = -EINVAL;
+            break;
+        }
+        lock_profile_enabled = 0;
+        spinlock_profile_reset('\0');
+        lock_profile_sample_shift = pc->sample_shift;
+        lock_profile_until = pc->window_ms ?
+                             lock_profile_start + MILLISECS(pc->window_ms) : 0;
+        lock_profile_stopped = STIME_MAX;
+        smp_wmb();
+        lock_profile_enabled = 1;
+        break;
+    case XEN_SYSCTL_LOCKPROF_stop:
+        if ( lock_profile_enabled )
+            lock_profile_stopped = NOW();
+        lock_profile_enabled = 0;
+        break;
     default:
         rc = -EINVAL;
         break;
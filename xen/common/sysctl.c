@@ -263,7 +263,9 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
         pi->total_pages = total_pages;
         /* Protected by lock */
         get_outstanding_claims(&pi->free_pages, &pi->outstanding_pages);
-        pi->scrub_pages = 0;
+        /* Free pages still to be scrubbed are reported separately. */
+        pi->scrub_pages = min_t(uint64_t, total_scrub_pages(), pi->free_pages);
+        pi->free_pages -= pi->scrub_pages;
         pi->cpu_khz = cpu_khz;
         arch_do_physinfo(pi);
 
@@ -29,12 +29,31 @@
 static unsigned int timer_slop __read_mostly = 50000; /* 50 us */
 integer_param("timer_slop", timer_slop);
 
+/*
+ * Timers expiring within WHEEL_SLOTS << WHEEL_SHIFT ns (about 67ms) of the
+ * wheel's base go on the timer wheel, where insertion and removal are O(1).
+ * Later timers go on the heap, and move onto the wheel as it advances.
+ */
+#define WHEEL_SHIFT 17                  /* 131us per slot */
+#define WHEEL_SLOTS 512
+#define WHEEL_MASK  (WHEEL_SLOTS - 1)
+
 struct timers {
     spinlock_t     lock;
     struct timer **heap;
     struct timer  *list;
     struct timer  *running;
     struct list_head inactive;
+    /*
+     * Slot i holds the timers expiring in slot number n (expiry time
+     * >> WHEEL_SHIFT) with n & WHEEL_MASK == i, for n between wheel_base
+     * and wheel_base + WHEEL_SLOTS.  Timers already due when added go in
+     * the base slot.
+     */
+    struct list_head *wheel;
+    s_time_t       wheel_base;
+    unsigned int   wheel_count;
+    DECLARE_BITMAP(wheel_map, WHEEL_SLOTS);
 } __cacheline_aligned;
 
 static DEFINE_PER_CPU(struct timers, timers);
@@ -167,6 +186,81 @@ static int add_to_list(struct timer **pprev, struct timer *t)
 }
 
 
+/****************************************************************************
+ * TIMER WHEEL OPERATIONS.
+ */
+
+static void add_to_wheel(struct timers *ts, struct timer *t)
+{
+    s_time_t slot = t->expires >> WHEEL_SHIFT;
+    unsigned int i = max(slot, ts->wheel_base) & WHEEL_MASK;
+
+    t->wheel_slot = i;
+    list_add_tail(&t->wheel, &ts->wheel[i]);
+    __set_bit(i, ts->wheel_map);
+    ts->wheel_count++;
+}
+
+static void remove_from_wheel(struct timers *ts, struct timer *t)
+{
+    list_del(&t->wheel);
+    if ( list_empty(&ts->wheel[t->wheel_slot]) )
+        __clear_bit(t->wheel_slot, ts->wheel_map);
+    ts->wheel_count--;
+}
+
+/*
+ * Slot number of the first occupied slot at or after the wheel's base, or
+ * wheel_base + WHEEL_SLOTS if the wheel is empty.
+ */
+static s_time_t next_wheel_slot(struct timers *ts)
+{
+    unsigned int base = ts->wheel_base & WHEEL_MASK, i;
+
+    i = find_next_bit(ts->wheel_map, WHEEL_SLOTS, base);
+    if ( i < WHEEL_SLOTS )
+        return ts->wheel_base + (i - base);
+
+    i = find_first_bit(ts->wheel_map, base);
+    if ( i < base )
+        return ts->wheel_base + (i + WHEEL_SLOTS - base);
+
+    return ts->wheel_base + WHEEL_SLOTS;
+}
+
+/* Earliest expiry on the wheel: the minimum of its first occupied slot. */
+static s_time_t wheel_deadline(struct timers *ts)
+{
+    struct timer *t;
+    s_time_t deadline = STIME_MAX;
+
+    if ( ts->wheel_count == 0 )
+        return deadline;
+
+    list_for_each_entry ( t, &ts->wheel[next_wheel_slot(ts) & WHEEL_MASK],
+                          wheel )
+        if ( t->expires < deadline )
+            deadline = t->expires;
+
+    return deadline;
+}
+
+/*
+ * Does @expires fall within the wheel's horizon?  An empty wheel is first
+ * moved to the current time, so that it covers the near future.
+ */
+static bool_t wheel_covers(struct timers *ts, s_time_t expires)
+{
+    if ( ts->wheel == NULL )
+        return 0;
+
+    if ( ts->wheel_count == 0 )
+        ts->wheel_base = NOW() >> WHEEL_SHIFT;
+
+    return (expires >> WHEEL_SHIFT) < ts->wheel_base + WHEEL_SLOTS;
+}
+
+
 /****************************************************************************
  * TIMER OPERATIONS.
  */
@@ -184,6 +278,11 @@ static int remove_entry(struct timer *t)
     case TIMER_STATUS_in_list:
         rc = remove_from_list(&timers->list, t);
         break;
+    case TIMER_STATUS_in_wheel:
+        remove_from_wheel(timers, t);
+        /* Reprogram only if this may have been the earliest timer. */
+        rc = (t->expires == per_cpu(timer_deadline, t->cpu));
+        break;
     default:
         rc = 0;
         BUG();
@@ -200,6 +299,16 @@ static int add_entry(struct timer *t)
 
     ASSERT(t->status == TIMER_STATUS_invalid);
 
+    /* Near-term timers go on the wheel. */
+    if ( wheel_covers(timers, t->expires) )
+    {
+        s_time_t deadline = per_cpu(timer_deadline, t->cpu);
+
+        t->status = TIMER_STATUS_in_wheel;
+        add_to_wheel(timers, t);
+        return (deadline == 0) || (t->expires < deadline);
+    }
+
     /* Try to add to heap. t->heap_offset indicates whether we succeed. */
     t->heap_offset = 0;
     t->status = TIMER_STATUS_in_heap;
@@ -277,7 +386,7 @@ static inline void timer_unlock(struct timer *timer)
 static bool_t active_timer(struct timer *timer)
 {
     ASSERT(timer->status >= TIMER_STATUS_inactive);
-    ASSERT(timer->status <= TIMER_STATUS_in_list);
+    ASSERT(timer->status <= TIMER_STATUS_in_wheel);
     return (timer->status >= TIMER_STATUS_in_heap);
 }
 
@@ -428,6 +537,58 @@ static void execute_timer(struct timers *ts, struct timer *t)
 }
 
 
+/* Execute ready wheel timers, and advance the wheel towards @now. */
+static void run_wheel(struct timers *ts, s_time_t now)
+{
+    s_time_t slot = now >> WHEEL_SHIFT;
+    struct list_head *head;
+    struct timer *t;
+
+    if ( ts->wheel == NULL )
+        return;
+
+    for ( ; ; )
+    {
+        /* The lock is dropped while a timer runs: rescan after each one. */
+        head = &ts->wheel[ts->wheel_base & WHEEL_MASK];
+    again:
+        list_for_each_entry ( t, head, wheel )
+        {
+            if ( t->expires < now )
+            {
+                remove_from_wheel(ts, t);
+                execute_timer(ts, t);
+                goto again;
+            }
+        }
+
+        if ( ts->wheel_base >= slot )
+            break;
+
+        /* Slots before the current one only hold ready timers. */
+        ts->wheel_base = (ts->wheel_count == 0) ? slot :
+                         min(next_wheel_slot(ts), slot);
+    }
+}
+
+/* Move timers which are now within the wheel's horizon off the heap. */
+static void refill_wheel(struct timers *ts)
+{
+    struct timer **heap = ts->heap, *t;
+
+    if ( ts->wheel == NULL )
+        return;
+
+    while ( (GET_HEAP_SIZE(heap) != 0) &&
+            ((t = heap[1])->expires >> WHEEL_SHIFT) <
+            ts->wheel_base + WHEEL_SLOTS )
+    {
+        remove_from_heap(heap, t);
+        t->status = TIMER_STATUS_in_wheel;
+        add_to_wheel(ts, t);
+    }
+}
+
 static void timer_softirq_action(void)
 {
     struct timer  *t, **heap, *next;
@@ -476,6 +637,9 @@ static void timer_softirq_action(void)
         execute_timer(ts, t);
     }
 
+    /* Execute ready wheel timers. */
+    run_wheel(ts, now);
+
     /* Try to move timers from linked list to more efficient heap. */
     next = ts->list;
     ts->list = NULL;
@@ -486,9 +650,14 @@ static void timer_softirq_action(void)
         add_entry(t);
     }
 
-    /* Find earliest deadline from head of linked list and top of heap. */
-    deadline = STIME_MAX;
-    if ( GET_HEAP_SIZE(heap) != 0 )
+    refill_wheel(ts);
+
+    /*
+     * Find earliest deadline from head of linked list, top of heap and
+     * first occupied wheel slot.
+     */
+    deadline = wheel_deadline(ts);
+    if ( (GET_HEAP_SIZE(heap) != 0) && (heap[1]->expires < deadline) )
         deadline = heap[1]->expires;
     if ( (ts->list != NULL) && (ts->list->expires < deadline) )
         deadline = ts->list->expires;
@@ -536,6 +705,10 @@ static void dump_timerq(unsigned char key)
             dump_timer(ts->heap[j], now);
         for ( t = ts->list, j = 0; t != NULL; t = t->list_next, j++ )
             dump_timer(t, now);
+        if ( ts->wheel != NULL )
+            for ( j = 0; j < WHEEL_SLOTS; j++ )
+                list_for_each_entry ( t, &ts->wheel[j], wheel )
+                    dump_timer(t, now);
         spin_unlock_irqrestore(&ts->lock, flags);
     }
 }
@@ -569,6 +742,15 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
         spin_lock(&old_ts->lock);
     }
 
+    while ( old_ts->wheel_count != 0 )
+    {
+        t = list_entry(old_ts->wheel[next_wheel_slot(old_ts) & WHEEL_MASK].next,
+                       struct timer, wheel);
+        remove_entry(t);
+        write_atomic(&t->cpu, new_cpu);
+        notify |= add_entry(t);
+    }
+
     while ( (t = GET_HEAP_SIZE(old_ts->heap)
              ? old_ts->heap[1] : old_ts->list) != NULL )
     {
@@ -599,6 +781,7 @@ static int cpu_callback(
 {
     unsigned int cpu = (unsigned long)hcpu;
     struct timers *ts = &per_cpu(timers, cpu);
+    unsigned int i;
 
     switch ( action )
     {
@@ -606,10 +789,20 @@ static int cpu_callback(
         INIT_LIST_HEAD(&ts->inactive);
         spin_lock_init(&ts->lock);
         ts->heap = &dummy_heap;
+        if ( ts->wheel == NULL )
+        {
+            ts->wheel = xmalloc_array(struct list_head, WHEEL_SLOTS);
+            if ( ts->wheel == NULL )
+                return notifier_from_errno(-ENOMEM);
+            for ( i = 0; i < WHEEL_SLOTS; i++ )
+                INIT_LIST_HEAD(&ts->wheel[i]);
+        }
         break;
     case CPU_UP_CANCELED:
     case CPU_DEAD:
         migrate_timers_from_cpu(cpu);
+        xfree(ts->wheel);
+        ts->wheel = NULL;
         break;
     default:
         break;
@@ -816,6 +816,7 @@ int guest_iommu_set_base(struct domain *d, uint64_t base)
         return -EACCES;
 
     iommu->mmio_base = base;
+    hvm_mmio_update_ranges(d);
     base >>= PAGE_SHIFT;
 
     for ( int i = 0; i < IOMMU_MMIO_PAGE_NR; i++ )
@@ -919,8 +920,17 @@ static int guest_iommu_mmio_range(struct vcpu *v, unsigned long addr)
            addr < iommu->mmio_base + IOMMU_MMIO_SIZE;
 }
 
+static void guest_iommu_mmio_ranges(struct domain *d, struct hvm_mmio_table *t)
+{
+    struct guest_iommu *iommu = domain_iommu(d);
+
+    if ( iommu && iommu->mmio_base != ~0ULL )
+        hvm_mmio_add_range(t, iommu->mmio_base, IOMMU_MMIO_SIZE);
+}
+
 const struct hvm_mmio_handler iommu_mmio_handler = {
     .check_handler = guest_iommu_mmio_range,
     .read_handler = guest_iommu_mmio_read,
-    .write_handler = guest_iommu_mmio_write
+    .write_handler = guest_iommu_mmio_write,
+    .ranges = guest_iommu_mmio_ranges
 };
@@ -48,7 +48,7 @@ struct hvm_ioreq_vcpu {
     evtchn_port_t    ioreq_evtchn;
 };
 
-#define NR_IO_RANGE_TYPES (HVMOP_IO_RANGE_PCI + 1)
+#define NR_IO_RANGE_TYPES (HVMOP_IO_RANGE_POSTED + 1)
 #define MAX_NR_IO_RANGES  256
 
 struct hvm_ioreq_server {
@@ -94,6 +94,13 @@ struct hvm_domain {
 
     struct hvm_io_handler *io_handler;
 
+    /*
+     * MMIO dispatch table, RCU-protected and replaced as a whole under
+     * mmio_table_lock.  NULL if every mmio handler needs probing.
+     */
+    struct hvm_mmio_table *mmio_table;
+    spinlock_t             mmio_table_lock;
+
     /* Lock protects access to irq, vpic and vioapic. */
     spinlock_t             irq_lock;
     struct hvm_irq         irq;
@@ -20,6 +20,7 @@
 #ifndef __ASM_X86_HVM_IO_H__
 #define __ASM_X86_HVM_IO_H__
 
+#include <xen/rcupdate.h>
 #include <asm/hvm/vpic.h>
 #include <asm/hvm/vioapic.h>
 #include <public/hvm/ioreq.h>
@@ -40,6 +41,9 @@ typedef int (*hvm_mmio_write_t)(struct vcpu *v,
                                 unsigned long val);
 typedef int (*hvm_mmio_check_t)(struct vcpu *v, unsigned long addr);
 
+struct hvm_mmio_table;
+typedef void (*hvm_mmio_ranges_t)(struct domain *d, struct hvm_mmio_table *t);
+
 typedef int (*portio_action_t)(
     int dir, uint32_t port, uint32_t bytes, uint32_t *val);
 typedef int (*mmio_action_t)(ioreq_t *);
@@ -63,6 +67,12 @@ struct hvm_mmio_handler {
     hvm_mmio_check_t check_handler;
     hvm_mmio_read_t read_handler;
     hvm_mmio_write_t write_handler;
+    /*
+     * Report, through hvm_mmio_add_range(), every range of guest physical
+     * addresses for which check_handler may return true.  Whenever one of
+     * them changes hvm_mmio_update_ranges() must be called.
+     */
+    hvm_mmio_ranges_t ranges;
 };
 
 extern const struct hvm_mmio_handler hpet_mmio_handler;
@@ -73,6 +83,27 @@ extern const struct hvm_mmio_handler iommu_mmio_handler;
 
 #define HVM_MMIO_HANDLER_NR 5
 
+/* Guest physical ranges claimed by the handlers above, sorted by address. */
+#define HVM_MMIO_MAX_RANGES 32
+
+struct hvm_mmio_range {
+    unsigned long start, end;   /* inclusive */
+    unsigned int handler;       /* index into hvm_mmio_handlers[] */
+};
+
+struct hvm_mmio_table {
+    struct rcu_head rcu;
+    unsigned int nr_ranges;
+    unsigned int handler;       /* handler reporting ranges during a build */
+    bool_t overflow;
+    struct hvm_mmio_range range[HVM_MMIO_MAX_RANGES];
+};
+
+void hvm_mmio_add_range(
+    struct hvm_mmio_table *t, unsigned long start, unsigned long size);
+void hvm_mmio_update_ranges(struct domain *d);
+void hvm_mmio_destroy_ranges(struct domain *d);
+
 int hvm_io_intercept(ioreq_t *p, int type);
 void register_io_handler(
     struct domain *d, unsigned long addr, unsigned long size,
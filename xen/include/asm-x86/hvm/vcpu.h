@@ -77,6 +77,9 @@ struct hvm_vcpu_io {
     bool_t mmio_retry, mmio_retrying;
 
     unsigned long msix_unmask_address;
+
+    /* Accesses completed by each of the internal mmio handlers. */
+    unsigned long mmio_exits[HVM_MMIO_HANDLER_NR];
 };
 
 #define VMCX_EADDR    (~0ULL)
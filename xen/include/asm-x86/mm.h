@@ -81,9 +81,27 @@ struct page_info
         } sh;
 
         /* Page is on a free list: ((count_info & PGC_count_mask) == 0). */
-        struct {
-            /* Do TLBs need flushing for safety before next page use? */
-            bool_t need_tlbflush;
+        union {
+            struct {
+                /*
+                 * Index of the first *possibly* unscrubbed page in the
+                 * buddy (only valid for the head page).  One more bit
+                 * than the maximum order, to fit INVALID_DIRTY_IDX.
+                 */
+#define INVALID_DIRTY_IDX ((1UL << (MAX_ORDER + 1)) - 1)
+                unsigned long first_dirty:MAX_ORDER + 1;
+
+                /* Is the buddy being scrubbed by an idle CPU? */
+#define BUDDY_NOT_SCRUBBING    0
+#define BUDDY_SCRUBBING        1
+#define BUDDY_SCRUB_ABORT      2
+                unsigned long scrub_state:2;
+
+                /* Do TLBs need flushing for safety before next page use? */
+                unsigned long need_tlbflush:1;
+            };
+            /* For updating the fields above as a whole. */
+            unsigned long val;
         } free;
 
     } u;
@@ -216,6 +234,9 @@ struct page_info
  /* Page is broken? */
 #define _PGC_broken       PG_shift(7)
 #define PGC_broken        PG_mask(1, 7)
+ /* Free page needs scrubbing? (Free pages are never PGC_allocated.) */
+#define _PGC_need_scrub   _PGC_allocated
+#define PGC_need_scrub    PGC_allocated
  /* Mutually-exclusive page states: { inuse, offlining, offlined, free }. */
 #define PGC_state         PG_mask(3, 9)
 #define PGC_state_inuse   PG_mask(0, 9)
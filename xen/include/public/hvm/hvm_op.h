@@ -314,6 +314,20 @@ DEFINE_XEN_GUEST_HANDLE(xen_hvm_get_ioreq_server_info_t);
  *
  * NOTE: unless an emulation request falls entirely within a range mapped
  * by a secondary emulator, it will not be passed to that emulator.
+ *
+ * Posted-write memory ranges are memory ranges for which the emulator does
+ * not need to complete writes synchronously, such as doorbell registers.
+ * Reads from such a range are sent to the emulator as for any other memory
+ * range, but single writes are placed in the buffered ioreq ring and the
+ * vCPU resumes immediately. The ring is always drained before a synchronous
+ * request is handled, so a later read still observes earlier writes.
+ * Registering a posted-write range requires the server to have been created
+ * with a buffered ioreq ring, and commits the emulator to two extensions of
+ * the buffered ring protocol (see struct buf_ioreq in ioreq.h):
+ *  - posted writes above 1MB are encoded in an extra slot, and
+ *  - the event channel is only kicked when a write finds the ring empty,
+ *    so the emulator must re-check write_pointer after a full barrier
+ *    following its final update of read_pointer.
  */
 #define HVMOP_map_io_range_to_ioreq_server 19
 #define HVMOP_unmap_io_range_from_ioreq_server 20
@@ -324,6 +338,7 @@ struct xen_hvm_io_range {
 # define HVMOP_IO_RANGE_PORT   0 /* I/O port range */
 # define HVMOP_IO_RANGE_MEMORY 1 /* MMIO range */
 # define HVMOP_IO_RANGE_PCI    2 /* PCI segment/bus/dev/func range */
+# define HVMOP_IO_RANGE_POSTED 3 /* Posted-write MMIO range */
     uint64_aligned_t start, end; /* IN - inclusive start and end of range */
 };
 typedef struct xen_hvm_io_range xen_hvm_io_range_t;
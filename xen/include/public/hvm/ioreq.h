@@ -71,9 +71,15 @@ struct shared_iopage {
 };
 typedef struct shared_iopage shared_iopage_t;
 
+/*
+ * A buffered request whose 'pad' bit is set is a posted write (see
+ * HVMOP_IO_RANGE_POSTED in hvm_op.h): it is followed by one more slot,
+ * after the high data slot if size is 8, whose 'data' holds bits 20-51
+ * of the physical address.
+ */
 struct buf_ioreq {
     uint8_t  type;   /* I/O type                    */
-    uint8_t  pad:1;
+    uint8_t  pad:1;  /* posted write, see above     */
     uint8_t  dir:1;  /* 1=read, 0=write             */
     uint8_t  size:2; /* 0=>1, 1=>2, 2=>4, 3=>8. If 8, use two buf_ioreqs */
     uint32_t addr:20;/* physical address            */
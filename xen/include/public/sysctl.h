@@ -34,7 +34,7 @@
 #include "xen.h"
 #include "domctl.h"
 
-#define XEN_SYSCTL_INTERFACE_VERSION 0x0000000B
+#define XEN_SYSCTL_INTERFACE_VERSION 0x0000000C
 
 /*
  * Read console content from Xen buffer ring.
@@ -434,10 +434,26 @@ struct xen_sysctl_page_offline_op {
 /* Sub-operations: */
 #define XEN_SYSCTL_LOCKPROF_reset 1   /* Reset all profile data to zero. */
 #define XEN_SYSCTL_LOCKPROF_query 2   /* Get lock profile information. */
+#define XEN_SYSCTL_LOCKPROF_start 3   /* Reset and (re)start profiling. */
+#define XEN_SYSCTL_LOCKPROF_stop  4   /* Stop profiling, keeping the data. */
+#define XEN_SYSCTL_LOCKPROF_query_cpu 5 /* Get per-cpu wait information. */
 /* Record-type: */
 #define LOCKPROF_TYPE_GLOBAL      0   /* global lock, idx meaningless */
 #define LOCKPROF_TYPE_PERDOM      1   /* per-domain lock, idx is domid */
 #define LOCKPROF_TYPE_N           2   /* number of types */
+/*
+ * Wait and hold time histograms: bucket 0 counts times below 256ns, bucket
+ * i (0 < i < LOCKPROF_HIST_N - 1) times in [2^(i+7), 2^(i+8)) ns, and the
+ * last bucket all longer times.
+ */
+#define LOCKPROF_HIST_N          16
+#define LOCKPROF_SITES_N          4   /* call sites recorded per lock */
+struct xen_sysctl_lockprof_site {
+    uint64_aligned_t addr;         /* return address into the lock caller */
+    uint64_aligned_t block_cnt;    /* # of waits from this site */
+    uint64_aligned_t block_time;   /* nsecs waited from this site */
+};
+typedef struct xen_sysctl_lockprof_site xen_sysctl_lockprof_site_t;
 struct xen_sysctl_lockprof_data {
     char     name[40];     /* lock name (may include up to 2 %d specifiers) */
     int32_t  type;         /* LOCKPROF_TYPE_??? */
@@ -446,9 +462,19 @@ struct xen_sysctl_lockprof_data {
     uint64_aligned_t block_cnt;    /* # of wait for lock */
     uint64_aligned_t lock_time;    /* nsecs lock held */
     uint64_aligned_t block_time;   /* nsecs waited for lock */
+    uint64_aligned_t block_hist[LOCKPROF_HIST_N]; /* waits by duration */
+    uint64_aligned_t hold_hist[LOCKPROF_HIST_N];  /* holds by duration */
+    /* Call sites which waited longest, unused entries have addr 0. */
+    xen_sysctl_lockprof_site_t sites[LOCKPROF_SITES_N];
 };
 typedef struct xen_sysctl_lockprof_data xen_sysctl_lockprof_data_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lockprof_data_t);
+struct xen_sysctl_lockprof_cpu {
+    uint64_aligned_t block_cnt;    /* # of waits for any lock */
+    uint64_aligned_t block_time;   /* nsecs waited for any lock */
+};
+typedef struct xen_sysctl_lockprof_cpu xen_sysctl_lockprof_cpu_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lockprof_cpu_t);
 struct xen_sysctl_lockprof_op {
     /* IN variables. */
     uint32_t       cmd;               /* XEN_SYSCTL_LOCKPROF_??? */
@@ -458,6 +484,15 @@ struct xen_sysctl_lockprof_op {
     uint64_aligned_t time;            /* nsecs of profile measurement */
     /* profile information (or NULL) */
     XEN_GUEST_HANDLE_64(xen_sysctl_lockprof_data_t) data;
+    /*
+     * IN (start), OUT (query): only one in 2^sample_shift lock acquisitions
+     * on each cpu is profiled.
+     */
+    uint32_t       sample_shift;
+    /* IN (start): stop profiling after window_ms msecs, 0 for no limit. */
+    uint32_t       window_ms;
+    /* per-cpu information, indexed by cpu (query_cpu only, or NULL) */
+    XEN_GUEST_HANDLE_64(xen_sysctl_lockprof_cpu_t) cpu_data;
 };
 typedef struct xen_sysctl_lockprof_op xen_sysctl_lockprof_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lockprof_op_t);
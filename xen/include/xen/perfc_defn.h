@@ -51,6 +51,17 @@ PERFCOUNTER(migrate_running,        "csched: migrate_running")
 PERFCOUNTER(migrate_kicked_away,    "csched: migrate_kicked_away")
 PERFCOUNTER(vcpu_hot,               "csched: vcpu_hot")
 
+/* credit2 scheduler */
+PERFCOUNTER(csched2_steal,          "csched2: steal_work")
+
+/* RCU */
+PERFCOUNTER(rcu_offloaded,          "rcu: callbacks offloaded")
+PERFCOUNTER(rcu_batch_resched,      "rcu: batches cut short")
+
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
+PERFCOUNTER(scrub_idle_pages,       "pages scrubbed while idle")
+PERFCOUNTER(scrub_alloc_pages,      "pages scrubbed on allocation")
+PERFCOUNTER(page_cache_hits,        "pages allocated from per-CPU caches")
+PERFCOUNTER(page_cache_drains,      "per-CPU page cache drains")
 
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
@@ -86,6 +86,7 @@ struct evtchn
 #define ECS_PIRQ         4 /* Channel is bound to a physical IRQ line.       */
 #define ECS_VIRQ         5 /* Channel is bound to a virtual IRQ line.        */
 #define ECS_IPI          6 /* Channel is bound to a virtual IPI line.        */
+    spinlock_t lock;       /* Serialises sends against state changes. */
     u8  state;             /* ECS_* */
     u8  xen_consumer:XEN_CONSUMER_BITS; /* Consumer in Xen if nonzero */
     u8  pending:1;
@@ -249,6 +250,10 @@ struct vcpu
 
     struct evtchn_fifo_vcpu *evtchn_fifo;
 
+    /* Maptrack free list of this VCPU (see grant_table.c). */
+    spinlock_t       maptrack_freelist_lock;
+    unsigned int     maptrack_head;
+
     struct arch_vcpu arch;
 };
 
@@ -58,6 +58,12 @@ struct lock_debug { };
 
 struct spinlock;
 
+struct lock_profile_site {
+    void                *addr;       /* caller of the lock function */
+    u64                 block_cnt;   /* # of waits from there */
+    s64                 time_block;  /* cumulated wait time from there */
+};
+
 struct lock_profile {
     struct lock_profile *next;       /* forward link */
     char                *name;       /* lock name */
@@ -67,6 +73,9 @@ struct lock_profile {
     s64                 time_hold;   /* cumulated lock time */
     s64                 time_block;  /* cumulated wait time */
     s64                 time_locked; /* system time of last locking */
+    u64                 block_hist[LOCKPROF_HIST_N]; /* waits by duration */
+    u64                 hold_hist[LOCKPROF_HIST_N];  /* holds by duration */
+    struct lock_profile_site sites[LOCKPROF_SITES_N]; /* top waiters */
 };
 
 struct lock_profile_qhead {
@@ -75,7 +84,7 @@ struct lock_profile_qhead {
     int32_t                   idx;     /* index for printout */
 };
 
-#define _LOCK_PROFILE(name) { 0, #name, &name, 0, 0, 0, 0, 0 }
+#define _LOCK_PROFILE(l) { .name = #l, .lock = &l }
 #define _LOCK_PROFILE_PTR(name)                                               \
     static struct lock_profile *__lock_profile_##name                         \
     __used_section(".lockprofile.data") =                                     \